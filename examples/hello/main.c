@@ -53,7 +53,7 @@ static void initfunc (osjob_t* job) {
 
 // application entry point
 int main () {
-    osjob_t initjob;
+    osjob_t initjob = { 0 };  // jobs must start out zeroed
 
     // initialize runtime env
     os_init();
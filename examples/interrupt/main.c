@@ -85,7 +85,7 @@ static void initfunc (osjob_t* j) {
 
 // application entry point
 int main () {
-    osjob_t initjob;
+    osjob_t initjob = { 0 };  // jobs must start out zeroed
 
     // initialize runtime env
     os_init();
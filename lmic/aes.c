@@ -11,6 +11,18 @@
 
 #include "oslmic.h"
 
+#if !defined(CFG_aes_table)
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_NI 1
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#define AES_ARMV8 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 #define AES_MICSUB 0x30 // internal use only
 
 static const u4_t AES_RCON[10] = { 
@@ -204,16 +216,16 @@ u4_t AESAUX[16/sizeof(u4_t)];
 u4_t AESKEY[11*16/sizeof(u4_t)];
 
 // generate 1+10 roundkeys for encryption with 128-bit key
-// read 128-bit key from AESKEY in MSBF, generate roundkey words in place
-static void aesroundkeys () {
+// read 128-bit key in MSBF from the start of key, generate roundkey words in place
+static void aesroundkeys (u4_t* key) {
     int i;
     u4_t b;
 
     for( i=0; i<4; i++) {
-        AESKEY[i] = swapmsbf(AESKEY[i]);
+        key[i] = swapmsbf(key[i]);
     }
     
-    b = AESKEY[3];
+    b = key[3];
     for( ; i<44; i++ ) {
         if( i%4==0 ) {
             // b = SubWord(RotWord(b)) xor Rcon[i/4]
@@ -223,34 +235,74 @@ static void aesroundkeys () {
                 (AES_S[   b >> 24 ]      ) ^
                  AES_RCON[(i-4)/4];
         }
-        AESKEY[i] = b ^= AESKEY[i-4];
+        key[i] = b ^= key[i-4];
     }
 }
 
-u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
-        
-        aesroundkeys();
+static u4_t aesBlocks (u1_t mode, xref2u1_t buf, u2_t len, const u4_t* key, const u1_t* sk, u4_t* aux);
+
+// CMAC subkey K1 (n=1) or K2 (n=2) from L = E(0)
+static void cmacSubkey (u1_t* k, int n) {
+    while( n-- > 0 ) {
+        u1_t msb = k[0] >> 7;
+        for( u1_t i=0; i<15; i++ )
+            k[i] = (k[i] << 1) | (k[i+1] >> 7);
+        k[15] = (k[15] << 1) ^ (msb ? 0x87 : 0);
+    }
+}
+
+// everything of an expanded key derived from the round keys in rk
+static void keyDerive (os_aeskey_t* k) {
+    // byte order copy of the round keys for the AES instructions
+    for( int i=0; i<44; i++ )
+        msbf4_write(k->rkb+4*i, k->rk[i]);
+    // CMAC subkeys from L = E(0)
+    u4_t aux[4] = { 0 };
+    os_clearMem(k->sk[0], 16);
+    aesBlocks(AES_ENC, k->sk[0], 16, k->rk, NULL, aux);
+    os_copyMem(k->sk[1], k->sk[0], 16);
+    cmacSubkey(k->sk[0], 1);
+    cmacSubkey(k->sk[1], 2);
+}
+
+void os_aesKey (os_aeskey_t* k, xref2cu1_t key) {
+    os_copyMem(k->rk, key, 16);
+    aesroundkeys(k->rk);
+    keyDerive(k);
+}
+
+// run mode on buf with the round keys in key and the CMAC subkeys K1, K2 in
+// sk (NULL: compute them)
+static u4_t aesBlocks (u1_t mode, xref2u1_t buf, u2_t len, const u4_t* key, const u1_t* sk, u4_t* aux) {
 
         if( mode & AES_MICNOAUX ) {
-            AESAUX[0] = AESAUX[1] = AESAUX[2] = AESAUX[3] = 0;
+            aux[0] = aux[1] = aux[2] = aux[3] = 0;
         } else {
-            AESAUX[0] = swapmsbf(AESAUX[0]);
-            AESAUX[1] = swapmsbf(AESAUX[1]);
-            AESAUX[2] = swapmsbf(AESAUX[2]);
-            AESAUX[3] = swapmsbf(AESAUX[3]);
+            aux[0] = swapmsbf(aux[0]);
+            aux[1] = swapmsbf(aux[1]);
+            aux[2] = swapmsbf(aux[2]);
+            aux[3] = swapmsbf(aux[3]);
         }
 
-        while( (signed char)len > 0 ) {
+        while( (s2_t)len > 0 ) {
             u4_t a0, a1, a2, a3;
             u4_t t0, t1, t2, t3;
-            u4_t *ki, *ke;
+            const u4_t *ki, *ke;
 
             // load input block
             if( (mode & AES_CTR) || ((mode & AES_MIC) && (mode & AES_MICNOAUX)==0) ) { // load CTR block or first MIC block
-                a0 = AESAUX[0];
-                a1 = AESAUX[1];
-                a2 = AESAUX[2];
-                a3 = AESAUX[3];
+                a0 = aux[0];
+                a1 = aux[1];
+                a2 = aux[2];
+                a3 = aux[3];
+            }
+            else if( (mode & AES_MIC) && len <= 16 && sk ) { // last MIC block, subkey known
+                sk += (len == 16) ? 0 : 16;
+                aux[0] ^= (u4_t)msbf4_read(sk+0);
+                aux[1] ^= (u4_t)msbf4_read(sk+4);
+                aux[2] ^= (u4_t)msbf4_read(sk+8);
+                aux[3] ^= (u4_t)msbf4_read(sk+12);
+                goto LOADDATA;
             }
             else if( (mode & AES_MIC) && len <= 16 ) { // last MIC block
                 a0 = a1 = a2 = a3 = 0; // load null block
@@ -267,15 +319,15 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
                     }
                 } 
                 if( mode & AES_MIC ) {
-                    a0 ^= AESAUX[0];
-                    a1 ^= AESAUX[1];
-                    a2 ^= AESAUX[2];
-                    a3 ^= AESAUX[3];
+                    a0 ^= aux[0];
+                    a1 ^= aux[1];
+                    a2 ^= aux[2];
+                    a3 ^= aux[3];
                 }
             }
 
             // perform AES encryption on block in a0-a3
-            ki = AESKEY;
+            ki = key;
             ke = ki + 8*4;
             a0 ^= ki[0];
             a1 ^= ki[1];
@@ -319,18 +371,18 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
                         if( t0 ) a3 ^= 0x87;
                     } while( --t1 );
 
-                    AESAUX[0] ^= a0;
-                    AESAUX[1] ^= a1;
-                    AESAUX[2] ^= a2;
-                    AESAUX[3] ^= a3;
+                    aux[0] ^= a0;
+                    aux[1] ^= a1;
+                    aux[2] ^= a2;
+                    aux[3] ^= a3;
                     mode &= ~AES_MICSUB;
                     goto LOADDATA;
                 } else {
                     // save cipher block as new iv
-                    AESAUX[0] = a0;
-                    AESAUX[1] = a1;
-                    AESAUX[2] = a2;
-                    AESAUX[3] = a3;
+                    aux[0] = a0;
+                    aux[1] = a1;
+                    aux[2] = a2;
+                    aux[3] = a3;
                 }
             } else { // CIPHER
                 if( mode & AES_CTR ) { // xor block (partially)
@@ -345,7 +397,7 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
                         }
                     }
                     // update counter
-                    AESAUX[3]++;
+                    aux[3]++;
                 } else { // ECB
                     // store block
                     msbf4_write(buf+0,  a0);
@@ -362,6 +414,375 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
             }
             mode |= AES_MICNOAUX;
         }
-        return AESAUX[0];
+        return aux[0];
+}
+
+// ================================================================================
+// AES instructions
+// The block cipher runs on the CPU's AES instructions, the modes are done
+// here on byte blocks with the same results as aesBlocks(). Blocks are only
+// built with whole-block copies right before the kernels load them, which
+// keeps stores and the kernels' 16 byte loads from stalling each other.
+
+// encrypt n consecutive blocks in place
+typedef void (*aesenc_t) (u1_t* blk, int n, const os_aeskey_t* key);
+// CBC-MAC: x = E(x ^ data) for n consecutive data blocks
+typedef void (*aesmac_t) (u1_t* x, const u1_t* data, int n, const os_aeskey_t* key);
+// blk[i] = E(blk[i] ^ in[i]) for n blocks, each with its own key
+typedef void (*aesencx_t) (u1_t* const* blk, const u1_t* const* in, const os_aeskey_t* const* keys, int n);
+
+static const u1_t zeroBlock[16] = { 0 };
+
+// last CMAC block m (r bytes, 1..16), padded and xored with its subkey
+static void cmacLast (u1_t* last, const os_aeskey_t* key, const u1_t* m, int r) {
+    const u1_t* k = key->sk[r == 16 ? 0 : 1];
+    for( u1_t i=0; i<16; i++ )
+        last[i] = k[i] ^ (i < r ? m[i] : i == r ? 0x80 : 0x00);
+}
+
+static u4_t aesModes (u1_t mode, xref2u1_t buf, u2_t len, const os_aeskey_t* key, u4_t* aux,
+                      aesenc_t enc, aesmac_t mac) {
+    u1_t x[16];  // chaining or counter block
+    if( mode & AES_MICNOAUX )
+        os_clearMem(x, 16);
+    else
+        os_copyMem(x, aux, 16);
+
+    if( mode & AES_MIC ) {
+        if( len > 0 ) {
+            u1_t last[16];
+            int full = (len - 1) / 16;  // blocks before the last one
+            cmacLast(last, key, buf + 16*full, len - 16*full);
+            if( (mode & AES_MICNOAUX) == 0 )
+                enc(x, 1, key);  // B0
+            mac(x, buf, full, key);
+            mac(x, last, 1, key);
+        }
+    } else if( mode & AES_CTR ) {
+        u1_t ks[16*16];  // key stream of up to 16 blocks per call
+        while( len > 0 ) {
+            int n = len >= 16*16 ? 16 : (len + 15) / 16;
+            for( int b=0; b<n; b++ ) {
+                os_copyMem(ks+16*b, x, 16);
+                for( int i=15; i>=12 && ++x[i] == 0; i-- );  // 32 bit counter
+            }
+            enc(ks, n, key);
+            int m = len < 16*n ? len : 16*n, i = 0;
+            for( ; i+8 <= m; i += 8 ) {
+                u8_t a, b;
+                memcpy(&a, buf+i, 8);
+                memcpy(&b, ks+i, 8);
+                a ^= b;
+                memcpy(buf+i, &a, 8);
+            }
+            for( ; i<m; i++ )
+                buf[i] ^= ks[i];
+            buf += m;
+            len -= m;
+        }
+    } else { // ECB
+        int full = len / 16;
+        if( full > 0 )
+            enc(buf, full, key);
+        if( len % 16 ) {  // padded like a MIC block
+            u1_t* p = buf + 16*full;
+            for( u1_t i=len%16; i<16; i++ )
+                p[i] = i == len%16 ? 0x80 : 0x00;
+            enc(p, 1, key);
+        }
+    }
+    // leave the chaining block like aesBlocks() does
+    for( u1_t i=0; i<4; i++ )
+        aux[i] = msbf4_read(x+4*i);
+    return aux[0];
+}
+
+#if defined(AES_NI)
+#define NI_LOAD(p)    _mm_loadu_si128((const __m128i*)(p))
+#define NI_STORE(p,v) _mm_storeu_si128((__m128i*)(p), v)
+
+__attribute__((target("aes,sse2")))
+static void encAesNi (u1_t* blk, int n, const os_aeskey_t* key) {
+    __m128i rk[11];
+    for( int r=0; r<11; r++ )
+        rk[r] = NI_LOAD(key->rkb+16*r);
+    // four blocks at a time to keep the AES unit busy
+    for( ; n >= 4; n -= 4, blk += 64 ) {
+        __m128i b0 = _mm_xor_si128(NI_LOAD(blk+ 0), rk[0]);
+        __m128i b1 = _mm_xor_si128(NI_LOAD(blk+16), rk[0]);
+        __m128i b2 = _mm_xor_si128(NI_LOAD(blk+32), rk[0]);
+        __m128i b3 = _mm_xor_si128(NI_LOAD(blk+48), rk[0]);
+        for( int r=1; r<10; r++ ) {
+            b0 = _mm_aesenc_si128(b0, rk[r]);
+            b1 = _mm_aesenc_si128(b1, rk[r]);
+            b2 = _mm_aesenc_si128(b2, rk[r]);
+            b3 = _mm_aesenc_si128(b3, rk[r]);
+        }
+        NI_STORE(blk+ 0, _mm_aesenclast_si128(b0, rk[10]));
+        NI_STORE(blk+16, _mm_aesenclast_si128(b1, rk[10]));
+        NI_STORE(blk+32, _mm_aesenclast_si128(b2, rk[10]));
+        NI_STORE(blk+48, _mm_aesenclast_si128(b3, rk[10]));
+    }
+    for( ; n > 0; n--, blk += 16 ) {
+        __m128i b = _mm_xor_si128(NI_LOAD(blk), rk[0]);
+        for( int r=1; r<10; r++ )
+            b = _mm_aesenc_si128(b, rk[r]);
+        NI_STORE(blk, _mm_aesenclast_si128(b, rk[10]));
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void macAesNi (u1_t* x, const u1_t* data, int n, const os_aeskey_t* key) {
+    __m128i rk[11];
+    for( int r=0; r<11; r++ )
+        rk[r] = NI_LOAD(key->rkb+16*r);
+    __m128i b = NI_LOAD(x);
+    for( ; n > 0; n--, data += 16 ) {
+        b = _mm_xor_si128(b, _mm_xor_si128(NI_LOAD(data), rk[0]));
+        for( int r=1; r<10; r++ )
+            b = _mm_aesenc_si128(b, rk[r]);
+        b = _mm_aesenclast_si128(b, rk[10]);
+    }
+    NI_STORE(x, b);
+}
+
+__attribute__((target("aes,sse2")))
+static void encxAesNi (u1_t* const* blk, const u1_t* const* in, const os_aeskey_t* const* keys, int n) {
+    for( ; n >= 4; n -= 4, blk += 4, in += 4, keys += 4 ) {
+        const u1_t* k0 = keys[0]->rkb;
+        const u1_t* k1 = keys[1]->rkb;
+        const u1_t* k2 = keys[2]->rkb;
+        const u1_t* k3 = keys[3]->rkb;
+        __m128i b0 = _mm_xor_si128(_mm_xor_si128(NI_LOAD(blk[0]), NI_LOAD(in[0])), NI_LOAD(k0));
+        __m128i b1 = _mm_xor_si128(_mm_xor_si128(NI_LOAD(blk[1]), NI_LOAD(in[1])), NI_LOAD(k1));
+        __m128i b2 = _mm_xor_si128(_mm_xor_si128(NI_LOAD(blk[2]), NI_LOAD(in[2])), NI_LOAD(k2));
+        __m128i b3 = _mm_xor_si128(_mm_xor_si128(NI_LOAD(blk[3]), NI_LOAD(in[3])), NI_LOAD(k3));
+        for( int r=16; r<160; r+=16 ) {
+            b0 = _mm_aesenc_si128(b0, NI_LOAD(k0+r));
+            b1 = _mm_aesenc_si128(b1, NI_LOAD(k1+r));
+            b2 = _mm_aesenc_si128(b2, NI_LOAD(k2+r));
+            b3 = _mm_aesenc_si128(b3, NI_LOAD(k3+r));
+        }
+        NI_STORE(blk[0], _mm_aesenclast_si128(b0, NI_LOAD(k0+160)));
+        NI_STORE(blk[1], _mm_aesenclast_si128(b1, NI_LOAD(k1+160)));
+        NI_STORE(blk[2], _mm_aesenclast_si128(b2, NI_LOAD(k2+160)));
+        NI_STORE(blk[3], _mm_aesenclast_si128(b3, NI_LOAD(k3+160)));
+    }
+    for( ; n > 0; n--, blk++, in++, keys++ )
+        macAesNi(*blk, *in, 1, *keys);
+}
+
+static bit_t hasAesNi () {
+    return __builtin_cpu_supports("aes") != 0;
+}
+#endif // AES_NI
+
+#if defined(AES_ARMV8)
+__attribute__((target("+crypto")))
+static uint8x16_t armv8Block (uint8x16_t b, const uint8x16_t* rk) {
+    for( int r=0; r<9; r++ )
+        b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+    return veorq_u8(vaeseq_u8(b, rk[9]), rk[10]);
+}
+
+__attribute__((target("+crypto")))
+static void encArmv8 (u1_t* blk, int n, const os_aeskey_t* key) {
+    uint8x16_t rk[11];
+    for( int r=0; r<11; r++ )
+        rk[r] = vld1q_u8(key->rkb+16*r);
+    for( ; n > 0; n--, blk += 16 )
+        vst1q_u8(blk, armv8Block(vld1q_u8(blk), rk));
+}
+
+__attribute__((target("+crypto")))
+static void macArmv8 (u1_t* x, const u1_t* data, int n, const os_aeskey_t* key) {
+    uint8x16_t rk[11];
+    for( int r=0; r<11; r++ )
+        rk[r] = vld1q_u8(key->rkb+16*r);
+    uint8x16_t b = vld1q_u8(x);
+    for( ; n > 0; n--, data += 16 )
+        b = armv8Block(veorq_u8(b, vld1q_u8(data)), rk);
+    vst1q_u8(x, b);
+}
+
+static void encxArmv8 (u1_t* const* blk, const u1_t* const* in, const os_aeskey_t* const* keys, int n) {
+    for( int i=0; i<n; i++ )
+        macArmv8(blk[i], in[i], 1, keys[i]);
+}
+
+static bit_t hasArmv8 () {
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#endif // AES_ARMV8
+
+// ================================================================================
+// Dispatch
+
+static const struct aesimpl_t {
+    const char* name;
+    bit_t     (*avail) (void);  // CPU supports it (NULL: always)
+    aesenc_t    enc;            // block cipher (NULL: table code)
+    aesmac_t    mac;
+    aesencx_t   encx;
+} aesImpls[] = {
+#if defined(AES_NI)
+    { "aesni", hasAesNi, encAesNi, macAesNi, encxAesNi },
+#endif
+#if defined(AES_ARMV8)
+    { "armv8", hasArmv8, encArmv8, macArmv8, encxArmv8 },
+#endif
+    { "table", NULL, NULL, NULL, NULL },  // last: fallback
+};
+
+static const struct aesimpl_t* aesImpl;
+
+bit_t os_aesSelect (const char* name) {
+    for( u1_t i=0; i<sizeof(aesImpls)/sizeof(aesImpls[0]); i++ ) {
+        const struct aesimpl_t* impl = &aesImpls[i];
+        if( (name == NULL || strcmp(name, impl->name) == 0) &&
+            (impl->avail == NULL || impl->avail()) ) {
+            aesImpl = impl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char* os_aesBackend () {
+    if( aesImpl == NULL )
+        os_aesSelect(NULL);
+    return aesImpl->name;
+}
+
+u4_t os_aes_k (u1_t mode, xref2u1_t buf, u2_t len, const os_aeskey_t* key, u4_t* aux) {
+    if( aesImpl == NULL )
+        os_aesSelect(NULL);
+    if( aesImpl->enc )
+        return aesModes(mode, buf, len, key, aux, aesImpl->enc, aesImpl->mac);
+    return aesBlocks(mode, buf, len, key->rk, key->sk[0], aux);
+}
+
+u4_t os_aes_r (u1_t mode, xref2u1_t buf, u2_t len, u4_t* key, u4_t* aux) {
+    aesroundkeys(key);
+    if( aesImpl == NULL )
+        os_aesSelect(NULL);
+    if( aesImpl->enc ) {
+        os_aeskey_t k;
+        os_copyMem(k.rk, key, sizeof(k.rk));
+        keyDerive(&k);
+        return aesModes(mode, buf, len, &k, aux, aesImpl->enc, aesImpl->mac);
+    }
+    return aesBlocks(mode, buf, len, key, NULL, aux);
+}
+
+u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
+    return os_aes_r(mode, buf, len, AESKEY, AESAUX);
 }
 
+// ================================================================================
+// Batches
+// A MIC is one chain of dependent block encryptions, which leaves the AES unit
+// mostly idle. With AES instructions the MICs of a batch advance in lanes, one
+// block of every lane per step, so that independent chains overlap. CTR and
+// ECB frames are pipelined within the frame already and run one by one.
+
+enum { AES_LANES = 8 };
+
+struct aeslane_t {
+    os_aesjob_t* job;
+    const u1_t*  buf;
+    int          len;     // data left including the last block (0: done)
+    bit_t        b0;      // next step encrypts B0
+    u1_t         x[16];   // chaining block
+    u1_t         last[16];// last block, padded and xored with the subkey
+};
+
+static void laneInit (struct aeslane_t* l, os_aesjob_t* job) {
+    l->job = job;
+    l->buf = job->buf;
+    l->len = job->len;
+    l->b0  = (job->mode & AES_MICNOAUX) == 0;
+    if( l->b0 )
+        os_copyMem(l->x, job->aux, 16);
+    else
+        os_clearMem(l->x, 16);
+    if( l->len > 0 ) {
+        int full = (l->len - 1) / 16;
+        cmacLast(l->last, job->key, l->buf + 16*full, l->len - 16*full);
+    }
+}
+
+static void laneDone (struct aeslane_t* l) {
+    u4_t* aux = l->job->aux;
+    for( u1_t i=0; i<4; i++ )
+        aux[i] = msbf4_read(l->x+4*i);
+    l->job->res = aux[0];
+}
+
+// add the block of the next step, returns 0 if the MIC is done
+static bit_t laneIn (struct aeslane_t* l, u1_t** blk, const u1_t** in, const os_aeskey_t** keys) {
+    if( l->len == 0 )
+        return 0;
+    *keys = l->job->key;
+    *blk  = l->x;
+    *in   = l->b0 ? zeroBlock : l->len > 16 ? l->buf : l->last;
+    return 1;
+}
+
+static void laneOut (struct aeslane_t* l) {
+    if( l->b0 ) {
+        l->b0 = 0;
+    } else if( l->len > 16 ) {
+        l->buf += 16;
+        l->len -= 16;
+    } else {
+        l->len = 0;
+    }
+}
+
+// run the frames up to the next MIC and return it (NULL: none left)
+static os_aesjob_t* nextMic (os_aesjob_t* jobs, int n, int* next) {
+    while( *next < n ) {
+        os_aesjob_t* job = &jobs[(*next)++];
+        if( job->mode & AES_MIC )
+            return job;
+        job->res = aesModes(job->mode, job->buf, job->len, job->key, job->aux, aesImpl->enc, aesImpl->mac);
+    }
+    return NULL;
+}
+
+void os_aesBatch (os_aesjob_t* jobs, int n) {
+    if( aesImpl == NULL )
+        os_aesSelect(NULL);
+    if( aesImpl->encx == NULL ) {
+        // the table code gains nothing from interleaving
+        for( int i=0; i<n; i++ )
+            jobs[i].res = os_aes_k(jobs[i].mode, jobs[i].buf, jobs[i].len, jobs[i].key, jobs[i].aux);
+        return;
+    }
+    struct aeslane_t lanes[AES_LANES];
+    u1_t* blk[AES_LANES];
+    const u1_t* in[AES_LANES];
+    const os_aeskey_t* keys[AES_LANES];
+    os_aesjob_t* job;
+    int active = 0, next = 0;
+    while( active < AES_LANES && (job = nextMic(jobs, n, &next)) != NULL )
+        laneInit(&lanes[active++], job);
+    while( active > 0 ) {
+        for( int i=0; i<active; ) {
+            if( laneIn(&lanes[i], blk+i, in+i, keys+i) ) {
+                i++;
+                continue;
+            }
+            // MIC done, the lane takes the next one
+            laneDone(&lanes[i]);
+            if( (job = nextMic(jobs, n, &next)) != NULL )
+                laneInit(&lanes[i], job);
+            else
+                lanes[i] = lanes[--active];
+        }
+        aesImpl->encx(blk, in, keys, active);
+        for( int i=0; i<active; i++ )
+            laneOut(&lanes[i]);
+    }
+}
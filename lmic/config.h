@@ -5,6 +5,20 @@
 #define CFG_eu868 1
 //#define CFG_us915 1
 
+// cross-check radio register shadow against the chip every N radio operations
+//#define CFG_regverify 16
+
+// read DIO edges from the GPIO character device instead of wiringPiISR/polling
+//#define CFG_gpio_events 1
+
+// collect per-callback scheduler statistics (lateness, run time, queue depth)
+// and dump them to stderr every N seconds (0: only via os_dumpJobStats())
+//#define CFG_jobstats 60
+
+// use the portable table AES only, not AES-NI or ARMv8 crypto instructions
+// even if the CPU has them
+//#define CFG_aes_table 1
+
 #define US_PER_OSTICK 50
 //#define  OSTICKS_PER_SEC 20000
 
@@ -7,16 +7,35 @@
 #include <stdio.h>
 #include <time.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#ifdef CFG_gpio_events
+#include <fcntl.h>
+#include <linux/gpio.h>
+#endif
 
 
 int fd;
 
+static u8_t clock_ns (clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (u8_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 // -----------------------------------------------------------------------------
 // I/O
 
 static void hal_io_init () {
     wiringPiSetup();
-    pinMode(pins.nss, OUTPUT);
+    if (pins.nss != UNUSED_PIN) {
+        pinMode(pins.nss, OUTPUT);
+    }
     pinMode(pins.rxtx, OUTPUT);
     pinMode(pins.rst, OUTPUT);
     pinMode(pins.dio[0], INPUT);
@@ -40,39 +59,157 @@ void hal_pin_rst (u1_t val) {
     }
 }
 
+#ifdef CFG_gpio_events
+// DIO rising edges are read from the kernel GPIO character device.
+// Each line is requested as a non-blocking event fd, so edges are queued
+// by the kernel with a timestamp and no ISR thread is involved.
+#define GPIO_CHIP "/dev/gpiochip0"
+
+static int diofd[NUM_DIO];
+
+static void hal_dio_init () {
+    int chipfd = open(GPIO_CHIP, O_RDONLY);
+    if (chipfd < 0) {
+        fprintf(stderr, "%s: %s\n", GPIO_CHIP, strerror(errno));
+        hal_failed(__FILE__, __LINE__);
+    }
+    for (u1_t i = 0; i < NUM_DIO; ++i) {
+        struct gpioevent_request req;
+        memset(&req, 0, sizeof(req));
+        req.lineoffset = wpiPinToGpio(pins.dio[i]);
+        req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+        snprintf(req.consumer_label, sizeof(req.consumer_label), "lmic dio%d", i);
+        if (ioctl(chipfd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+            fprintf(stderr, "dio%d: %s\n", i, strerror(errno));
+            hal_failed(__FILE__, __LINE__);
+        }
+        fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+        diofd[i] = req.fd;
+    }
+    close(chipfd);
+}
+
+// convert kernel event timestamp (ns) into ticks
+static ostime_t hal_event_ticks (u8_t ts) {
+    // events are stamped with CLOCK_MONOTONIC since Linux 5.7 and with
+    // CLOCK_REALTIME before - take the clock that yields a plausible age
+    s8_t age = clock_ns(CLOCK_MONOTONIC) - ts;
+    s8_t rtage = clock_ns(CLOCK_REALTIME) - ts;
+    if (age < 0 || (rtage >= 0 && rtage < age)) {
+        age = rtage;
+    }
+    if (age < 0) {
+        age = 0;
+    }
+    return hal_ticks() - (ostime_t)(age / (1000*US_PER_OSTICK));
+}
+
+static void hal_io_check() {
+    struct gpioevent_data ev;
+    for (u1_t i = 0; i < NUM_DIO; ++i) {
+        // drain the queue, but report one edge per check (with the time
+        // of the first one) - the handler clears all radio IRQ flags
+        u8_t ts = 0;
+        while (read(diofd[i], &ev, sizeof(ev)) == sizeof(ev)) {
+            if (ev.id == GPIOEVENT_EVENT_RISING_EDGE && ts == 0) {
+                ts = ev.timestamp;
+            }
+        }
+        if (ts != 0) {
+            radio_irq_handler_at(i, hal_event_ticks(ts));
+        }
+    }
+}
+#else
 static bool dio_states[NUM_DIO] = {0};
 
+// set by the wiringPiISR threads: time of the last rising edge per DIO line
+// and a bit for each line that had one since the last check
+static u4_t isrticks[NUM_DIO];
+static u1_t isrseen;
+
 static void hal_io_check() {
     u1_t i;
+    u1_t seen = __atomic_exchange_n(&isrseen, 0, __ATOMIC_ACQUIRE);
     for (i = 0; i < NUM_DIO; ++i) {
         if (dio_states[i] != digitalRead(pins.dio[i])) {
             dio_states[i] = !dio_states[i];
             if (dio_states[i]) {
-                radio_irq_handler(i);
+                radio_irq_handler_at(i, (seen & (1 << i)) ? __atomic_load_n(&isrticks[i], __ATOMIC_RELAXED) : hal_ticks());
             }
         }
     }
 }
+#endif
 
 // -----------------------------------------------------------------------------
 // SPI
 //
+#define SPI_CHANNEL 0
+#define SPI_SPEED   10000000
+
 static int spifd;
 
 static void hal_spi_init () {
-    spifd = wiringPiSPISetup(0, 10000000);
+    spifd = wiringPiSPISetup(SPI_CHANNEL, SPI_SPEED);
 }
 
+// with nss == UNUSED_PIN the radio NSS is wired to the SPI CE line and the
+// spidev driver asserts it for the duration of each message
 void hal_pin_nss (u1_t val) {
-    digitalWrite(pins.nss, val);
+    if (pins.nss != UNUSED_PIN) {
+        digitalWrite(pins.nss, val);
+    }
 }
 
 // perform SPI transaction with radio
 u1_t hal_spi (u1_t out) {
-    u1_t res = wiringPiSPIDataRW(0, &out, 1);
+    u1_t res = wiringPiSPIDataRW(SPI_CHANNEL, &out, 1);
     return out;
 }
 
+// perform 2-byte register transaction with radio (one full-duplex message)
+u1_t hal_spi_reg (u1_t addr, u1_t data) {
+    u1_t buf[2] = { addr, data };
+    struct spi_ioc_transfer xfer;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.tx_buf = (unsigned long)buf;
+    xfer.rx_buf = (unsigned long)buf;
+    xfer.len = 2;
+    xfer.speed_hz = SPI_SPEED;
+    xfer.bits_per_word = 8;
+    if (ioctl(spifd, SPI_IOC_MESSAGE(1), &xfer) < 0) {
+        fprintf(stderr, "SPI transfer failed: %s\n", strerror(errno));
+        hal_failed(__FILE__, __LINE__);
+    }
+    return buf[1];
+}
+
+// perform SPI burst transaction with radio
+// (address byte and payload go out as one spidev message, so the whole
+// FIFO transfer costs a single ioctl instead of one per byte)
+void hal_spi_burst (u1_t addr, u1_t* buf, u1_t len, u1_t dir) {
+    struct spi_ioc_transfer xfer[2];
+    memset(xfer, 0, sizeof(xfer));
+    xfer[0].tx_buf = (unsigned long)&addr;
+    xfer[0].len = 1;
+    xfer[0].speed_hz = SPI_SPEED;
+    xfer[0].bits_per_word = 8;
+    if (dir) {
+        xfer[1].tx_buf = (unsigned long)buf;
+    } else {
+        xfer[1].rx_buf = (unsigned long)buf;
+    }
+    xfer[1].len = len;
+    xfer[1].speed_hz = SPI_SPEED;
+    xfer[1].bits_per_word = 8;
+    if (ioctl(spifd, SPI_IOC_MESSAGE(len ? 2 : 1), xfer) < 0) {
+        fprintf(stderr, "SPI burst failed: %s\n", strerror(errno));
+        hal_failed(__FILE__, __LINE__);
+    }
+}
+
 
 // -----------------------------------------------------------------------------
 // TIME
@@ -83,16 +220,26 @@ static void hal_time_init () {
     tstart.tv_nsec=0; //Makes difference calculations in hal_ticks() easier
 }
 
-u4_t hal_ticks (void) {
+u8_t hal_ticks64 (void) {
     // LMIC requires ticks to be 15.5μs - 100 μs long
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
     ts.tv_sec-=tstart.tv_sec;
     u8_t ticks=ts.tv_sec*(1000000/US_PER_OSTICK)+ts.tv_nsec/(1000*US_PER_OSTICK);
 //    fprintf(stderr, "%d hal_ticks()=%d\n", sizeof(time_t), ticks);
-    return (u4_t)ticks;
+    return ticks;
 }
 
+u4_t hal_ticks (void) {
+    return (u4_t)hal_ticks64();
+}
+
+#if defined(CFG_jobstats)
+u8_t hal_nanos (void) {
+    return clock_ns(CLOCK_MONOTONIC_RAW);
+}
+#endif
+
 // Returns the number of ticks until time.
 static u4_t delta_time(u4_t time) {
       u4_t t = hal_ticks( );
@@ -104,47 +251,136 @@ static u4_t delta_time(u4_t time) {
       }
 }
 
+// Wait until the target tick: sleep on an absolute CLOCK_MONOTONIC deadline
+// until shortly before it, then spin on CLOCK_MONOTONIC_RAW (the hal_ticks()
+// clock) for the rest. The sleep margin covers the wakeup latency measured in
+// hal_wait_calibrate().
+static s8_t wait_margin_ns;
+
 void hal_waitUntil (u4_t time) {
-    u4_t now=hal_ticks();
-    u4_t delta = delta_time(time);
-    //fprintf(stderr, "waitUntil(%d) delta=%d\n", time, delta);
-    s4_t t=time-now;
-    if (delta==0) return;
-    if (t>0) { 
-      //fprintf(stderr, "delay(%d)\n", t*US_PER_OSTICK/1000);
-      delay(t*US_PER_OSTICK/1000);
-      return;
+    u8_t nowraw = clock_ns(CLOCK_MONOTONIC_RAW);
+    u8_t base = (u8_t)tstart.tv_sec*1000000000;
+    u8_t now = (nowraw - base) / (1000*US_PER_OSTICK);
+    s4_t d = time - (u4_t)now;
+    if (d <= 0) {
+        return;
+    }
+    u8_t target = base + (now + d) * (1000*US_PER_OSTICK);
+    s8_t sleep_ns = (s8_t)(target - nowraw) - wait_margin_ns;
+    if (sleep_ns > 0) {
+        u8_t mono = clock_ns(CLOCK_MONOTONIC) + sleep_ns;
+        struct timespec ts;
+        ts.tv_sec = mono / 1000000000;
+        ts.tv_nsec = mono % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+    while (clock_ns(CLOCK_MONOTONIC_RAW) < target);
+}
+
+// measure how late clock_nanosleep() returns and keep the worst case (plus
+// some slack) as the spin tail of hal_waitUntil()
+static void hal_wait_calibrate () {
+    s8_t worst = 0;
+    for (int i = 0; i < 20; ++i) {
+        u8_t target = clock_ns(CLOCK_MONOTONIC) + 200000;
+        struct timespec ts;
+        ts.tv_sec = target / 1000000000;
+        ts.tv_nsec = target % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        s8_t late = clock_ns(CLOCK_MONOTONIC) - target;
+        if (late > worst) {
+            worst = late;
+        }
+    }
+    wait_margin_ns = worst + worst/2 + 20000;
+}
+
+// -----------------------------------------------------------------------------
+// SLEEP
+//
+// hal_sleep() blocks in epoll_wait() on a timerfd, which hal_checkTimer() arms
+// for the next scheduled job, on the DIO event fds (CFG_gpio_events) and on an
+// eventfd that hal_wakeup() signals from other threads (wiringPiISR threads,
+// producers posting jobs with os_postCallback()).
+
+static int epfd, tmrfd, wakefd;
+static u8_t start_ns, idle_ns;
+
+static void hal_sleep_add (int sfd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+}
+
+static void hal_sleep_init () {
+    epfd = epoll_create1(0);
+    tmrfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    wakefd = eventfd(0, EFD_NONBLOCK);
+    if (epfd < 0 || tmrfd < 0 || wakefd < 0) {
+        fprintf(stderr, "sleep init failed: %s\n", strerror(errno));
+        hal_failed(__FILE__, __LINE__);
     }
+    hal_sleep_add(tmrfd);
+    hal_sleep_add(wakefd);
+#ifdef CFG_gpio_events
+    for (u1_t i = 0; i < NUM_DIO; ++i) {
+        hal_sleep_add(diofd[i]);
+    }
+#endif
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+void hal_wakeup () {
+    u8_t one = 1;
+    write(wakefd, &one, sizeof(one));
 }
 
 // check and rewind for target time
 u1_t hal_checkTimer (u4_t time) {
-    // No need to schedule wakeup, since we're not sleeping
-//    fprintf(stderr, "hal_checkTimer(%d):%d (%d)\n", time,  delta_time(time), hal_ticks());
-    return delta_time(time) <= 0;
+    u4_t delta = delta_time(time);
+    if (delta == 0) {
+        return 1;
+    }
+    // wake up hal_sleep() when the target time is reached
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delta / (1000000/US_PER_OSTICK);
+    its.it_value.tv_nsec = (delta % (1000000/US_PER_OSTICK)) * US_PER_OSTICK * 1000;
+    timerfd_settime(tmrfd, 0, &its, NULL);
+    return 0;
+}
+
+void hal_cpuStats (u8_t* idle, u8_t* busy) {
+    u8_t total = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    *idle = idle_ns / 1000;
+    *busy = (total - idle_ns) / 1000;
 }
 
 static u8_t irqlevel = 0;
 
+#ifndef CFG_gpio_events
+// ISR threads must not touch OS or LMIC: they only note the time of the edge
+// and wake up the run loop, which picks the pin up in hal_io_check().
+static void hal_isr (u1_t dio) {
+    __atomic_store_n(&isrticks[dio], hal_ticks(), __ATOMIC_RELAXED);
+    __atomic_fetch_or(&isrseen, 1 << dio, __ATOMIC_RELEASE);
+    hal_wakeup();
+}
+
 void IRQ0(void) {
-//  fprintf(stderr, "IRQ0 %d\n", irqlevel);
-  if (irqlevel==0) {
-    radio_irq_handler(0);
-    return;
-  }
+    hal_isr(0);
 }
 
 void IRQ1(void) {
-  if (irqlevel==0){
-    radio_irq_handler(1);
-  }
+    hal_isr(1);
 }
 
 void IRQ2(void) {
-  if (irqlevel==0){
-    radio_irq_handler(2);
-  }
+    hal_isr(2);
 }
+#endif
 
 void hal_disableIRQs () {
 //    cli();
@@ -170,7 +406,14 @@ void hal_enableIRQs () {
   }
 
   void hal_sleep () {
-      // Not implemented
+      struct epoll_event evs[NUM_DIO+2];
+      u8_t t0 = clock_ns(CLOCK_MONOTONIC);
+      epoll_wait(epfd, evs, NUM_DIO+2, -1);
+      idle_ns += clock_ns(CLOCK_MONOTONIC) - t0;
+      // consume timer expiration and wakeup count (DIO events are read by hal_io_check)
+      u8_t cnt;
+      read(tmrfd, &cnt, sizeof(cnt));
+      read(wakefd, &cnt, sizeof(cnt));
   }
 
   void hal_failed (const char *file, u2_t line) {
@@ -187,9 +430,16 @@ void hal_init() {
     hal_spi_init();
     // configure timer and interrupt handler
     hal_time_init();
+    hal_wait_calibrate();
+#ifdef CFG_gpio_events
+    hal_dio_init();
+#endif
+    hal_sleep_init();
+#ifndef CFG_gpio_events
     wiringPiISR(pins.dio[0], INT_EDGE_RISING, IRQ0);
     wiringPiISR(pins.dio[1], INT_EDGE_RISING, IRQ1);
     wiringPiISR(pins.dio[2], INT_EDGE_RISING, IRQ2);
+#endif
 
   
 }
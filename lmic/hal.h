@@ -19,6 +19,7 @@ void hal_init (void);
 
 /*
  * drive radio NSS pin (0=low, 1=high).
+ *   - no-op if NSS is driven by the SPI controller (pins.nss == UNUSED_PIN)
  */
 void hal_pin_nss (u1_t val);
 
@@ -39,6 +40,21 @@ void hal_pin_rst (u1_t val);
  */
 u1_t hal_spi (u1_t outval);
 
+/*
+ * perform 2-byte SPI register transaction with radio.
+ *   - write address byte 'addr' and data byte 'data'
+ *   - return byte read during the data phase
+ */
+u1_t hal_spi_reg (u1_t addr, u1_t data);
+
+/*
+ * perform SPI burst transaction with radio.
+ *   - write address byte 'addr'
+ *   - dir=1: write 'len' bytes from 'buf'
+ *   - dir=0: read 'len' bytes into 'buf'
+ */
+void hal_spi_burst (u1_t addr, u1_t* buf, u1_t len, u1_t dir);
+
 /*
  * disable all CPU interrupts.
  *   - might be invoked nested 
@@ -56,11 +72,36 @@ void hal_enableIRQs (void);
  */
 void hal_sleep (void);
 
+/*
+ * wake up hal_sleep() from another thread.
+ *   - may be called from any thread at any time
+ *   - if hal_sleep() is not blocked, its next call returns immediately
+ */
+void hal_wakeup (void);
+
+/*
+ * return time spent sleeping in hal_sleep() (idle) and time spent
+ * otherwise (busy) since hal_init(), both in microseconds.
+ */
+void hal_cpuStats (u8_t* idle, u8_t* busy);
+
 /*
  * return 32-bit system time in ticks.
  */
 u4_t hal_ticks (void);
 
+/*
+ * return 64-bit system time in ticks (does not wrap).
+ */
+u8_t hal_ticks64 (void);
+
+#if defined(CFG_jobstats)
+/*
+ * return a monotonic timestamp in nanoseconds (used for profiling only).
+ */
+u8_t hal_nanos (void);
+#endif
+
 /*
  * busy-wait until specified timestamp (in ticks) is reached.
  */
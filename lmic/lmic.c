@@ -10,6 +10,7 @@
  *******************************************************************************/
 
 //! \file
+#include <stddef.h>
 #include "lmic.h"
 
 #if !defined(MINRX_SYMS)
@@ -45,10 +46,17 @@
 DEFINE_LMIC;
 DECL_ON_LMIC_EVENT;
 
+// Context of a job: the MAC runs on the context's osjob, the uplink queue on
+// its txqjob.
+#define jobCtx(job) ((lmic_ctx*)((u1_t*)(job) - offsetof(struct lmic_t, osjob)))
+#define txqCtx(job) ((lmic_ctx*)((u1_t*)(job) - offsetof(struct lmic_t, txqjob)))
+
 
 // Fwd decls.
-static void engineUpdate(void);
-static void startScan (void);
+static void engineUpdate(lmic_ctx* ctx);
+static void startScan (lmic_ctx* ctx);
+static void saveSession (lmic_ctx* ctx, bit_t durable);
+static void resetState (lmic_ctx* ctx);
 
 
 // ================================================================================
@@ -133,63 +141,89 @@ u2_t os_crc16 (xref2u1_t data, uint len) {
 // ================================================================================
 // BEG AES
 
-static void micB0 (u4_t devaddr, u4_t seqno, int dndir, int len) {
-    os_clearMem(AESaux,16);
-    AESaux[0]  = 0x49;
-    AESaux[5]  = dndir?1:0;
-    AESaux[15] = len;
-    os_wlsbf4(AESaux+ 6,devaddr);
-    os_wlsbf4(AESaux+10,seqno);
+// Every context has its own chaining block. Keys are expanded once when they
+// are installed (session keys) or first used (device key).
+#define ctxAesAux ((xref2u1_t)ctx->aesAux)
+
+static u4_t aes (lmic_ctx* ctx, const os_aeskey_t* key, u1_t mode, xref2u1_t buf, u2_t len) {
+    return os_aes_k(mode, buf, len, key, ctx->aesAux);
+}
+
+static const os_aeskey_t* devKey (lmic_ctx* ctx) {
+    if( !ctx->devRkOk ) {
+        u1_t key[16];
+        if( ctx->cfg.hasIdent )
+            os_copyMem(key, ctx->cfg.devKey, 16);
+        else
+            os_getDevKey(key);
+        os_aesKey(&ctx->devRk, key);
+        ctx->devRkOk = 1;
+    }
+    return &ctx->devRk;
+}
+
+// Expand the session keys and prepare the B0 blocks for devaddr
+static void setSessKeys (lmic_ctx* ctx) {
+    os_aesKey(&ctx->nwkRk, ctx->nwkKey);
+    os_aesKey(&ctx->artRk, ctx->artKey);
+    for( u1_t dndir=0; dndir<2; dndir++ ) {
+        u1_t* b0 = ctx->micB0[dndir];
+        os_clearMem(b0, 16);
+        b0[0] = 0x49;
+        b0[5] = dndir;
+        os_wlsbf4(b0+6, ctx->devaddr);
+    }
 }
 
 
-static int aes_verifyMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
-    micB0(devaddr, seqno, dndir, len);
-    os_copyMem(AESkey,key,16);
-    return os_aes(AES_MIC, pdu, len) == os_rmsbf4(pdu+len);
+static void micB0 (lmic_ctx* ctx, u4_t seqno, int dndir, int len) {
+    os_copyMem(ctxAesAux, ctx->micB0[dndir?1:0], 16);
+    os_wlsbf4(ctxAesAux+10,seqno);
+    ctxAesAux[15] = len;
 }
 
 
-static void aes_appendMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
-    micB0(devaddr, seqno, dndir, len);
-    os_copyMem(AESkey,key,16);
+static int aes_verifyMic (lmic_ctx* ctx, const os_aeskey_t* key, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
+    micB0(ctx, seqno, dndir, len);
+    return aes(ctx, key, AES_MIC, pdu, len) == os_rmsbf4(pdu+len);
+}
+
+
+static void aes_appendMic (lmic_ctx* ctx, const os_aeskey_t* key, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
+    micB0(ctx, seqno, dndir, len);
     // MSB because of internal structure of AES
-    os_wmsbf4(pdu+len, os_aes(AES_MIC, pdu, len));
+    os_wmsbf4(pdu+len, aes(ctx, key, AES_MIC, pdu, len));
 }
 
 
-static void aes_appendMic0 (xref2u1_t pdu, int len) {
-    os_getDevKey(AESkey);
-    os_wmsbf4(pdu+len, os_aes(AES_MIC|AES_MICNOAUX, pdu, len));  // MSB because of internal structure of AES
+static void aes_appendMic0 (lmic_ctx* ctx, xref2u1_t pdu, int len) {
+    os_wmsbf4(pdu+len, aes(ctx, devKey(ctx), AES_MIC|AES_MICNOAUX, pdu, len));  // MSB because of internal structure of AES
 }
 
 
-static int aes_verifyMic0 (xref2u1_t pdu, int len) {
-    os_getDevKey(AESkey);
-    return os_aes(AES_MIC|AES_MICNOAUX, pdu, len) == os_rmsbf4(pdu+len);
+static int aes_verifyMic0 (lmic_ctx* ctx, xref2u1_t pdu, int len) {
+    return aes(ctx, devKey(ctx), AES_MIC|AES_MICNOAUX, pdu, len) == os_rmsbf4(pdu+len);
 }
 
 
-static void aes_encrypt (xref2u1_t pdu, int len) {
-    os_getDevKey(AESkey);
-    os_aes(AES_ENC, pdu, len);
+static void aes_encrypt (lmic_ctx* ctx, xref2u1_t pdu, int len) {
+    aes(ctx, devKey(ctx), AES_ENC, pdu, len);
 }
 
 
-static void aes_cipher (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t payload, int len) {
+static void aes_cipher (lmic_ctx* ctx, const os_aeskey_t* key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t payload, int len) {
     if( len <= 0 )
         return;
-    os_clearMem(AESaux, 16);
-    AESaux[0] = AESaux[15] = 1; // mode=cipher / dir=down / block counter=1
-    AESaux[5] = dndir?1:0;
-    os_wlsbf4(AESaux+ 6,devaddr);
-    os_wlsbf4(AESaux+10,seqno);
-    os_copyMem(AESkey,key,16);
-    os_aes(AES_CTR, payload, len);
+    os_clearMem(ctxAesAux, 16);
+    ctxAesAux[0] = ctxAesAux[15] = 1; // mode=cipher / dir=down / block counter=1
+    ctxAesAux[5] = dndir?1:0;
+    os_wlsbf4(ctxAesAux+ 6,devaddr);
+    os_wlsbf4(ctxAesAux+10,seqno);
+    aes(ctx, key, AES_CTR, payload, len);
 }
 
 
-static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey, xref2u1_t artkey) {
+static void aes_sessKeys (lmic_ctx* ctx, u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey, xref2u1_t artkey) {
     os_clearMem(nwkkey, 16);
     nwkkey[0] = 0x01;
     os_copyMem(nwkkey+1, artnonce, LEN_ARTNONCE+LEN_NETID);
@@ -197,10 +231,8 @@ static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey,
     os_copyMem(artkey, nwkkey, 16);
     artkey[0] = 0x02;
 
-    os_getDevKey(AESkey);
-    os_aes(AES_ENC, nwkkey, 16);
-    os_getDevKey(AESkey);
-    os_aes(AES_ENC, artkey, 16);
+    aes(ctx, devKey(ctx), AES_ENC, nwkkey, 16);
+    aes(ctx, devKey(ctx), AES_ENC, artkey, 16);
 }
 
 // END AES
@@ -212,8 +244,10 @@ static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey,
 
 #if defined(CFG_eu868) // ========================================
 
-#define maxFrameLen(dr) ((dr)<=DR_SF9 ? maxFrameLens[(dr)] : 0xFF)
-const u1_t maxFrameLens [] = { 64,64,64,123 };
+// PHYPayload maxima (M+5, repeater compatible) - FSK is limited to what the
+// radio driver can put into the 64 byte FIFO in one go
+#define maxFrameLen(dr) ((dr)<=DR_FSK ? maxFrameLens[(dr)] : 0xFF)
+const u1_t maxFrameLens [] = { 64,64,64,128,235,235,235,64 };
 
 const u1_t _DR2RPS_CRC[] = {
     ILLEGAL_RPS,
@@ -235,8 +269,9 @@ static const s1_t TXPOWLEVELS[] = {
 
 #elif defined(CFG_us915) // ========================================
 
-#define maxFrameLen(dr) ((dr)<=DR_SF11CR ? maxFrameLens[(dr)] : 0xFF)
-const u1_t maxFrameLens [] = { 24,66,142,255,255,255,255,255,  66,142 };
+// PHYPayload maxima (M+5, repeater compatible)
+#define maxFrameLen(dr) ((dr)<=DR_SF7CR ? maxFrameLens[(dr)] : 0xFF)
+const u1_t maxFrameLens [] = { 24,66,138,235,235,0,0,0,  46,122,235,235,235,235 };  // DR5-7 RFU
 
 const u1_t _DR2RPS_CRC[] = {
     ILLEGAL_RPS,
@@ -277,19 +312,22 @@ int getSensitivity (rps_t rps) {
     return -141 + SENSITIVITY[getSf(rps)][getBw(rps)];
 }
 
-ostime_t calcAirTime (rps_t rps, u1_t plen) {
-    u1_t bw = getBw(rps);  // 0,1,2 = 125,250,500kHz
-    u1_t sf = getSf(rps);  // 0=FSK, 1..6 = SF7..12
+// LoRa airtime formula. With C++14 it also runs at compile time to fill
+// AIRTIME below, so it must stay free of side effects.
+#if __cplusplus >= 201402L
+constexpr
+#endif
+static ostime_t airTime (u1_t sf, u1_t bw, u1_t cr, int nocrc, int ih, u1_t plen) {
     if( sf == FSK ) {
         return (plen+/*preamble*/5+/*syncword*/3+/*len*/1+/*crc*/2) * /*bits/byte*/8
             * (s4_t)OSTICKS_PER_SEC / /*kbit/s*/50000;
     }
     u1_t sfx = 4*(sf+(7-SF7));
     u1_t q = sfx - (sf >= SF11 ? 8 : 0);
-    int tmp = 8*plen - sfx + 28 + (getNocrc(rps)?0:16) - (getIh(rps)?20:0);
+    int tmp = 8*plen - sfx + 28 + (nocrc?0:16) - (ih?20:0);
     if( tmp > 0 ) {
         tmp = (tmp + q - 1) / q;
-        tmp *= getCr(rps)+5;
+        tmp *= cr+5;
         tmp += 8;
     } else {
         tmp = 8;
@@ -315,6 +353,40 @@ ostime_t calcAirTime (rps_t rps, u1_t plen) {
     return (((ostime_t)tmp << sfx) * OSTICKS_PER_SEC + div/2) / div;
 }
 
+ostime_t calcAirTimeFormula (rps_t rps, u1_t plen) {
+    return airTime(getSf(rps), getBw(rps), getCr(rps), getNocrc(rps), getIh(rps), plen);
+}
+
+#if __cplusplus >= 201402L
+// Airtime of every LoRa frame with explicit header and CR 4/5 (all frames
+// LMIC sends or receives) - [nocrc][sf-SF7][bw][plen], 36kB.
+struct airtimetab_t {
+    ostime_t t[2][SF12-SF7+1][BW500+1][256];
+};
+
+static constexpr airtimetab_t makeAirtimeTab () {
+    airtimetab_t tab = {};
+    for( int nocrc=0; nocrc<2; nocrc++ )
+        for( int sf=SF7; sf<=SF12; sf++ )
+            for( int bw=BW125; bw<=BW500; bw++ )
+                for( int plen=0; plen<256; plen++ )
+                    tab.t[nocrc][sf-SF7][bw][plen] = airTime(sf, bw, CR_4_5, nocrc, 0, plen);
+    return tab;
+}
+
+static constexpr airtimetab_t AIRTIME = makeAirtimeTab();
+#endif
+
+ostime_t calcAirTime (rps_t rps, u1_t plen) {
+#if __cplusplus >= 201402L
+    u1_t sf = getSf(rps);
+    u1_t bw = getBw(rps);
+    if( sf != FSK && sf <= SF12 && bw <= BW500 && getCr(rps) == CR_4_5 && getIh(rps) == 0 )
+        return AIRTIME.t[getNocrc(rps)][sf-SF7][bw][plen];
+#endif
+    return calcAirTimeFormula(rps, plen);
+}
+
 extern inline rps_t updr2rps (dr_t dr);
 extern inline rps_t dndr2rps (dr_t dr);
 extern inline int isFasterDR (dr_t dr1, dr_t dr2);
@@ -387,58 +459,59 @@ static const ostime_t DR2HSYM_osticks[] = {
 };
 
 
-static ostime_t calcRxWindow (u1_t secs, dr_t dr) {
+static ostime_t calcRxWindow (lmic_ctx* ctx, u1_t secs, dr_t dr) {
     ostime_t rxoff, err;
     if( secs==0 ) {
         // aka 128 secs (next becaon)
-        rxoff = LMIC.drift;
-        err = LMIC.lastDriftDiff;
+        rxoff = ctx->drift;
+        err = ctx->lastDriftDiff;
     } else {
         // scheduled RX window within secs into current beacon period
-        rxoff = (LMIC.drift * (ostime_t)secs) >> BCN_INTV_exp;
-        err = (LMIC.lastDriftDiff * (ostime_t)secs) >> BCN_INTV_exp;
+        rxoff = (ctx->drift * (ostime_t)secs) >> BCN_INTV_exp;
+        err = (ctx->lastDriftDiff * (ostime_t)secs) >> BCN_INTV_exp;
     }
     u1_t rxsyms = MINRX_SYMS;
-    err += (ostime_t)LMIC.maxDriftDiff * LMIC.missedBcns;
-    LMIC.rxsyms = MINRX_SYMS + (err / dr2hsym(dr));
+    err += (ostime_t)ctx->maxDriftDiff * ctx->missedBcns;
+    ctx->rxsyms = MINRX_SYMS + (err / dr2hsym(dr));
 
     return (rxsyms-PAMBL_SYMS) * dr2hsym(dr) + rxoff;
 }
 
 
 // Setup beacon RX parameters assuming we have an error of ms (aka +/-(ms/2))
-static void calcBcnRxWindowFromMillis (u1_t ms, bit_t ini) {
+static void calcBcnRxWindowFromMillis (lmic_ctx* ctx, u1_t ms, bit_t ini) {
     if( ini ) {
-        LMIC.drift = 0;
-        LMIC.maxDriftDiff = 0;
-        LMIC.missedBcns = 0;
-        LMIC.bcninfo.flags |= BCN_NODRIFT|BCN_NODDIFF;
+        ctx->drift = 0;
+        ctx->maxDriftDiff = 0;
+        ctx->missedBcns = 0;
+        ctx->bcninfo.flags |= BCN_NODRIFT|BCN_NODDIFF;
     }
     ostime_t hsym = dr2hsym(DR_BCN);
-    LMIC.bcnRxsyms = MINRX_SYMS + ms2osticksCeil(ms) / hsym;
-    LMIC.bcnRxtime = LMIC.bcninfo.txtime + BCN_INTV_osticks - (LMIC.bcnRxsyms-PAMBL_SYMS) * hsym;
+    ctx->bcnRxsyms = MINRX_SYMS + ms2osticksCeil(ms) / hsym;
+    ctx->bcnRxtime = ctx->bcninfo.txtime + BCN_INTV_osticks - (ctx->bcnRxsyms-PAMBL_SYMS) * hsym;
 }
 
 
 // Setup scheduled RX window (ping/multicast slot)
-static void rxschedInit (xref2rxsched_t rxsched) {
-    os_clearMem(AESkey,16);
-    os_clearMem(LMIC.frame+8,8);
-    os_wlsbf4(LMIC.frame, LMIC.bcninfo.time);
-    os_wlsbf4(LMIC.frame+4, LMIC.devaddr);
-    os_aes(AES_ENC,LMIC.frame,16);
+static void rxschedInit (lmic_ctx* ctx, xref2rxsched_t rxsched) {
+    os_aeskey_t key0;
+    os_clearMem(ctx->frame,16);
+    os_aesKey(&key0, ctx->frame);  // all zero key
+    os_wlsbf4(ctx->frame, ctx->bcninfo.time);
+    os_wlsbf4(ctx->frame+4, ctx->devaddr);
+    aes(ctx, &key0, AES_ENC,ctx->frame,16);
     u1_t intvExp = rxsched->intvExp;
-    ostime_t off = os_rlsbf2(LMIC.frame) & (0x0FFF >> (7 - intvExp)); // random offset (slot units)
-    rxsched->rxbase = (LMIC.bcninfo.txtime +
+    ostime_t off = os_rlsbf2(ctx->frame) & (0x0FFF >> (7 - intvExp)); // random offset (slot units)
+    rxsched->rxbase = (ctx->bcninfo.txtime +
                        BCN_RESERVE_osticks +
                        ms2osticks(BCN_SLOT_SPAN_ms * off)); // random offset osticks
     rxsched->slot   = 0;
-    rxsched->rxtime = rxsched->rxbase - calcRxWindow(/*secs BCN_RESERVE*/2+(1<<intvExp),rxsched->dr);
-    rxsched->rxsyms = LMIC.rxsyms;
+    rxsched->rxtime = rxsched->rxbase - calcRxWindow(ctx, /*secs BCN_RESERVE*/2+(1<<intvExp),rxsched->dr);
+    rxsched->rxsyms = ctx->rxsyms;
 }
 
 
-static bit_t rxschedNext (xref2rxsched_t rxsched, ostime_t cando) {
+static bit_t rxschedNext (lmic_ctx* ctx, xref2rxsched_t rxsched, ostime_t cando) {
   again:
     if( rxsched->rxtime - cando >= 0 )
         return 1;
@@ -450,8 +523,8 @@ static bit_t rxschedNext (xref2rxsched_t rxsched, ostime_t cando) {
         return 0;
     rxsched->rxtime = rxsched->rxbase
         + ((BCN_WINDOW_osticks * (ostime_t)slot) >> BCN_INTV_exp)
-        - calcRxWindow(/*secs BCN_RESERVE*/2+slot+intv,rxsched->dr);
-    rxsched->rxsyms = LMIC.rxsyms;
+        - calcRxWindow(ctx, /*secs BCN_RESERVE*/2+slot+intv,rxsched->dr);
+    rxsched->rxsyms = ctx->rxsyms;
     goto again;
 }
 
@@ -467,58 +540,66 @@ static ostime_t rndDelay (u1_t secSpan) {
 }
 
 
-static void txDelay (ostime_t reftime, u1_t secSpan) {
-    reftime += rndDelay(secSpan);
-    if( LMIC.globalDutyRate == 0  ||  (reftime - LMIC.globalDutyAvail) > 0 ) {
-        LMIC.globalDutyAvail = reftime;
-        LMIC.opmode |= OP_RNDTX;
+// Duty cycle times are kept in 64 bits so they cannot alias into the future
+// once they are more than 2^31 ticks old. This gives the 32-bit view used by
+// the rest of the engine, clamped to now if it lies in the past.
+static ostime_t dutyTime (ostime64_t time) {
+    ostime64_t now = os_getTime64();
+    return (ostime_t)(time < now ? now : time);
+}
+
+static void txDelay (lmic_ctx* ctx, ostime_t reftime, u1_t secSpan) {
+    ostime64_t avail = os_extendTime(reftime + rndDelay(secSpan));
+    if( ctx->globalDutyRate == 0  ||  avail > ctx->globalDutyAvail ) {
+        ctx->globalDutyAvail = avail;
+        ctx->opmode |= OP_RNDTX;
     }
 }
 
 
-static void setDrJoin (u1_t reason, u1_t dr) {
+static void setDrJoin (lmic_ctx* ctx, u1_t reason, u1_t dr) {
     EV(drChange, INFO, (e_.reason    = reason,
                         e_.deveui    = MAIN::CDEV->getEui(),
                         e_.dr        = dr|DR_PAGE,
-                        e_.txpow     = LMIC.adrTxPow,
-                        e_.prevdr    = LMIC.datarate|DR_PAGE,
-                        e_.prevtxpow = LMIC.adrTxPow));
-    LMIC.datarate = dr;
-    DO_DEVDB(LMIC.datarate,datarate);
+                        e_.txpow     = ctx->adrTxPow,
+                        e_.prevdr    = ctx->datarate|DR_PAGE,
+                        e_.prevtxpow = ctx->adrTxPow));
+    ctx->datarate = dr;
+    DO_DEVDB(ctx->datarate,datarate);
 }
 
 
-static void setDrTxpow (u1_t reason, u1_t dr, s1_t pow) {
+static void setDrTxpow (lmic_ctx* ctx, u1_t reason, u1_t dr, s1_t pow) {
     EV(drChange, INFO, (e_.reason    = reason,
                         e_.deveui    = MAIN::CDEV->getEui(),
                         e_.dr        = dr|DR_PAGE,
                         e_.txpow     = pow,
-                        e_.prevdr    = LMIC.datarate|DR_PAGE,
-                        e_.prevtxpow = LMIC.adrTxPow));
+                        e_.prevdr    = ctx->datarate|DR_PAGE,
+                        e_.prevtxpow = ctx->adrTxPow));
     
     if( pow != KEEP_TXPOW )
-        LMIC.adrTxPow = pow;
-    if( LMIC.datarate != dr ) {
-        LMIC.datarate = dr;
-        DO_DEVDB(LMIC.datarate,datarate);
-        LMIC.opmode |= OP_NEXTCHNL;
+        ctx->adrTxPow = pow;
+    if( ctx->datarate != dr ) {
+        ctx->datarate = dr;
+        DO_DEVDB(ctx->datarate,datarate);
+        ctx->opmode |= OP_NEXTCHNL;
     }
 }
 
 
-void LMIC_stopPingable (void) {
-    LMIC.opmode &= ~(OP_PINGABLE|OP_PINGINI);
+void lmic_stopPingable (lmic_ctx* ctx) {
+    ctx->opmode &= ~(OP_PINGABLE|OP_PINGINI);
 }
 
 
-void LMIC_setPingable (u1_t intvExp) {
+void lmic_setPingable (lmic_ctx* ctx, u1_t intvExp) {
     // Change setting
-    LMIC.ping.intvExp = (intvExp & 0x7);
-    LMIC.opmode |= OP_PINGABLE;
-    // App may call LMIC_enableTracking() explicitely before
+    ctx->ping.intvExp = (intvExp & 0x7);
+    ctx->opmode |= OP_PINGABLE;
+    // App may call lmic_enableTracking(ctx) explicitely before
     // Otherwise tracking is implicitly enabled here
-    if( (LMIC.opmode & (OP_TRACK|OP_SCAN)) == 0  &&  LMIC.bcninfoTries == 0 )
-        LMIC_enableTracking(0);
+    if( (ctx->opmode & (OP_TRACK|OP_SCAN)) == 0  &&  ctx->bcninfoTries == 0 )
+        lmic_enableTracking(ctx, 0);
 }
 
 
@@ -545,48 +626,94 @@ static const u4_t iniChannelFreq[12] = {
     EU868_F9|BAND_CENTI
 };
 
-static void initDefaultChannels (bit_t join) {
-    os_clearMem(&LMIC.channelFreq, sizeof(LMIC.channelFreq));
-    os_clearMem(&LMIC.channelDrMap, sizeof(LMIC.channelDrMap));
-    os_clearMem(&LMIC.bands, sizeof(LMIC.bands));
+// Channel selection works on bitmaps: nextTx() intersects the enabled
+// channels with those of a band and a data rate and takes the first channel
+// after the band's last one, so the cost does not grow with the plan.
 
-    LMIC.channelMap = 0x1FF;
+static void chmapSet (u8_t* map, u1_t chnl) {
+    map[chnl>>6] |= (u8_t)1 << (chnl&63);
+}
+
+static void chmapClr (u8_t* map, u1_t chnl) {
+    map[chnl>>6] &= ~((u8_t)1 << (chnl&63));
+}
+
+// first channel in map after chnl (wrapping around), -1 if map is empty
+static int chmapNext (const u8_t* map, u1_t chnl) {
+    u1_t w = chnl>>6, b = chnl&63;
+    u8_t above = b == 63 ? 0 : map[w] & (~(u8_t)0 << (b+1));
+    if( above )
+        return (w<<6) + __builtin_ctzll(above);
+    for( u1_t k=1; k<=CHMAP_WORDS; k++ ) {
+        u1_t i = (w+k) % CHMAP_WORDS;
+        if( map[i] )
+            return (i<<6) + __builtin_ctzll(map[i]);
+    }
+    return -1;
+}
+
+// update the band and data rate bitmaps after channel chnl was (un)defined
+static void updateChannelMaps (lmic_ctx* ctx, u1_t chnl) {
+    for( u1_t b=0; b<MAX_BANDS; b++ )
+        chmapClr(ctx->bandChannels[b], chnl);
+    for( u1_t dr=0; dr<16; dr++ )
+        chmapClr(ctx->drChannels[dr], chnl);
+    if( ctx->channelFreq[chnl] == 0 )
+        return;
+    chmapSet(ctx->bandChannels[ctx->channelFreq[chnl] & 0x3], chnl);
+    for( u1_t dr=0; dr<16; dr++ ) {
+        if( ctx->channelDrMap[chnl] & (1<<dr) )
+            chmapSet(ctx->drChannels[dr], chnl);
+    }
+}
+
+static void initDefaultChannels (lmic_ctx* ctx, bit_t join) {
+    os_clearMem(&ctx->channelFreq, sizeof(ctx->channelFreq));
+    os_clearMem(&ctx->channelDrMap, sizeof(ctx->channelDrMap));
+    os_clearMem(&ctx->channelMap, sizeof(ctx->channelMap));
+    os_clearMem(&ctx->bandChannels, sizeof(ctx->bandChannels));
+    os_clearMem(&ctx->drChannels, sizeof(ctx->drChannels));
+    os_clearMem(&ctx->bands, sizeof(ctx->bands));
+
+    ctx->channelMap[0] = 0x1FF;
     u1_t su = join ? 0 : 3;
     u1_t num = join ? 3 : 9;
     for( u1_t fu=0; fu<num; fu++,su++ ) {
-        LMIC.channelFreq[fu]  = iniChannelFreq[su];
-        LMIC.channelDrMap[fu] = DR_RANGE_MAP(DR_SF12,DR_SF7);
+        ctx->channelFreq[fu]  = iniChannelFreq[su];
+        ctx->channelDrMap[fu] = DR_RANGE_MAP(DR_SF12,DR_SF7);
     }
     if( !join ) {
-        LMIC.channelDrMap[5] = 0x0080;  // FSK only! (todo: map this from DR_FSK)
-        LMIC.channelDrMap[1] = DR_RANGE_MAP(DR_SF12,DR_SF7B);
+        ctx->channelDrMap[5] = 0x0080;  // FSK only! (todo: map this from DR_FSK)
+        ctx->channelDrMap[1] = DR_RANGE_MAP(DR_SF12,DR_SF7B);
     }
-
-    LMIC.bands[BAND_MILLI].txcap    = 1000;  // 0.1%
-    LMIC.bands[BAND_MILLI].txpow    = 14;
-    LMIC.bands[BAND_MILLI].lastchnl = os_getRndU1() % MAX_CHANNELS;
-    LMIC.bands[BAND_CENTI].txcap    = 100;   // 1%
-    LMIC.bands[BAND_CENTI].txpow    = 14;
-    LMIC.bands[BAND_CENTI].lastchnl = os_getRndU1() % MAX_CHANNELS;
-    LMIC.bands[BAND_DECI ].txcap    = 10;    // 10%
-    LMIC.bands[BAND_DECI ].txpow    = 27;
-    LMIC.bands[BAND_DECI].lastchnl = os_getRndU1() % MAX_CHANNELS;
-    LMIC.bands[BAND_MILLI].avail = os_getTime();
-    LMIC.bands[BAND_CENTI].avail = os_getTime();
-    LMIC.bands[BAND_DECI ].avail = os_getTime();
-}
-
-bit_t LMIC_setupBand (u1_t bandidx, s1_t txpow, u2_t txcap) {
+    for( u1_t fu=0; fu<num; fu++ )
+        updateChannelMaps(ctx, fu);
+
+    ctx->bands[BAND_MILLI].txcap    = 1000;  // 0.1%
+    ctx->bands[BAND_MILLI].txpow    = 14;
+    ctx->bands[BAND_MILLI].lastchnl = os_getRndU1() % MAX_CHANNELS;
+    ctx->bands[BAND_CENTI].txcap    = 100;   // 1%
+    ctx->bands[BAND_CENTI].txpow    = 14;
+    ctx->bands[BAND_CENTI].lastchnl = os_getRndU1() % MAX_CHANNELS;
+    ctx->bands[BAND_DECI ].txcap    = 10;    // 10%
+    ctx->bands[BAND_DECI ].txpow    = 27;
+    ctx->bands[BAND_DECI].lastchnl = os_getRndU1() % MAX_CHANNELS;
+    ctx->bands[BAND_MILLI].avail = os_getTime64();
+    ctx->bands[BAND_CENTI].avail = os_getTime64();
+    ctx->bands[BAND_DECI ].avail = os_getTime64();
+}
+
+bit_t lmic_setupBand (lmic_ctx* ctx, u1_t bandidx, s1_t txpow, u2_t txcap) {
     if( bandidx > BAND_AUX ) return 0;
-    band_t* b = &LMIC.bands[bandidx];
+    band_t* b = &ctx->bands[bandidx];
     b->txpow = txpow;
     b->txcap = txcap;
-    b->avail = os_getTime();
+    b->avail = os_getTime64();
     b->lastchnl = os_getRndU1() % MAX_CHANNELS;
     return 1;
 }
 
-bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
+bit_t lmic_setupChannel (lmic_ctx* ctx, u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
     if( chidx >= MAX_CHANNELS )
         return 0;
     if( band == -1 ) {
@@ -601,16 +728,20 @@ bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
         if( band > BAND_AUX ) return 0;
         freq = (freq&~3) | band;
     }
-    LMIC.channelFreq [chidx] = freq;
-    LMIC.channelDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF12,DR_SF7) : drmap;
-    LMIC.channelMap |= 1<<chidx;  // enabled right away
+    ctx->channelFreq [chidx] = freq;
+    ctx->channelDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF12,DR_SF7) : drmap;
+    chmapSet(ctx->channelMap, chidx);  // enabled right away
+    updateChannelMaps(ctx, chidx);
     return 1;
 }
 
-void LMIC_disableChannel (u1_t channel) {
-    LMIC.channelFreq[channel] = 0;
-    LMIC.channelDrMap[channel] = 0;
-    LMIC.channelMap &= ~(1<<channel);
+void lmic_disableChannel (lmic_ctx* ctx, u1_t channel) {
+    if( channel >= MAX_CHANNELS )
+        return;
+    ctx->channelFreq[channel] = 0;
+    ctx->channelDrMap[channel] = 0;
+    chmapClr(ctx->channelMap, channel);
+    updateChannelMaps(ctx, channel);
 }
 
 static u4_t convFreq (xref2u1_t ptr) {
@@ -620,108 +751,160 @@ static u4_t convFreq (xref2u1_t ptr) {
     return freq;
 }
 
-static u1_t mapChannels (u1_t chpage, u2_t chmap) {
+// the network masks channels 0-15 (page 0), higher channels are kept
+static u1_t mapChannels (lmic_ctx* ctx, u1_t chpage, u2_t chmap) {
     // Bad page, disable all channel, enable non-existent
-    if( chpage != 0 || chmap==0 || (chmap & ~LMIC.channelMap) != 0 )
+    if( chpage != 0 || chmap==0 || (chmap & ~(u2_t)ctx->channelMap[0]) != 0 )
         return 0;  // illegal input
-    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ ) {
-        if( (chmap & (1<<chnl)) != 0 && LMIC.channelFreq[chnl] == 0 )
+    for( u1_t chnl=0; chnl<16; chnl++ ) {
+        if( (chmap & (1<<chnl)) != 0 && ctx->channelFreq[chnl] == 0 )
             chmap &= ~(1<<chnl); // ignore - channel is not defined
     }
-    LMIC.channelMap = chmap;
+    ctx->channelMap[0] = (ctx->channelMap[0] & ~(u8_t)0xFFFF) | chmap;
     return 1;
 }
 
 
-static void updateTx (ostime_t txbeg) {
-    u4_t freq = LMIC.channelFreq[LMIC.txChnl];
+// Airtime of a band over a sliding hour, counted in DUTY_SLOTS slots. The
+// oldest slot is counted in full, so the result errs on the high side.
+#define DUTY_SLOT_osticks (3600/DUTY_SLOTS*OSTICKS_PER_SEC)
+
+static void addBandAirtime (band_t* band, ostime64_t time, ostime_t airtime) {
+    u4_t slot = (u4_t)(time / DUTY_SLOT_osticks);
+    for( u4_t s=band->usedSlot+1; s<=slot && s-band->usedSlot<=DUTY_SLOTS; s++ )
+        band->used[s % DUTY_SLOTS] = 0;
+    if( slot > band->usedSlot )
+        band->usedSlot = slot;
+    band->used[slot % DUTY_SLOTS] += airtime;
+}
+
+static ostime_t bandAirtime (const band_t* band, ostime64_t now) {
+    u4_t slot = (u4_t)(now / DUTY_SLOT_osticks);
+    ostime_t sum = 0;
+    for( u1_t i=0; i<DUTY_SLOTS && i<=band->usedSlot; i++ ) {
+        if( slot - (band->usedSlot - i) < DUTY_SLOTS )
+            sum += band->used[(band->usedSlot - i) % DUTY_SLOTS];
+    }
+    return sum;
+}
+
+// Slots relative to the slot of now for the session store (used[i]: i slots
+// before now) and back. Time restarts with the process, so restored slots
+// are placed by the age of the copy; airtime older than the first slot of
+// the new time line goes into that slot and is counted too long rather than
+// too short.
+static void saveBandAirtime (const band_t* band, ostime64_t now, u4_t* used) {
+    u4_t slot = (u4_t)(now / DUTY_SLOT_osticks);
+    for( u1_t i=0; i<DUTY_SLOTS; i++ ) {
+        u4_t s = slot - i;
+        used[i] = i <= slot && s <= band->usedSlot && band->usedSlot - s < DUTY_SLOTS
+            ? (u4_t)band->used[s % DUTY_SLOTS] : 0;
+    }
+}
+
+static void restoreBandAirtime (band_t* band, ostime64_t now, ostime64_t age, const u4_t* used) {
+    u4_t slot = (u4_t)(now / DUTY_SLOT_osticks);
+    ostime64_t shift = age / DUTY_SLOT_osticks;
+    os_clearMem(band->used, sizeof(band->used));
+    band->usedSlot = slot;
+    for( u1_t i=0; i<DUTY_SLOTS; i++ ) {
+        if( used[i] == 0 || i + shift >= DUTY_SLOTS )
+            continue;
+        u4_t s = slot >= i + shift ? slot - (u4_t)(i + shift) : 0;
+        band->used[s % DUTY_SLOTS] += used[i];
+    }
+}
+
+static void updateTx (lmic_ctx* ctx, ostime_t txbeg) {
+    u4_t freq = ctx->channelFreq[ctx->txChnl];
     // Update global/band specific duty cycle stats
-    ostime_t airtime = calcAirTime(LMIC.rps, LMIC.dataLen);
+    ostime_t airtime = calcAirTime(ctx->rps, ctx->dataLen);
     // Update channel/global duty cycle stats
-    xref2band_t band = &LMIC.bands[freq & 0x3];
-    LMIC.freq  = freq & ~(u4_t)3;
-    LMIC.txpow = band->txpow;
-    band->avail = txbeg + airtime * band->txcap;
-    printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
-    if( LMIC.globalDutyRate != 0 )
-        LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
-}
-
-static ostime_t nextTx (ostime_t now) {
-    u1_t bmap=0xF;
-    do {
-        ostime_t mintime = now + /*10h*/36000*OSTICKS_PER_SEC;
-        u1_t band=0;
-        for( u1_t bi=0; bi<4; bi++ ) {
-            if( (bmap & (1<<bi)) && mintime - LMIC.bands[bi].avail > 0 )
-                mintime = LMIC.bands[band = bi].avail;
-        }
-        // Find next channel in given band
-        u1_t chnl = LMIC.bands[band].lastchnl;
-        for( u1_t ci=0; ci<MAX_CHANNELS; ci++ ) {
-            if( (chnl = (chnl+1)) >= MAX_CHANNELS )
-                chnl -=  MAX_CHANNELS;
-            if( (LMIC.channelMap & (1<<chnl)) != 0  &&  // channel enabled
-                (LMIC.channelDrMap[chnl] & (1<<(LMIC.datarate&0xF))) != 0  &&
-                band == (LMIC.channelFreq[chnl] & 0x3) ) { // in selected band
-                LMIC.txChnl = LMIC.bands[band].lastchnl = chnl;
-                return mintime;
-            }
-        }
-        if( (bmap &= ~(1<<band)) == 0 ) {
-            // No feasible channel  found!
-            return mintime;
-        }
-    } while(1);
+    xref2band_t band = &ctx->bands[freq & 0x3];
+    ctx->freq  = freq & ~(u4_t)3;
+    ctx->txpow = band->txpow;
+    band->avail = os_extendTime(txbeg) + airtime * band->txcap;
+    addBandAirtime(band, os_extendTime(txbeg), airtime);
+    printf("%lu: freq=%lu\n", os_getTime(), ctx->freq);
+    if( ctx->globalDutyRate != 0 )
+        ctx->globalDutyAvail = os_extendTime(txbeg) + (airtime<<ctx->globalDutyRate);
+}
+
+// Earliest available band with an enabled channel at the current data rate
+// (-1: none), cand receives the usable channels of every band.
+static int nextBand (lmic_ctx* ctx, u8_t cand[MAX_BANDS][CHMAP_WORDS]) {
+    const u8_t* drmap = ctx->drChannels[ctx->datarate&0xF];
+    int band = -1;
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ ) {
+        u8_t any = 0;
+        for( u1_t i=0; i<CHMAP_WORDS; i++ )
+            any |= cand[bi][i] = ctx->channelMap[i] & ctx->bandChannels[bi][i] & drmap[i];
+        if( any && (band < 0 || ctx->bands[bi].avail < ctx->bands[band].avail) )
+            band = bi;
+    }
+    return band;
 }
 
+static ostime_t nextTx (lmic_ctx* ctx, ostime_t now) {
+    u8_t cand[MAX_BANDS][CHMAP_WORDS];
+    int band = nextBand(ctx, cand);
+    ostime64_t mintime = os_extendTime(now) + /*10h*/36000*OSTICKS_PER_SEC;
+    if( band < 0 ) {
+        // No feasible channel  found!
+        return dutyTime(mintime);
+    }
+    if( mintime > ctx->bands[band].avail )
+        mintime = ctx->bands[band].avail;
+    // Next channel in given band
+    ctx->txChnl = ctx->bands[band].lastchnl = chmapNext(cand[band], ctx->bands[band].lastchnl);
+    return dutyTime(mintime);
+}
 
-static void setBcnRxParams (void) {
-    LMIC.dataLen = 0;
-    LMIC.freq = LMIC.channelFreq[LMIC.bcnChnl] & ~(u4_t)3;
-    LMIC.rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
+
+static void setBcnRxParams (lmic_ctx* ctx) {
+    ctx->dataLen = 0;
+    ctx->freq = ctx->channelFreq[ctx->bcnChnl] & ~(u4_t)3;
+    ctx->rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
 }
 
-#define setRx1Params() /*LMIC.freq/rps remain unchanged*/
+#define setRx1Params() /*ctx->freq/rps remain unchanged*/
 
-static void initJoinLoop (void) {
-    LMIC.txChnl = os_getRndU1() % 6;
-    LMIC.adrTxPow = 14;
-    setDrJoin(DRCHG_SET, DR_SF7);
-    initDefaultChannels(1);
-    ASSERT((LMIC.opmode & OP_NEXTCHNL)==0);
-    LMIC.txend = LMIC.bands[BAND_MILLI].avail + rndDelay(8);
+static void initJoinLoop (lmic_ctx* ctx) {
+    ctx->txChnl = os_getRndU1() % 6;
+    ctx->adrTxPow = 14;
+    setDrJoin(ctx, DRCHG_SET, DR_SF7);
+    initDefaultChannels(ctx, 1);
+    ASSERT((ctx->opmode & OP_NEXTCHNL)==0);
+    ctx->txend = dutyTime(ctx->bands[BAND_MILLI].avail) + rndDelay(8);
 }
 
 
-static ostime_t nextJoinState (void) {
+static ostime_t nextJoinState (lmic_ctx* ctx) {
     u1_t failed = 0;
 
     // Try 869.x and then 864.x with same DR
     // If both fail try next lower datarate
-    if( ++LMIC.txChnl == 6 )
-        LMIC.txChnl = 0;
-    if( (++LMIC.txCnt & 1) == 0 ) {
+    if( ++ctx->txChnl == 6 )
+        ctx->txChnl = 0;
+    if( (++ctx->txCnt & 1) == 0 ) {
         // Lower DR every 2nd try (having tried 868.x and 864.x with the same DR)
-        if( LMIC.datarate == DR_SF12 )
+        if( ctx->datarate == DR_SF12 )
             failed = 1; // we have tried all DR - signal EV_JOIN_FAILED
         else
-            setDrJoin(DRCHG_NOJACC, decDR((dr_t)LMIC.datarate));
+            setDrJoin(ctx, DRCHG_NOJACC, decDR((dr_t)ctx->datarate));
     }
     // Clear NEXTCHNL because join state engine controls channel hopping
-    LMIC.opmode &= ~OP_NEXTCHNL;
+    ctx->opmode &= ~OP_NEXTCHNL;
     // Move txend to randomize synchronized concurrent joins.
     // Duty cycle is based on txend.
-    ostime_t time = os_getTime();
-    if( time - LMIC.bands[BAND_MILLI].avail < 0 )
-        time = LMIC.bands[BAND_MILLI].avail;
-    LMIC.txend = time +
+    ostime_t time = dutyTime(ctx->bands[BAND_MILLI].avail);
+    ctx->txend = time +
         (isTESTMODE()
          // Avoid collision with JOIN ACCEPT @ SF12 being sent by GW (but we missed it)
          ? DNW2_SAFETY_ZONE
          // Otherwise: randomize join (street lamp case):
          // SF12:255, SF11:127, .., SF7:8secs
-         : DNW2_SAFETY_ZONE+rndDelay(255>>LMIC.datarate));
+         : DNW2_SAFETY_ZONE+rndDelay(255>>ctx->datarate));
     // 1 - triggers EV_JOIN_FAILED event
     return failed;
 }
@@ -737,10 +920,10 @@ static ostime_t nextJoinState (void) {
 //
 
 
-static void initDefaultChannels (void) {
+static void initDefaultChannels (lmic_ctx* ctx) {
     for( u1_t i=0; i<4; i++ )
-        LMIC.channelMap[i] = 0xFFFF;
-    LMIC.channelMap[4] = 0x00FF;
+        ctx->channelMap[i] = 0xFFFF;
+    ctx->channelMap[4] = 0x00FF;
 }
 
 static u4_t convFreq (xref2u1_t ptr) {
@@ -750,135 +933,143 @@ static u4_t convFreq (xref2u1_t ptr) {
     return freq;
 }
 
-bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
+bit_t lmic_setupChannel (lmic_ctx* ctx, u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
     if( chidx < 72 || chidx >= 72+MAX_XCHANNELS )
         return 0; // channels 0..71 are hardwired
     chidx -= 72;
-    LMIC.xchFreq[chidx] = freq;
-    LMIC.xchDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF10,DR_SF8C) : drmap;
-    LMIC.channelMap[chidx>>4] |= (1<<(chidx&0xF));
+    ctx->xchFreq[chidx] = freq;
+    ctx->xchDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF10,DR_SF8C) : drmap;
+    chidx += 72;
+    ctx->channelMap[chidx>>4] |= (1<<(chidx&0xF));
     return 1;
 }
 
-void LMIC_disableChannel (u1_t channel) {
+void lmic_disableChannel (lmic_ctx* ctx, u1_t channel) {
     if( channel < 72+MAX_XCHANNELS )
-        LMIC.channelMap[channel/4] &= ~(1<<(channel&0xF));
+        ctx->channelMap[channel>>4] &= ~(1<<(channel&0xF));
 }
 
-static u1_t mapChannels (u1_t chpage, u2_t chmap) {
+static u1_t mapChannels (lmic_ctx* ctx, u1_t chpage, u2_t chmap) {
     if( chpage == MCMD_LADR_CHP_125ON || chpage == MCMD_LADR_CHP_125OFF ) {
         u2_t en125 = chpage == MCMD_LADR_CHP_125ON ? 0xFFFF : 0x0000;
         for( u1_t u=0; u<4; u++ )
-            LMIC.channelMap[u] = en125;
-        LMIC.channelMap[64/16] = chmap;
+            ctx->channelMap[u] = en125;
+        ctx->channelMap[64/16] = chmap;
     } else {
         if( chpage >= (72+MAX_XCHANNELS+15)/16 )
             return 0;
-        LMIC.channelMap[chpage] = chmap;
+        ctx->channelMap[chpage] = chmap;
     }
     return 1;
 }
 
-static void updateTx (ostime_t txbeg) {
-    u1_t chnl = LMIC.txChnl;
+static void updateTx (lmic_ctx* ctx, ostime_t txbeg) {
+    u1_t chnl = ctx->txChnl;
     if( chnl < 64 ) {
-        //LMIC.freq = US915_125kHz_UPFBASE + chnl*US915_125kHz_UPFSTEP;
-        LMIC.freq = US915_125kHz_UPFBASE;
-        LMIC.txpow = 30;
-    	printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
+        //ctx->freq = US915_125kHz_UPFBASE + chnl*US915_125kHz_UPFSTEP;
+        ctx->freq = US915_125kHz_UPFBASE;
+        ctx->txpow = 30;
+    	printf("%lu: freq=%lu\n", os_getTime(), ctx->freq);
         return;
     }
-    LMIC.txpow = 26;
+    ctx->txpow = 26;
     if( chnl < 64+8 ) {
-        LMIC.freq = US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
+        ctx->freq = US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
     } else {
         ASSERT(chnl < 64+8+MAX_XCHANNELS);
-        LMIC.freq = LMIC.xchFreq[chnl-72];
+        ctx->freq = ctx->xchFreq[chnl-72];
     }
 
-    printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
+    printf("%lu: freq=%lu\n", os_getTime(), ctx->freq);
     // Update global duty cycle stats
-    if( LMIC.globalDutyRate != 0 ) {
-        ostime_t airtime = calcAirTime(LMIC.rps, LMIC.dataLen);
-        LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
+    if( ctx->globalDutyRate != 0 ) {
+        ostime_t airtime = calcAirTime(ctx->rps, ctx->dataLen);
+        ctx->globalDutyAvail = os_extendTime(txbeg) + (airtime<<ctx->globalDutyRate);
     }
 }
 
 // US does not have duty cycling - return now as earliest TX time
-#define nextTx(now) (_nextTx(),(now))
-static void _nextTx (void) {
-    if( LMIC.chRnd==0 )
-        LMIC.chRnd = os_getRndU1() & 0x3F;
-    if( LMIC.datarate >= DR_SF8C ) { // 500kHz
-        u1_t map = LMIC.channelMap[64/16]&0xFF;
-        for( u1_t i=0; i<8; i++ ) {
-            if( (map & (1<<(++LMIC.chRnd & 7))) != 0 ) {
-                LMIC.txChnl = 64 + (LMIC.chRnd & 7);
-                return;
-            }
+#define nextTx(ctx, now) (_nextTx(ctx),(now))
+// Round robin from chRnd+1: rotate the enabled channels so that this one is
+// bit 0, the distance to the next enabled channel is the trailing zero count.
+static void _nextTx (lmic_ctx* ctx) {
+    if( ctx->chRnd==0 )
+        ctx->chRnd = os_getRndU1() & 0x3F;
+    if( ctx->datarate >= DR_SF8C ) { // 500kHz
+        u1_t map = ctx->channelMap[64/16]&0xFF;
+        if( map ) {
+            u1_t s = (ctx->chRnd + 1) & 7;
+            u1_t rot = (u1_t)((map >> s) | (map << ((8-s) & 7)));
+            ctx->chRnd += 1 + __builtin_ctz(rot);
+            ctx->txChnl = 64 + (ctx->chRnd & 7);
+            return;
         }
+        ctx->chRnd += 8;
     } else { // 125kHz
-        for( u1_t i=0; i<64; i++ ) {
-            u1_t chnl = ++LMIC.chRnd & 0x3F;
-            if( (LMIC.channelMap[(chnl >> 4)] & (1<<(chnl & 0xF))) != 0 ) {
-                LMIC.txChnl = chnl;
-                return;
-            }
+        u8_t map = (u8_t)ctx->channelMap[0] | (u8_t)ctx->channelMap[1]<<16 |
+                   (u8_t)ctx->channelMap[2]<<32 | (u8_t)ctx->channelMap[3]<<48;
+        if( map ) {
+            u1_t s = (ctx->chRnd + 1) & 0x3F;
+            u8_t rot = s ? (map >> s) | (map << (64-s)) : map;
+            ctx->chRnd += 1 + __builtin_ctzll(rot);
+            ctx->txChnl = ctx->chRnd & 0x3F;
+            return;
         }
+        ctx->chRnd += 64;
     }
     // No feasible channel  found! Keep old one.
 }
 
-static void setBcnRxParams (void) {
-    LMIC.dataLen = 0;
-    LMIC.freq = US915_500kHz_DNFBASE + LMIC.bcnChnl * US915_500kHz_DNFSTEP;
-    LMIC.rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
+static void setBcnRxParams (lmic_ctx* ctx) {
+    ctx->dataLen = 0;
+    ctx->freq = US915_500kHz_DNFBASE + ctx->bcnChnl * US915_500kHz_DNFSTEP;
+    ctx->rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
 }
 
 #define setRx1Params() {                                                \
-    LMIC.freq = US915_500kHz_DNFBASE + (LMIC.txChnl & 0x7) * US915_500kHz_DNFSTEP; \
-    if( /* TX datarate */LMIC.dndr < DR_SF8C )                          \
-        LMIC.dndr += DR_SF10CR - DR_SF10;                               \
-    else if( LMIC.dndr == DR_SF8C )                                     \
-        LMIC.dndr = DR_SF7CR;                                           \
-    LMIC.rps = dndr2rps(LMIC.dndr);                                     \
+    ctx->freq = US915_500kHz_DNFBASE + (ctx->txChnl & 0x7) * US915_500kHz_DNFSTEP; \
+    if( /* TX datarate */ctx->dndr < DR_SF8C )                          \
+        ctx->dndr += DR_SF10CR - DR_SF10;                               \
+    else if( ctx->dndr == DR_SF8C )                                     \
+        ctx->dndr = DR_SF7CR;                                           \
+    ctx->rps = dndr2rps(ctx->dndr);                                     \
 }
 
-static void initJoinLoop (void) {
-    LMIC.chRnd = 0;
-    LMIC.txChnl = 0;
-    LMIC.adrTxPow = 20;
-    ASSERT((LMIC.opmode & OP_NEXTCHNL)==0);
-    LMIC.txend = os_getTime();
-    setDrJoin(DRCHG_SET, DR_SF7);
+static void initJoinLoop (lmic_ctx* ctx) {
+    ctx->chRnd = 0;
+    ctx->txChnl = 0;
+    ctx->adrTxPow = 20;
+    ASSERT((ctx->opmode & OP_NEXTCHNL)==0);
+    ctx->txend = os_getTime();
+    setDrJoin(ctx, DRCHG_SET, DR_SF7);
 }
 
-static ostime_t nextJoinState (void) {
+static ostime_t nextJoinState (lmic_ctx* ctx) {
     // Try the following:
     //   SF7/8/9/10  on a random channel 0..63
     //   SF8C        on a random channel 64..71
     //
     u1_t failed = 0;
-    if( LMIC.datarate != DR_SF8C ) {
-        LMIC.txChnl = 64+(LMIC.txChnl&7);
-        setDrJoin(DRCHG_SET, DR_SF8C);
+    if( ctx->datarate != DR_SF8C ) {
+        ctx->txChnl = 64+(ctx->txChnl&7);
+        setDrJoin(ctx, DRCHG_SET, DR_SF8C);
     } else {
-        LMIC.txChnl = os_getRndU1() & 0x3F;
-        s1_t dr = DR_SF7 - ++LMIC.txCnt;
+        ctx->txChnl = os_getRndU1() & 0x3F;
+        s1_t dr = DR_SF7 - ++ctx->txCnt;
         if( dr < DR_SF10 ) {
             dr = DR_SF10;
             failed = 1; // All DR exhausted - signal failed
         }
-        setDrJoin(DRCHG_SET, dr);
+        setDrJoin(ctx, DRCHG_SET, dr);
     }
-    LMIC.opmode &= ~OP_NEXTCHNL;
-    LMIC.txend = os_getTime() +
+    ctx->opmode &= ~OP_NEXTCHNL;
+    ctx->txend = os_getTime() +
         (isTESTMODE()
          // Avoid collision with JOIN ACCEPT being sent by GW (but we missed it - GW is still busy)
          ? DNW2_SAFETY_ZONE
          // Otherwise: randomize join (street lamp case):
          // SF10:16, SF9=8,..SF8C:1secs
-         : rndDelay(16>>LMIC.datarate));
+         : rndDelay(16>>ctx->datarate));
     // 1 - triggers EV_JOIN_FAILED event
     return failed;
 }
@@ -893,39 +1084,45 @@ static ostime_t nextJoinState (void) {
 
 
 static void runEngineUpdate (xref2osjob_t osjob) {
-    engineUpdate();
+    lmic_ctx* ctx = jobCtx(osjob);
+    engineUpdate(ctx);
 }
 
 
-static void reportEvent (ev_t ev) {
+static void reportEvent (lmic_ctx* ctx, ev_t ev) {
     EV(devCond, INFO, (e_.reason = EV::devCond_t::LMIC_EV,
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = ev));
-    ON_LMIC_EVENT(ev);
-    engineUpdate();
+    if( ctx->cfg.evcb )
+        ctx->cfg.evcb(ctx, ev);
+    else
+        ON_LMIC_EVENT(ev);
+    engineUpdate(ctx);
 }
 
 
 static void runReset (xref2osjob_t osjob) {
+    lmic_ctx* ctx = jobCtx(osjob);
     // Disable session
-    LMIC_reset();
-    LMIC_startJoining();
-    reportEvent(EV_RESET);
+    resetState(ctx);
+    saveSession(ctx, 0);
+    lmic_startJoining(ctx);
+    reportEvent(ctx, EV_RESET);
 }
 
-static void stateJustJoined (void) {
-    LMIC.seqnoDn     = LMIC.seqnoUp = 0;
-    LMIC.rejoinCnt   = 0;
-    LMIC.dnConf      = LMIC.adrChanged = LMIC.ladrAns = LMIC.devsAns = 0;
-    LMIC.moreData    = LMIC.dn2Ans = LMIC.snchAns = LMIC.dutyCapAns = 0;
-    LMIC.pingSetAns  = 0;
-    LMIC.upRepeat    = 0;
-    LMIC.adrAckReq   = LINK_CHECK_INIT;
-    LMIC.dn2Dr       = DR_DNW2;
-    LMIC.dn2Freq     = FREQ_DNW2;
-    LMIC.bcnChnl     = CHNL_BCN;
-    LMIC.ping.freq   = FREQ_PING;
-    LMIC.ping.dr     = DR_PING;
+static void stateJustJoined (lmic_ctx* ctx) {
+    ctx->seqnoDn     = ctx->seqnoUp = ctx->seqnoUpLimit = 0;
+    ctx->rejoinCnt   = 0;
+    ctx->dnConf      = ctx->adrChanged = ctx->ladrAns = ctx->devsAns = 0;
+    ctx->moreData    = ctx->dn2Ans = ctx->snchAns = ctx->dutyCapAns = 0;
+    ctx->pingSetAns  = 0;
+    ctx->upRepeat    = 0;
+    ctx->adrAckReq   = LINK_CHECK_INIT;
+    ctx->dn2Dr       = DR_DNW2;
+    ctx->dn2Freq     = FREQ_DNW2;
+    ctx->bcnChnl     = CHNL_BCN;
+    ctx->ping.freq   = FREQ_PING;
+    ctx->ping.dr     = DR_PING;
 }
 
 
@@ -934,9 +1131,9 @@ static void stateJustJoined (void) {
 
 
 // Decode beacon  - do not overwrite bcninfo unless we have a match!
-static int decodeBeacon (void) {
-    ASSERT(LMIC.dataLen == LEN_BCN); // implicit header RX guarantees this
-    xref2u1_t d = LMIC.frame;
+static int decodeBeacon (lmic_ctx* ctx) {
+    ASSERT(ctx->dataLen == LEN_BCN); // implicit header RX guarantees this
+    xref2u1_t d = ctx->frame;
     if(
 #if CFG_eu868
         d[OFF_BCN_CRC1] != (u1_t)os_crc16(d,OFF_BCN_CRC1)
@@ -947,34 +1144,34 @@ static int decodeBeacon (void) {
         return 0;   // first (common) part fails CRC check
     // First set of fields is ok
     u4_t bcnnetid = os_rlsbf4(&d[OFF_BCN_NETID]) & 0xFFFFFF;
-    if( bcnnetid != LMIC.netid )
+    if( bcnnetid != ctx->netid )
         return -1;  // not the beacon we're looking for
 
-    LMIC.bcninfo.flags &= ~(BCN_PARTIAL|BCN_FULL);
+    ctx->bcninfo.flags &= ~(BCN_PARTIAL|BCN_FULL);
     // Match - update bcninfo structure
-    LMIC.bcninfo.snr    = LMIC.snr;
-    LMIC.bcninfo.rssi   = LMIC.rssi;
-    LMIC.bcninfo.txtime = LMIC.rxtime - AIRTIME_BCN_osticks;
-    LMIC.bcninfo.time   = os_rlsbf4(&d[OFF_BCN_TIME]);
-    LMIC.bcninfo.flags |= BCN_PARTIAL;
+    ctx->bcninfo.snr    = ctx->snr;
+    ctx->bcninfo.rssi   = ctx->rssi;
+    ctx->bcninfo.txtime = ctx->rxtime - AIRTIME_BCN_osticks;
+    ctx->bcninfo.time   = os_rlsbf4(&d[OFF_BCN_TIME]);
+    ctx->bcninfo.flags |= BCN_PARTIAL;
 
     // Check 2nd set
     if( os_rlsbf2(&d[OFF_BCN_CRC2]) != os_crc16(d,OFF_BCN_CRC2) )
         return 1;
     // Second set of fields is ok
-    LMIC.bcninfo.lat    = (s4_t)os_rlsbf4(&d[OFF_BCN_LAT-1]) >> 8; // read as signed 24-bit
-    LMIC.bcninfo.lon    = (s4_t)os_rlsbf4(&d[OFF_BCN_LON-1]) >> 8; // ditto
-    LMIC.bcninfo.info   = d[OFF_BCN_INFO];
-    LMIC.bcninfo.flags |= BCN_FULL;
+    ctx->bcninfo.lat    = (s4_t)os_rlsbf4(&d[OFF_BCN_LAT-1]) >> 8; // read as signed 24-bit
+    ctx->bcninfo.lon    = (s4_t)os_rlsbf4(&d[OFF_BCN_LON-1]) >> 8; // ditto
+    ctx->bcninfo.info   = d[OFF_BCN_INFO];
+    ctx->bcninfo.flags |= BCN_FULL;
     return 2;
 }
 
 
-static bit_t decodeFrame (void) {
-    xref2u1_t d = LMIC.frame;
+static bit_t decodeFrame (lmic_ctx* ctx) {
+    xref2u1_t d = ctx->frame;
     u1_t hdr    = d[0];
     u1_t ftype  = hdr & HDR_FTYPE;
-    int  dlen   = LMIC.dataLen;
+    int  dlen   = ctx->dataLen;
     if( dlen < OFF_DAT_OPTS+4 ||
         (hdr & HDR_MAJOR) != HDR_MAJOR_V1 ||
         (ftype != HDR_FTYPE_DADN  &&  ftype != HDR_FTYPE_DCDN) ) {
@@ -984,7 +1181,7 @@ static bit_t decodeFrame (void) {
                             e_.info   = dlen < 4 ? 0 : os_rlsbf4(&d[dlen-4]),
                             e_.info2  = hdr + (dlen<<8)));
       norx:
-        LMIC.dataLen = 0;
+        ctx->dataLen = 0;
         return 0;
     }
     // Validate exact frame length
@@ -997,11 +1194,11 @@ static bit_t decodeFrame (void) {
     int  poff  = OFF_DAT_OPTS+olen;
     int  pend  = dlen-4;  // MIC
 
-    if( addr != LMIC.devaddr ) {
+    if( addr != ctx->devaddr ) {
         EV(specCond, WARN, (e_.reason = EV::specCond_t::ALIEN_ADDRESS,
                             e_.eui    = MAIN::CDEV->getEui(),
                             e_.info   = addr,
-                            e_.info2  = LMIC.devaddr));
+                            e_.info2  = ctx->devaddr));
         goto norx;
     }
     if( poff > pend ) {
@@ -1017,28 +1214,28 @@ static bit_t decodeFrame (void) {
     if( pend > poff )
         port = d[poff++];
 
-    seqno = LMIC.seqnoDn + (u2_t)(seqno - LMIC.seqnoDn);
+    seqno = ctx->seqnoDn + (u2_t)(seqno - ctx->seqnoDn);
 
-    if( !aes_verifyMic(LMIC.nwkKey, LMIC.devaddr, seqno, /*dn*/1, d, pend) ) {
+    if( !aes_verifyMic(ctx, &ctx->nwkRk, seqno, /*dn*/1, d, pend) ) {
         EV(spe3Cond, ERR, (e_.reason = EV::spe3Cond_t::CORRUPTED_MIC,
                            e_.eui1   = MAIN::CDEV->getEui(),
                            e_.info1  = Base::lsbf4(&d[pend]),
                            e_.info2  = seqno,
-                           e_.info3  = LMIC.devaddr));
+                           e_.info3  = ctx->devaddr));
         goto norx;
     }
-    if( seqno < LMIC.seqnoDn ) {
-        if( (s4_t)seqno > (s4_t)LMIC.seqnoDn ) {
+    if( seqno < ctx->seqnoDn ) {
+        if( (s4_t)seqno > (s4_t)ctx->seqnoDn ) {
             EV(specCond, INFO, (e_.reason = EV::specCond_t::DNSEQNO_ROLL_OVER,
                                 e_.eui    = MAIN::CDEV->getEui(),
-                                e_.info   = LMIC.seqnoDn, 
+                                e_.info   = ctx->seqnoDn, 
                                 e_.info2  = seqno));
             goto norx;
         }
-        if( seqno != LMIC.seqnoDn-1 || !LMIC.dnConf || ftype != HDR_FTYPE_DCDN ) {
+        if( seqno != ctx->seqnoDn-1 || !ctx->dnConf || ftype != HDR_FTYPE_DCDN ) {
             EV(specCond, INFO, (e_.reason = EV::specCond_t::DNSEQNO_OBSOLETE,
                                 e_.eui    = MAIN::CDEV->getEui(),
-                                e_.info   = LMIC.seqnoDn, 
+                                e_.info   = ctx->seqnoDn, 
                                 e_.info2  = seqno));
             goto norx;
         }
@@ -1047,29 +1244,29 @@ static bit_t decodeFrame (void) {
         replayConf = 1;
     }
     else {
-        if( seqno > LMIC.seqnoDn ) {
+        if( seqno > ctx->seqnoDn ) {
             EV(specCond, INFO, (e_.reason = EV::specCond_t::DNSEQNO_SKIP,
                                 e_.eui    = MAIN::CDEV->getEui(),
-                                e_.info   = LMIC.seqnoDn, 
+                                e_.info   = ctx->seqnoDn, 
                                 e_.info2  = seqno));
         }
-        LMIC.seqnoDn = seqno+1;  // next number to be expected
-        DO_DEVDB(LMIC.seqnoDn,seqnoDn);
+        ctx->seqnoDn = seqno+1;  // next number to be expected
+        DO_DEVDB(ctx->seqnoDn,seqnoDn);
         // DN frame requested confirmation - provide ACK once with next UP frame
-        LMIC.dnConf = (ftype == HDR_FTYPE_DCDN ? FCT_ACK : 0);
+        ctx->dnConf = (ftype == HDR_FTYPE_DCDN ? FCT_ACK : 0);
     }
 
-    if( LMIC.dnConf || (fct & FCT_MORE) )
-        LMIC.opmode |= OP_POLL;
+    if( ctx->dnConf || (fct & FCT_MORE) )
+        ctx->opmode |= OP_POLL;
 
     // We heard from network
-    LMIC.adrChanged = LMIC.rejoinCnt = 0;
-    if( LMIC.adrAckReq != LINK_CHECK_OFF )
-        LMIC.adrAckReq = LINK_CHECK_INIT;
+    ctx->adrChanged = ctx->rejoinCnt = 0;
+    if( ctx->adrAckReq != LINK_CHECK_OFF )
+        ctx->adrAckReq = LINK_CHECK_INIT;
 
     // Process OPTS
-    int m = LMIC.rssi - RSSI_OFF - getSensitivity(LMIC.rps);
-    LMIC.margin = m < 0 ? 0 : m > 254 ? 254 : m;
+    int m = ctx->rssi - RSSI_OFF - getSensitivity(ctx->rps);
+    ctx->margin = m < 0 ? 0 : m > 254 ? 254 : m;
 
     xref2u1_t opts = &d[OFF_DAT_OPTS];
     int oidx = 0;
@@ -1088,28 +1285,28 @@ static bit_t decodeFrame (void) {
             u1_t uprpt  = opts[oidx+4] & MCMD_LADR_REPEAT_MASK;     // up repeat count
             oidx += 5;
 
-            LMIC.ladrAns = 0x80 |     // Include an answer into next frame up
+            ctx->ladrAns = 0x80 |     // Include an answer into next frame up
                 MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
-            if( !mapChannels(chpage, chmap) )
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_CHACK;
+            if( !mapChannels(ctx, chpage, chmap) )
+                ctx->ladrAns &= ~MCMD_LADR_ANS_CHACK;
             dr_t dr = (dr_t)(p1>>MCMD_LADR_DR_SHIFT);
             if( !validDR(dr) ) {
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_DRACK;
+                ctx->ladrAns &= ~MCMD_LADR_ANS_DRACK;
                 EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
                                    e_.eui    = MAIN::CDEV->getEui(),
                                    e_.info   = Base::lsbf4(&d[pend]),
                                    e_.info2  = Base::msbf4(&opts[oidx-4])));
             }
-            if( (LMIC.ladrAns & 0x7F) == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
+            if( (ctx->ladrAns & 0x7F) == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
                 // Nothing went wrong - use settings
-                LMIC.upRepeat = uprpt;
-                setDrTxpow(DRCHG_NWKCMD, dr, pow2dBm(p1));
+                ctx->upRepeat = uprpt;
+                setDrTxpow(ctx, DRCHG_NWKCMD, dr, pow2dBm(p1));
             }
-            LMIC.adrChanged = 1;  // Trigger an ACK to NWK
+            ctx->adrChanged = 1;  // Trigger an ACK to NWK
             continue;
         }
         case MCMD_DEVS_REQ: {
-            LMIC.devsAns = 1;
+            ctx->devsAns = 1;
             oidx += 1;
             continue;
         }
@@ -1117,16 +1314,16 @@ static bit_t decodeFrame (void) {
             dr_t dr = (dr_t)(opts[oidx+1] & 0x0F);
             u4_t freq = convFreq(&opts[oidx+2]);
             oidx += 5;
-            LMIC.dn2Ans = 0x80;   // answer pending
+            ctx->dn2Ans = 0x80;   // answer pending
             if( validDR(dr) )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_DRACK;
+                ctx->dn2Ans |= MCMD_DN2P_ANS_DRACK;
             if( freq != 0 )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_CHACK;
-            if( LMIC.dn2Ans == (0x80|MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
-                LMIC.dn2Dr = dr;
-                LMIC.dn2Freq = freq;
-                DO_DEVDB(LMIC.dn2Dr,dn2Dr);
-                DO_DEVDB(LMIC.dn2Freq,dn2Freq);
+                ctx->dn2Ans |= MCMD_DN2P_ANS_CHACK;
+            if( ctx->dn2Ans == (0x80|MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
+                ctx->dn2Dr = dr;
+                ctx->dn2Freq = freq;
+                DO_DEVDB(ctx->dn2Dr,dn2Dr);
+                DO_DEVDB(ctx->dn2Freq,dn2Freq);
             }
             continue;
         }
@@ -1135,20 +1332,20 @@ static bit_t decodeFrame (void) {
             oidx += 2;
             // A value cap=0xFF means device is OFF unless enabled again manually.
             if( cap==0xFF )
-                LMIC.opmode |= OP_SHUTDOWN;  // stop any sending
-            LMIC.globalDutyRate  = cap & 0xF;
-            LMIC.globalDutyAvail = os_getTime();
+                ctx->opmode |= OP_SHUTDOWN;  // stop any sending
+            ctx->globalDutyRate  = cap & 0xF;
+            ctx->globalDutyAvail = os_getTime64();
             DO_DEVDB(cap,dutyCap);
-            LMIC.dutyCapAns = 1;
+            ctx->dutyCapAns = 1;
             continue;
         }
         case MCMD_SNCH_REQ: {
             u1_t chidx = opts[oidx+1];  // channel
             u4_t freq  = convFreq(&opts[oidx+2]); // freq
             u1_t drs   = opts[oidx+5];  // datarate span
-            LMIC.snchAns = 0x80;
-            if( freq != 0 && LMIC_setupChannel(chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
-                LMIC.snchAns |= MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
+            ctx->snchAns = 0x80;
+            if( freq != 0 && lmic_setupChannel(ctx, chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
+                ctx->snchAns |= MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
             oidx += 6;
             continue;
         }
@@ -1158,37 +1355,37 @@ static bit_t decodeFrame (void) {
             u1_t flags = 0x80;
             if( freq != 0 ) {
                 flags |= MCMD_PING_ANS_FQACK;
-                LMIC.ping.freq = freq;
-                DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
-                DO_DEVDB(LMIC.ping.freq, pingFreq);
-                DO_DEVDB(LMIC.ping.dr, pingDr);
+                ctx->ping.freq = freq;
+                DO_DEVDB(ctx->ping.intvExp, pingIntvExp);
+                DO_DEVDB(ctx->ping.freq, pingFreq);
+                DO_DEVDB(ctx->ping.dr, pingDr);
             }
-            LMIC.pingSetAns = flags;
+            ctx->pingSetAns = flags;
             continue;
         }
         case MCMD_BCNI_ANS: {
             // Ignore if tracking already enabled
-            if( (LMIC.opmode & OP_TRACK) == 0 ) {
-                LMIC.bcnChnl = opts[oidx+3];
+            if( (ctx->opmode & OP_TRACK) == 0 ) {
+                ctx->bcnChnl = opts[oidx+3];
                 // Enable tracking - bcninfoTries
-                LMIC.opmode |= OP_TRACK;
+                ctx->opmode |= OP_TRACK;
                 // Cleared later in txComplete handling - triggers EV_BEACON_FOUND
-                ASSERT(LMIC.bcninfoTries!=0);
+                ASSERT(ctx->bcninfoTries!=0);
                 // Setup RX parameters
-                LMIC.bcninfo.txtime = (LMIC.rxtime
+                ctx->bcninfo.txtime = (ctx->rxtime
                                        + ms2osticks(os_rlsbf2(&opts[oidx+1]) * MCMD_BCNI_TUNIT)
                                        + ms2osticksCeil(MCMD_BCNI_TUNIT/2)
                                        - BCN_INTV_osticks);
-                LMIC.bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
-                calcBcnRxWindowFromMillis(MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
+                ctx->bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
+                calcBcnRxWindowFromMillis(ctx, MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
 
                 EV(lostFrame, INFO, (e_.reason  = EV::lostFrame_t::MCMD_BCNI_ANS,
                                      e_.eui     = MAIN::CDEV->getEui(),
                                      e_.lostmic = Base::lsbf4(&d[pend]),
-                                     e_.info    = (LMIC.missedBcns |
-                                                   (osticks2us(LMIC.bcninfo.txtime + BCN_INTV_osticks
-                                                               - LMIC.bcnRxtime) << 8)),
-                                     e_.time    = MAIN::CDEV->ostime2ustime(LMIC.bcninfo.txtime + BCN_INTV_osticks)));
+                                     e_.info    = (ctx->missedBcns |
+                                                   (osticks2us(ctx->bcninfo.txtime + BCN_INTV_osticks
+                                                               - ctx->bcnRxtime) << 8)),
+                                     e_.time    = MAIN::CDEV->ostime2ustime(ctx->bcninfo.txtime + BCN_INTV_osticks)));
             }
             oidx += 4;
             continue;
@@ -1210,10 +1407,10 @@ static bit_t decodeFrame (void) {
         // Handle payload only if not a replay
         // Decrypt payload - if any
         if( port >= 0  &&  pend-poff > 0 )
-            aes_cipher(port <= 0 ? LMIC.nwkKey : LMIC.artKey, LMIC.devaddr, seqno, /*dn*/1, d+poff, pend-poff);
+            aes_cipher(ctx, port <= 0 ? &ctx->nwkRk : &ctx->artRk, ctx->devaddr, seqno, /*dn*/1, d+poff, pend-poff);
 
         EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
-                           e_.devaddr = LMIC.devaddr,
+                           e_.devaddr = ctx->devaddr,
                            e_.seqno   = seqno,
                            e_.flags   = (port < 0 ? EV::dfinfo_t::NOPORT : 0) | EV::dfinfo_t::DN,
                            e_.mic     = Base::lsbf4(&d[pend]),
@@ -1231,28 +1428,28 @@ static bit_t decodeFrame (void) {
     }
 
     if( // NWK acks but we don't have a frame pending
-        (ackup && LMIC.txCnt == 0) ||
+        (ackup && ctx->txCnt == 0) ||
         // We sent up confirmed and we got a response in DNW1/DNW2
         // BUT it did not carry an ACK - this should never happen
         // Do not resend and assume frame was not ACKed.
-        (!ackup && LMIC.txCnt != 0) ) {
+        (!ackup && ctx->txCnt != 0) ) {
         EV(specCond, ERR, (e_.reason = EV::specCond_t::SPURIOUS_ACK,
                            e_.eui    = MAIN::CDEV->getEui(),
                            e_.info   = seqno,
                            e_.info2  = ackup));
     }
 
-    if( LMIC.txCnt != 0 ) // we requested an ACK
-        LMIC.txrxFlags |= ackup ? TXRX_ACK : TXRX_NACK;
+    if( ctx->txCnt != 0 ) // we requested an ACK
+        ctx->txrxFlags |= ackup ? TXRX_ACK : TXRX_NACK;
 
     if( port < 0 ) {
-        LMIC.txrxFlags |= TXRX_NOPORT;
-        LMIC.dataBeg = poff;
-        LMIC.dataLen = 0;
+        ctx->txrxFlags |= TXRX_NOPORT;
+        ctx->dataBeg = poff;
+        ctx->dataLen = 0;
     } else {
-        LMIC.txrxFlags |= TXRX_PORT;
-        LMIC.dataBeg = poff;
-        LMIC.dataLen = pend-poff;
+        ctx->txrxFlags |= TXRX_PORT;
+        ctx->dataBeg = poff;
+        ctx->dataLen = pend-poff;
     }
     return 1;
 }
@@ -1262,54 +1459,54 @@ static bit_t decodeFrame (void) {
 // TX/RX transaction support
 
 
-static void setupRx2 (void) {
-    LMIC.txrxFlags = TXRX_DNW2;
-    LMIC.rps = dndr2rps(LMIC.dn2Dr);
-    LMIC.freq = LMIC.dn2Freq;
-    LMIC.dataLen = 0;
-    os_radio(RADIO_RX);
+static void setupRx2 (lmic_ctx* ctx) {
+    ctx->txrxFlags = TXRX_DNW2;
+    ctx->rps = dndr2rps(ctx->dn2Dr);
+    ctx->freq = ctx->dn2Freq;
+    ctx->dataLen = 0;
+    os_radio(ctx, RADIO_RX);
 }
 
 
-static void schedRx2 (ostime_t delay, osjobcb_t func) {
+static void schedRx2 (lmic_ctx* ctx, ostime_t delay, osjobcb_t func) {
     // Add 1.5 symbols we need 5 out of 8. Try to sync 1.5 symbols into the preamble.
-    LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dn2Dr);
-    os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
+    ctx->rxtime = ctx->txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(ctx->dn2Dr);
+    os_setTimedCallback(&ctx->osjob, ctx->rxtime - RX_RAMPUP, func);
 }
 
-static void setupRx1 (osjobcb_t func) {
-    LMIC.txrxFlags = TXRX_DNW1;
-    // Turn LMIC.rps from TX over to RX
-    LMIC.rps = setNocrc(LMIC.rps,1);
-    LMIC.dataLen = 0;
-    LMIC.osjob.func = func;
-    os_radio(RADIO_RX);
+static void setupRx1 (lmic_ctx* ctx, osjobcb_t func) {
+    ctx->txrxFlags = TXRX_DNW1;
+    // Turn ctx->rps from TX over to RX
+    ctx->rps = setNocrc(ctx->rps,1);
+    ctx->dataLen = 0;
+    ctx->osjob.func = func;
+    os_radio(ctx, RADIO_RX);
 }
 
 
-// Called by HAL once TX complete and delivers exact end of TX time stamp in LMIC.rxtime
-static void txDone (ostime_t delay, osjobcb_t func) {
-    if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE|OP_PINGINI)) == (OP_TRACK|OP_PINGABLE) ) {
-        rxschedInit(&LMIC.ping);    // note: reuses LMIC.frame buffer!
-        LMIC.opmode |= OP_PINGINI;
+// Called by HAL once TX complete and delivers exact end of TX time stamp in ctx->rxtime
+static void txDone (lmic_ctx* ctx, ostime_t delay, osjobcb_t func) {
+    if( (ctx->opmode & (OP_TRACK|OP_PINGABLE|OP_PINGINI)) == (OP_TRACK|OP_PINGABLE) ) {
+        rxschedInit(ctx, &ctx->ping);    // note: reuses ctx->frame buffer!
+        ctx->opmode |= OP_PINGINI;
     }
     // Change RX frequency / rps (US only) before we increment txChnl
     setRx1Params();
-    // LMIC.rxsyms carries the TX datarate (can be != LMIC.datarate [confirm retries etc.])
-    // Setup receive - LMIC.rxtime is preloaded with 1.5 symbols offset to tune
+    // ctx->rxsyms carries the TX datarate (can be != ctx->datarate [confirm retries etc.])
+    // Setup receive - ctx->rxtime is preloaded with 1.5 symbols offset to tune
     // into the middle of the 8 symbols preamble.
 #if defined(CFG_eu868)
-    if( /* TX datarate */LMIC.rxsyms == DR_FSK ) {
-        LMIC.rxtime = LMIC.txend + delay - PRERX_FSK*us2osticksRound(160);
-        LMIC.rxsyms = RXLEN_FSK;
+    if( /* TX datarate */ctx->rxsyms == DR_FSK ) {
+        ctx->rxtime = ctx->txend + delay - PRERX_FSK*us2osticksRound(160);
+        ctx->rxsyms = RXLEN_FSK;
     }
     else
 #endif
     {
-        LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dndr);
-        LMIC.rxsyms = MINRX_SYMS;
+        ctx->rxtime = ctx->txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(ctx->dndr);
+        ctx->rxsyms = MINRX_SYMS;
     }
-    os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
+    os_setTimedCallback(&ctx->osjob, ctx->rxtime - RX_RAMPUP, func);
 }
 
 
@@ -1317,45 +1514,46 @@ static void txDone (ostime_t delay, osjobcb_t func) {
 
 
 static void onJoinFailed (xref2osjob_t osjob) {
-    // Notify app - must call LMIC_reset() to stop joining
+    lmic_ctx* ctx = jobCtx(osjob);
+    // Notify app - must call lmic_reset(ctx) to stop joining
     // otherwise join procedure continues.
-    reportEvent(EV_JOIN_FAILED);
+    reportEvent(ctx, EV_JOIN_FAILED);
 }
 
 
-static bit_t processJoinAccept (void) {
-    ASSERT(LMIC.txrxFlags != TXRX_DNW1 || LMIC.dataLen != 0);
-    ASSERT((LMIC.opmode & OP_TXRXPEND)!=0);
+static bit_t processJoinAccept (lmic_ctx* ctx) {
+    ASSERT(ctx->txrxFlags != TXRX_DNW1 || ctx->dataLen != 0);
+    ASSERT((ctx->opmode & OP_TXRXPEND)!=0);
 
-    if( LMIC.dataLen == 0 ) {
+    if( ctx->dataLen == 0 ) {
       nojoinframe:
-        if( (LMIC.opmode & OP_JOINING) == 0 ) {
-            ASSERT((LMIC.opmode & OP_REJOIN) != 0);
+        if( (ctx->opmode & OP_JOINING) == 0 ) {
+            ASSERT((ctx->opmode & OP_REJOIN) != 0);
             // REJOIN attempt for roaming
-            LMIC.opmode &= ~(OP_REJOIN|OP_TXRXPEND);
-            if( LMIC.rejoinCnt < 10 )
-                LMIC.rejoinCnt++;
-            reportEvent(EV_REJOIN_FAILED);
+            ctx->opmode &= ~(OP_REJOIN|OP_TXRXPEND);
+            if( ctx->rejoinCnt < 10 )
+                ctx->rejoinCnt++;
+            reportEvent(ctx, EV_REJOIN_FAILED);
             return 1;
         }
-        LMIC.opmode &= ~OP_TXRXPEND;
-        ostime_t delay = nextJoinState();
+        ctx->opmode &= ~OP_TXRXPEND;
+        ostime_t delay = nextJoinState(ctx);
         EV(devCond, DEBUG, (e_.reason = EV::devCond_t::NO_JACC,
                             e_.eui    = MAIN::CDEV->getEui(),
-                            e_.info   = LMIC.datarate|DR_PAGE,
+                            e_.info   = ctx->datarate|DR_PAGE,
                             e_.info2  = osticks2ms(delay)));
         // Build next JOIN REQUEST with next engineUpdate call
         // Optionally, report join failed.
         // Both after a random/chosen amount of ticks.
-        os_setTimedCallback(&LMIC.osjob, os_getTime()+delay,
+        os_setTimedCallback(&ctx->osjob, os_getTime()+delay,
                             (delay&1) != 0
                             ? FUNC_ADDR(onJoinFailed)      // one JOIN iteration done and failed
                             : FUNC_ADDR(runEngineUpdate)); // next step to be delayed
         return 1;
     }
-    u1_t hdr  = LMIC.frame[0];
-    u1_t dlen = LMIC.dataLen;
-    u4_t mic  = os_rlsbf4(&LMIC.frame[dlen-4]); // safe before modified by encrypt!
+    u1_t hdr  = ctx->frame[0];
+    u1_t dlen = ctx->dataLen;
+    u4_t mic  = os_rlsbf4(&ctx->frame[dlen-4]); // safe before modified by encrypt!
     if( (dlen != LEN_JA && dlen != LEN_JAEXT)
         || (hdr & (HDR_FTYPE|HDR_MAJOR)) != (HDR_FTYPE_JACC|HDR_MAJOR_V1) ) {
         EV(specCond, ERR, (e_.reason = EV::specCond_t::UNEXPECTED_FRAME,
@@ -1363,23 +1561,23 @@ static bit_t processJoinAccept (void) {
                            e_.info   = dlen < 4 ? 0 : mic,
                            e_.info2  = hdr + (dlen<<8)));
       badframe:
-        if( (LMIC.txrxFlags & TXRX_DNW1) != 0 )
+        if( (ctx->txrxFlags & TXRX_DNW1) != 0 )
             return 0;
         goto nojoinframe;
     }
-    aes_encrypt(LMIC.frame+1, dlen-1);
-    if( !aes_verifyMic0(LMIC.frame, dlen-4) ) {
+    aes_encrypt(ctx, ctx->frame+1, dlen-1);
+    if( !aes_verifyMic0(ctx, ctx->frame, dlen-4) ) {
         EV(specCond, ERR, (e_.reason = EV::specCond_t::JOIN_BAD_MIC,
                            e_.info   = mic));
         goto badframe;
     }
 
-    u4_t addr = os_rlsbf4(LMIC.frame+OFF_JA_DEVADDR);
-    LMIC.devaddr = addr;
-    LMIC.netid = os_rlsbf4(&LMIC.frame[OFF_JA_NETID]) & 0xFFFFFF;
+    u4_t addr = os_rlsbf4(ctx->frame+OFF_JA_DEVADDR);
+    ctx->devaddr = addr;
+    ctx->netid = os_rlsbf4(&ctx->frame[OFF_JA_NETID]) & 0xFFFFFF;
 
 #if defined(CFG_eu868)
-    initDefaultChannels(0);
+    initDefaultChannels(ctx, 0);
 #endif
     if( dlen > LEN_JA ) {
 #if defined(CFG_us915)
@@ -1387,261 +1585,375 @@ static bit_t processJoinAccept (void) {
 #endif
         dlen = OFF_CFLIST;
         for( u1_t chidx=3; chidx<8; chidx++, dlen+=3 ) {
-            u4_t freq = convFreq(&LMIC.frame[dlen]);
+            u4_t freq = convFreq(&ctx->frame[dlen]);
             if( freq )
-                LMIC_setupChannel(chidx, freq, 0, -1);
+                lmic_setupChannel(ctx, chidx, freq, 0, -1);
         }
     }
 
     // already incremented when JOIN REQ got sent off
-    aes_sessKeys(LMIC.devNonce-1, &LMIC.frame[OFF_JA_ARTNONCE], LMIC.nwkKey, LMIC.artKey);
-    DO_DEVDB(LMIC.netid,   netid);
-    DO_DEVDB(LMIC.devaddr, devaddr);
-    DO_DEVDB(LMIC.nwkKey,  nwkkey);
-    DO_DEVDB(LMIC.artKey,  artkey);
+    aes_sessKeys(ctx, ctx->devNonce-1, &ctx->frame[OFF_JA_ARTNONCE], ctx->nwkKey, ctx->artKey);
+    setSessKeys(ctx);
+    DO_DEVDB(ctx->netid,   netid);
+    DO_DEVDB(ctx->devaddr, devaddr);
+    DO_DEVDB(ctx->nwkKey,  nwkkey);
+    DO_DEVDB(ctx->artKey,  artkey);
 
     EV(joininfo, INFO, (e_.arteui  = MAIN::CDEV->getArtEui(),
                         e_.deveui  = MAIN::CDEV->getEui(),
-                        e_.devaddr = LMIC.devaddr,
+                        e_.devaddr = ctx->devaddr,
                         e_.oldaddr = oldaddr,
-                        e_.nonce   = LMIC.devNonce-1,
+                        e_.nonce   = ctx->devNonce-1,
                         e_.mic     = mic,
-                        e_.reason  = ((LMIC.opmode & OP_REJOIN) != 0
+                        e_.reason  = ((ctx->opmode & OP_REJOIN) != 0
                                       ? EV::joininfo_t::REJOIN_ACCEPT
                                       : EV::joininfo_t::ACCEPT)));
     
-    ASSERT((LMIC.opmode & (OP_JOINING|OP_REJOIN))!=0);
-    if( (LMIC.opmode & OP_REJOIN) != 0 ) {
+    ASSERT((ctx->opmode & (OP_JOINING|OP_REJOIN))!=0);
+    if( (ctx->opmode & OP_REJOIN) != 0 ) {
         // Lower DR every try below current UP DR
-        LMIC.datarate = lowerDR(LMIC.datarate, LMIC.rejoinCnt);
+        ctx->datarate = lowerDR(ctx->datarate, ctx->rejoinCnt);
     }
-    LMIC.opmode &= ~(OP_JOINING|OP_TRACK|OP_REJOIN|OP_TXRXPEND|OP_PINGINI) | OP_NEXTCHNL;
-    stateJustJoined();
-    reportEvent(EV_JOINED);
+    ctx->opmode &= ~(OP_JOINING|OP_TRACK|OP_REJOIN|OP_TXRXPEND|OP_PINGINI) | OP_NEXTCHNL;
+    stateJustJoined(ctx);
+    saveSession(ctx, 0);
+    reportEvent(ctx, EV_JOINED);
     return 1;
 }
 
 
 static void processRx2Jacc (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 )
-        LMIC.txrxFlags = 0;  // nothing in 1st/2nd DN slot
-    processJoinAccept();
+    lmic_ctx* ctx = jobCtx(osjob);
+    if( ctx->dataLen == 0 )
+        ctx->txrxFlags = 0;  // nothing in 1st/2nd DN slot
+    processJoinAccept(ctx);
 }
 
 
 static void setupRx2Jacc (xref2osjob_t osjob) {
-    LMIC.osjob.func = FUNC_ADDR(processRx2Jacc);
-    setupRx2();
+    lmic_ctx* ctx = jobCtx(osjob);
+    ctx->osjob.func = FUNC_ADDR(processRx2Jacc);
+    setupRx2(ctx);
 }
 
 
 static void processRx1Jacc (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 || !processJoinAccept() )
-        schedRx2(DELAY_JACC2_osticks, FUNC_ADDR(setupRx2Jacc));
+    lmic_ctx* ctx = jobCtx(osjob);
+    if( ctx->dataLen == 0 || !processJoinAccept(ctx) )
+        schedRx2(ctx, DELAY_JACC2_osticks, FUNC_ADDR(setupRx2Jacc));
 }
 
 
 static void setupRx1Jacc (xref2osjob_t osjob) {
-    setupRx1(FUNC_ADDR(processRx1Jacc));
+    lmic_ctx* ctx = jobCtx(osjob);
+    setupRx1(ctx, FUNC_ADDR(processRx1Jacc));
 }
 
 
 static void jreqDone (xref2osjob_t osjob) {
-    txDone(DELAY_JACC1_osticks, FUNC_ADDR(setupRx1Jacc));
+    lmic_ctx* ctx = jobCtx(osjob);
+    txDone(ctx, DELAY_JACC1_osticks, FUNC_ADDR(setupRx1Jacc));
 }
 
 // ======================================== Data frames
 
 // Fwd decl.
-static bit_t processDnData(void);
+static bit_t processDnData(lmic_ctx* ctx);
 
 static void processRx2DnDataDelay (xref2osjob_t osjob) {
-    processDnData();
+    lmic_ctx* ctx = jobCtx(osjob);
+    processDnData(ctx);
 }
 
 static void processRx2DnData (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 ) {
-        LMIC.txrxFlags = 0;  // nothing in 1st/2nd DN slot
+    lmic_ctx* ctx = jobCtx(osjob);
+    if( ctx->dataLen == 0 ) {
+        ctx->txrxFlags = 0;  // nothing in 1st/2nd DN slot
         // Delay callback processing to avoid up TX while gateway is txing our missed frame! 
         // Since DNW2 uses SF12 by default we wait 3 secs.
-        os_setTimedCallback(&LMIC.osjob,
+        os_setTimedCallback(&ctx->osjob,
                             (os_getTime() + DNW2_SAFETY_ZONE + rndDelay(2)),
                             processRx2DnDataDelay);
         return;
     }
-    processDnData();
+    processDnData(ctx);
 }
 
 
 static void setupRx2DnData (xref2osjob_t osjob) {
-    LMIC.osjob.func = FUNC_ADDR(processRx2DnData);
-    setupRx2();
+    lmic_ctx* ctx = jobCtx(osjob);
+    ctx->osjob.func = FUNC_ADDR(processRx2DnData);
+    setupRx2(ctx);
 }
 
 
 static void processRx1DnData (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 || !processDnData() )
-        schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+    lmic_ctx* ctx = jobCtx(osjob);
+    if( ctx->dataLen == 0 || !processDnData(ctx) )
+        schedRx2(ctx, DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
 }
 
 
 static void setupRx1DnData (xref2osjob_t osjob) {
-    setupRx1(FUNC_ADDR(processRx1DnData));
+    lmic_ctx* ctx = jobCtx(osjob);
+    setupRx1(ctx, FUNC_ADDR(processRx1DnData));
 }
 
 
 static void updataDone (xref2osjob_t osjob) {
-    txDone(DELAY_DNW1_osticks, FUNC_ADDR(setupRx1DnData));
+    lmic_ctx* ctx = jobCtx(osjob);
+    txDone(ctx, DELAY_DNW1_osticks, FUNC_ADDR(setupRx1DnData));
 }
 
 // ======================================== 
 
 
-static void buildDataFrame (void) {
-    bit_t txdata = ((LMIC.opmode & (OP_TXDATA|OP_POLL)) != OP_POLL);
-    u1_t dlen = txdata ? LMIC.pendTxLen : 0;
+static void buildDataFrame (lmic_ctx* ctx) {
+    bit_t txdata = ((ctx->opmode & (OP_TXDATA|OP_POLL)) != OP_POLL);
+    u1_t dlen = txdata ? ctx->pendTxLen : 0;
 
     // Piggyback MAC options
     // Prioritize by importance
     int  end = OFF_DAT_OPTS;
-    if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) {
+    if( (ctx->opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) {
         // Indicate pingability in every UP frame
-        LMIC.frame[end] = MCMD_PING_IND;
-        LMIC.frame[end+1] = LMIC.ping.dr | (LMIC.ping.intvExp<<4);
+        ctx->frame[end] = MCMD_PING_IND;
+        ctx->frame[end+1] = ctx->ping.dr | (ctx->ping.intvExp<<4);
         end += 2;
     }
-    if( LMIC.dutyCapAns ) {
-        LMIC.frame[end] = MCMD_DCAP_ANS;
+    if( ctx->dutyCapAns ) {
+        ctx->frame[end] = MCMD_DCAP_ANS;
         end += 1;
-        LMIC.dutyCapAns = 0;
+        ctx->dutyCapAns = 0;
     }
-    if( LMIC.dn2Ans ) {
-        LMIC.frame[end+0] = MCMD_DN2P_ANS;
-        LMIC.frame[end+1] = LMIC.dn2Ans & ~MCMD_DN2P_ANS_RFU;
+    if( ctx->dn2Ans ) {
+        ctx->frame[end+0] = MCMD_DN2P_ANS;
+        ctx->frame[end+1] = ctx->dn2Ans & ~MCMD_DN2P_ANS_RFU;
         end += 2;
-        LMIC.dn2Ans = 0;
+        ctx->dn2Ans = 0;
     }
-    if( LMIC.devsAns ) {  // answer to device status
-        LMIC.frame[end+0] = MCMD_DEVS_ANS;
-        LMIC.frame[end+1] = LMIC.margin;
-        LMIC.frame[end+2] = os_getBattLevel();
+    if( ctx->devsAns ) {  // answer to device status
+        ctx->frame[end+0] = MCMD_DEVS_ANS;
+        ctx->frame[end+1] = ctx->margin;
+        ctx->frame[end+2] = os_getBattLevel();
         end += 3;
-        LMIC.devsAns = 0;
+        ctx->devsAns = 0;
     }
-    if( LMIC.ladrAns ) {  // answer to ADR change
-        LMIC.frame[end+0] = MCMD_LADR_ANS;
-        LMIC.frame[end+1] = LMIC.ladrAns & ~MCMD_LADR_ANS_RFU;
+    if( ctx->ladrAns ) {  // answer to ADR change
+        ctx->frame[end+0] = MCMD_LADR_ANS;
+        ctx->frame[end+1] = ctx->ladrAns & ~MCMD_LADR_ANS_RFU;
         end += 2;
-        LMIC.ladrAns = 0;
+        ctx->ladrAns = 0;
     }
-    if( LMIC.bcninfoTries > 0 ) {
-        LMIC.frame[end] = MCMD_BCNI_REQ;
+    if( ctx->bcninfoTries > 0 ) {
+        ctx->frame[end] = MCMD_BCNI_REQ;
         end += 1;
     }
-    if( LMIC.adrChanged ) {
-        if( LMIC.adrAckReq < 0 )
-            LMIC.adrAckReq = 0;
-        LMIC.adrChanged = 0;
+    if( ctx->adrChanged ) {
+        if( ctx->adrAckReq < 0 )
+            ctx->adrAckReq = 0;
+        ctx->adrChanged = 0;
     }
-    if( LMIC.pingSetAns != 0 ) {
-        LMIC.frame[end+0] = MCMD_PING_ANS;
-        LMIC.frame[end+1] = LMIC.pingSetAns & ~MCMD_PING_ANS_RFU;
+    if( ctx->pingSetAns != 0 ) {
+        ctx->frame[end+0] = MCMD_PING_ANS;
+        ctx->frame[end+1] = ctx->pingSetAns & ~MCMD_PING_ANS_RFU;
         end += 2;
-        LMIC.pingSetAns = 0;
+        ctx->pingSetAns = 0;
     }
-    if( LMIC.snchAns ) {
-        LMIC.frame[end+0] = MCMD_SNCH_ANS;
-        LMIC.frame[end+1] = LMIC.snchAns & ~MCMD_SNCH_ANS_RFU;
+    if( ctx->snchAns ) {
+        ctx->frame[end+0] = MCMD_SNCH_ANS;
+        ctx->frame[end+1] = ctx->snchAns & ~MCMD_SNCH_ANS_RFU;
         end += 2;
-        LMIC.snchAns = 0;
+        ctx->snchAns = 0;
     }
     ASSERT(end <= OFF_DAT_OPTS+16);
 
-    u1_t flen = end + (txdata ? 5+dlen : 4);
-    if( flen > MAX_LEN_FRAME ) {
+    int flen = end + (txdata ? 5+dlen : 4);
+    if( flen > maxFrameLen(ctx->datarate) ) {
         // Options and payload too big - delay payload
         txdata = 0;
         flen = end+4;
     }
-    LMIC.frame[OFF_DAT_HDR] = HDR_FTYPE_DAUP | HDR_MAJOR_V1;
-    LMIC.frame[OFF_DAT_FCT] = (LMIC.dnConf | LMIC.adrEnabled
-                              | (LMIC.adrAckReq >= 0 ? FCT_ADRARQ : 0)
+    ctx->frame[OFF_DAT_HDR] = HDR_FTYPE_DAUP | HDR_MAJOR_V1;
+    ctx->frame[OFF_DAT_FCT] = (ctx->dnConf | ctx->adrEnabled
+                              | (ctx->adrAckReq >= 0 ? FCT_ADRARQ : 0)
                               | (end-OFF_DAT_OPTS));
-    os_wlsbf4(LMIC.frame+OFF_DAT_ADDR,  LMIC.devaddr);
-
-    if( LMIC.txCnt == 0 ) {
-        LMIC.seqnoUp += 1;
-        DO_DEVDB(LMIC.seqnoUp,seqnoUp);
+    os_wlsbf4(ctx->frame+OFF_DAT_ADDR,  ctx->devaddr);
+
+    if( ctx->txCnt == 0 ) {
+        if( ctx->cfg.store != 0 && ctx->seqnoUp >= ctx->seqnoUpLimit ) {
+            // Reserve a block of counters with one durable write before
+            // using the first - after a restart we continue behind it
+            ctx->seqnoUpLimit = ctx->seqnoUp + FCNT_RESERVE;
+            saveSession(ctx, 1);
+        }
+        ctx->seqnoUp += 1;
+        DO_DEVDB(ctx->seqnoUp,seqnoUp);
     } else {
         EV(devCond, INFO, (e_.reason = EV::devCond_t::RE_TX,
                            e_.eui    = MAIN::CDEV->getEui(),
-                           e_.info   = LMIC.seqnoUp-1,
-                           e_.info2  = ((LMIC.txCnt+1) |
-                                        (DRADJUST[LMIC.txCnt+1] << 8) |
-                                        ((LMIC.datarate|DR_PAGE)<<16))));
+                           e_.info   = ctx->seqnoUp-1,
+                           e_.info2  = ((ctx->txCnt+1) |
+                                        (DRADJUST[ctx->txCnt+1] << 8) |
+                                        ((ctx->datarate|DR_PAGE)<<16))));
     }
-    os_wlsbf2(LMIC.frame+OFF_DAT_SEQNO, LMIC.seqnoUp-1);
+    os_wlsbf2(ctx->frame+OFF_DAT_SEQNO, ctx->seqnoUp-1);
 
     // Clear pending DN confirmation
-    LMIC.dnConf = 0;
+    ctx->dnConf = 0;
 
     if( txdata ) {
-        if( LMIC.pendTxConf ) {
+        if( ctx->pendTxConf ) {
             // Confirmed only makes sense if we have a payload (or at least a port)
-            LMIC.frame[OFF_DAT_HDR] = HDR_FTYPE_DCUP | HDR_MAJOR_V1;
-            if( LMIC.txCnt == 0 ) LMIC.txCnt = 1;
+            ctx->frame[OFF_DAT_HDR] = HDR_FTYPE_DCUP | HDR_MAJOR_V1;
+            if( ctx->txCnt == 0 ) ctx->txCnt = 1;
         }
-        LMIC.frame[end] = LMIC.pendTxPort;
-        os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
-        if (LMIC.pendTxPort != 223) {  // port 223 unencrypted for testing (TT)
-          aes_cipher(LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey,
-                     LMIC.devaddr, LMIC.seqnoUp-1,
-                     /*up*/0, LMIC.frame+end+1, dlen);
+        ctx->frame[end] = ctx->pendTxPort;
+        os_copyMem(ctx->frame+end+1, ctx->pendTxData, dlen);
+        if (ctx->pendTxPort != 223) {  // port 223 unencrypted for testing (TT)
+          aes_cipher(ctx, ctx->pendTxPort==0 ? &ctx->nwkRk : &ctx->artRk,
+                     ctx->devaddr, ctx->seqnoUp-1,
+                     /*up*/0, ctx->frame+end+1, dlen);
         }
 
     }
-    aes_appendMic(LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, flen-4);
+    aes_appendMic(ctx, &ctx->nwkRk, ctx->seqnoUp-1, /*up*/0, ctx->frame, flen-4);
 
     EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
-                       e_.devaddr = LMIC.devaddr,
-                       e_.seqno   = LMIC.seqnoUp-1,
-                       e_.flags   = (LMIC.pendTxPort < 0 ? EV::dfinfo_t::NOPORT : EV::dfinfo_t::NOP),
-                       e_.mic     = Base::lsbf4(&LMIC.frame[flen-4]),
-                       e_.hdr     = LMIC.frame[LORA::OFF_DAT_HDR],
-                       e_.fct     = LMIC.frame[LORA::OFF_DAT_FCT],
-                       e_.port    = LMIC.pendTxPort,
+                       e_.devaddr = ctx->devaddr,
+                       e_.seqno   = ctx->seqnoUp-1,
+                       e_.flags   = (ctx->pendTxPort < 0 ? EV::dfinfo_t::NOPORT : EV::dfinfo_t::NOP),
+                       e_.mic     = Base::lsbf4(&ctx->frame[flen-4]),
+                       e_.hdr     = ctx->frame[LORA::OFF_DAT_HDR],
+                       e_.fct     = ctx->frame[LORA::OFF_DAT_FCT],
+                       e_.port    = ctx->pendTxPort,
                        e_.plen    = txdata ? dlen : 0,
                        e_.opts.length = end-LORA::OFF_DAT_OPTS,
-                       memcpy(&e_.opts[0], LMIC.frame+LORA::OFF_DAT_OPTS, end-LORA::OFF_DAT_OPTS)));
-    LMIC.dataLen = flen;
+                       memcpy(&e_.opts[0], ctx->frame+LORA::OFF_DAT_OPTS, end-LORA::OFF_DAT_OPTS)));
+    ctx->dataLen = flen;
+}
+
+
+// ================================================================================
+// Uplink queue
+// Queued messages go out highest priority first, oldest first within a
+// priority. A frame starts with the first message and takes the following
+// ones for the same port and confirmation mode as long as they fit.
+
+// Length of the MAC options buildDataFrame() piggybacks on the next uplink.
+static int pendingOptsLen (lmic_ctx* ctx) {
+    int len = 0;
+    if( (ctx->opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) len += 2;
+    if( ctx->dutyCapAns )       len += 1;
+    if( ctx->dn2Ans )           len += 2;
+    if( ctx->devsAns )          len += 3;
+    if( ctx->ladrAns )          len += 2;
+    if( ctx->bcninfoTries > 0 ) len += 1;
+    if( ctx->pingSetAns != 0 )  len += 2;
+    if( ctx->snchAns )          len += 2;
+    return len;
+}
+
+// Largest application payload of the next uplink at the current data rate.
+static int maxPayload (lmic_ctx* ctx) {
+    int room = maxFrameLen(ctx->datarate) - OFF_DAT_OPTS - pendingOptsLen(ctx) - 5;  // port and MIC
+    return room < 0 ? 0 : room > MAX_LEN_PAYLOAD ? MAX_LEN_PAYLOAD : room;
+}
+
+static void txqRemove (lmic_ctx* ctx, u1_t i, u1_t txrxFlags) {
+    u2_t id = ctx->txq[i].id;
+    ctx->txqLen -= 1;
+    memmove(&ctx->txq[i], &ctx->txq[i+1], (ctx->txqLen-i) * sizeof(ctx->txq[0]));
+    if( ctx->cfg.txcb )
+        ctx->cfg.txcb(ctx, id, txrxFlags);
+}
+
+// Pack the next frame from the queue into pendTxData. Messages which do not
+// fit a frame at the current data rate any more are dropped. Returns 0 if
+// nothing is left to send.
+static bit_t loadTxq (lmic_ctx* ctx) {
+    int room = maxPayload(ctx);
+    for( u1_t i=0; i<ctx->txqLen; ) {
+        if( ctx->txq[i].len > room )
+            txqRemove(ctx, i, TXRX_DROP);
+        else
+            i++;
+    }
+    ctx->txqLoad = 0;
+    if( ctx->txqLen == 0 )
+        return 0;
+    int len = 0;
+    for( bit_t first=1; ; first=0 ) {
+        int best = -1;
+        for( u1_t i=0; i<ctx->txqLen; i++ ) {
+            struct lmic_txmsg_t* m = &ctx->txq[i];
+            if( m->inflight || len + m->len > room )
+                continue;
+            if( !first && (m->port != ctx->pendTxPort || m->conf != ctx->pendTxConf) )
+                continue;
+            if( best < 0 || m->prio > ctx->txq[best].prio )
+                best = i;
+        }
+        if( best < 0 )
+            break;
+        struct lmic_txmsg_t* m = &ctx->txq[best];
+        ctx->pendTxPort = m->port;
+        ctx->pendTxConf = m->conf;
+        os_copyMem(ctx->pendTxData+len, m->data, m->len);
+        len += m->len;
+        m->inflight = 1;
+    }
+    ctx->pendTxLen = len;
+    return 1;
 }
 
+static void runTxq (xref2osjob_t osjob) {
+    engineUpdate(txqCtx(osjob));
+}
+
+// drop every queued message, whether sent yet or not
+static void txqFlush (lmic_ctx* ctx) {
+    ctx->txqLoad = 0;
+    for( u1_t n=ctx->txqLen; n>0 && ctx->txqLen>0; n-- )
+        txqRemove(ctx, 0, TXRX_DROP);
+}
+
+// the frame is done, report its messages
+static void txqDone (lmic_ctx* ctx, u1_t txrxFlags) {
+    for( u1_t i=0; i<ctx->txqLen; ) {
+        if( ctx->txq[i].inflight )
+            txqRemove(ctx, i, txrxFlags);
+        else
+            i++;
+    }
+}
 
 // Callback from HAL during scan mode or when job timer expires.
 static void onBcnRx (xref2osjob_t job) {
+    lmic_ctx* ctx = jobCtx(job);
     // If we arrive via job timer make sure to put radio to rest.
-    os_radio(RADIO_RST);
-    os_clearCallback(&LMIC.osjob);
-    if( LMIC.dataLen == 0 ) {
+    os_radio(ctx, RADIO_RST);
+    os_clearCallback(&ctx->osjob);
+    if( ctx->dataLen == 0 ) {
         // Nothing received - timeout
-        LMIC.opmode &= ~(OP_SCAN | OP_TRACK);
-        reportEvent(EV_SCAN_TIMEOUT);
+        ctx->opmode &= ~(OP_SCAN | OP_TRACK);
+        reportEvent(ctx, EV_SCAN_TIMEOUT);
         return;
     }
-    if( decodeBeacon() <= 0 ) {
+    if( decodeBeacon(ctx) <= 0 ) {
         // Something is wrong with the beacon - continue scan
-        LMIC.dataLen = 0;
-        os_radio(RADIO_RXON);
-        os_setTimedCallback(&LMIC.osjob, LMIC.bcninfo.txtime, FUNC_ADDR(onBcnRx));
+        ctx->dataLen = 0;
+        os_radio(ctx, RADIO_RXON);
+        os_setTimedCallback(&ctx->osjob, ctx->bcninfo.txtime, FUNC_ADDR(onBcnRx));
         return;
     }
     // Found our 1st beacon
     // We don't have a previous beacon to calc some drift - assume
     // an max error of 13ms = 128sec*100ppm which is roughly +/-100ppm
-    calcBcnRxWindowFromMillis(13,1);
-    LMIC.opmode &= ~OP_SCAN;          // turn SCAN off
-    LMIC.opmode |=  OP_TRACK;         // auto enable tracking
-    reportEvent(EV_BEACON_FOUND);    // can be disabled in callback
+    calcBcnRxWindowFromMillis(ctx, 13,1);
+    ctx->opmode &= ~OP_SCAN;          // turn SCAN off
+    ctx->opmode |=  OP_TRACK;         // auto enable tracking
+    reportEvent(ctx, EV_BEACON_FOUND);    // can be disabled in callback
 }
 
 
@@ -1650,35 +1962,35 @@ static void onBcnRx (xref2osjob_t job) {
 // This mode ends with events: EV_SCAN_TIMEOUT/EV_SCAN_BEACON
 // Implicitely cancels any pending TX/RX transaction.
 // Also cancels an onpoing joining procedure.
-static void startScan (void) {
-    ASSERT(LMIC.devaddr!=0 && (LMIC.opmode & OP_JOINING)==0);
-    if( (LMIC.opmode & OP_SHUTDOWN) != 0 )
+static void startScan (lmic_ctx* ctx) {
+    ASSERT(ctx->devaddr!=0 && (ctx->opmode & OP_JOINING)==0);
+    if( (ctx->opmode & OP_SHUTDOWN) != 0 )
         return;
     // Cancel onging TX/RX transaction
-    LMIC.txCnt = LMIC.dnConf = LMIC.bcninfo.flags = 0;
-    LMIC.opmode = (LMIC.opmode | OP_SCAN) & ~(OP_TXRXPEND);
-    setBcnRxParams();
-    LMIC.rxtime = LMIC.bcninfo.txtime = os_getTime() + sec2osticks(BCN_INTV_sec+1);
-    os_setTimedCallback(&LMIC.osjob, LMIC.rxtime, FUNC_ADDR(onBcnRx));
-    os_radio(RADIO_RXON);
+    ctx->txCnt = ctx->dnConf = ctx->bcninfo.flags = 0;
+    ctx->opmode = (ctx->opmode | OP_SCAN) & ~(OP_TXRXPEND);
+    setBcnRxParams(ctx);
+    ctx->rxtime = ctx->bcninfo.txtime = os_getTime() + sec2osticks(BCN_INTV_sec+1);
+    os_setTimedCallback(&ctx->osjob, ctx->rxtime, FUNC_ADDR(onBcnRx));
+    os_radio(ctx, RADIO_RXON);
 }
 
 
-bit_t LMIC_enableTracking (u1_t tryBcnInfo) {
-    if( (LMIC.opmode & (OP_SCAN|OP_TRACK|OP_SHUTDOWN)) != 0 )
+bit_t lmic_enableTracking (lmic_ctx* ctx, u1_t tryBcnInfo) {
+    if( (ctx->opmode & (OP_SCAN|OP_TRACK|OP_SHUTDOWN)) != 0 )
         return 0;  // already in progress or failed to enable
     // If BCN info requested from NWK then app has to take are
     // of sending data up so that MCMD_BCNI_REQ can be attached.
-    if( (LMIC.bcninfoTries = tryBcnInfo) == 0 )
-        startScan();
+    if( (ctx->bcninfoTries = tryBcnInfo) == 0 )
+        startScan(ctx);
     return 1;  // enabled
 }
 
 
-void LMIC_disableTracking (void) {
-    LMIC.opmode &= ~(OP_SCAN|OP_TRACK);
-    LMIC.bcninfoTries = 0;
-    engineUpdate();
+void lmic_disableTracking (lmic_ctx* ctx) {
+    ctx->opmode &= ~(OP_SCAN|OP_TRACK);
+    ctx->bcninfoTries = 0;
+    engineUpdate(ctx);
 }
 
 
@@ -1688,48 +2000,54 @@ void LMIC_disableTracking (void) {
 //
 // ================================================================================
 
-static void buildJoinRequest (u1_t ftype) {
+static void buildJoinRequest (lmic_ctx* ctx, u1_t ftype) {
     // Do not use pendTxData since we might have a pending
     // user level frame in there. Use RX holding area instead.
-    xref2u1_t d = LMIC.frame;
+    xref2u1_t d = ctx->frame;
     d[OFF_JR_HDR] = ftype;
-    os_getArtEui(d + OFF_JR_ARTEUI);
-    os_getDevEui(d + OFF_JR_DEVEUI);
-    os_wlsbf2(d + OFF_JR_DEVNONCE, LMIC.devNonce);
-    aes_appendMic0(d, OFF_JR_MIC);
+    if( ctx->cfg.hasIdent ) {
+        os_copyMem(d + OFF_JR_ARTEUI, ctx->cfg.artEui, 8);
+        os_copyMem(d + OFF_JR_DEVEUI, ctx->cfg.devEui, 8);
+    } else {
+        os_getArtEui(d + OFF_JR_ARTEUI);
+        os_getDevEui(d + OFF_JR_DEVEUI);
+    }
+    os_wlsbf2(d + OFF_JR_DEVNONCE, ctx->devNonce);
+    aes_appendMic0(ctx, d, OFF_JR_MIC);
 
     EV(joininfo,INFO,(e_.deveui  = MAIN::CDEV->getEui(),
                       e_.arteui  = MAIN::CDEV->getArtEui(),
-                      e_.nonce   = LMIC.devNonce,
-                      e_.oldaddr = LMIC.devaddr,
+                      e_.nonce   = ctx->devNonce,
+                      e_.oldaddr = ctx->devaddr,
                       e_.mic     = Base::lsbf4(&d[LORA::OFF_JR_MIC]),
-                      e_.reason  = ((LMIC.opmode & OP_REJOIN) != 0
+                      e_.reason  = ((ctx->opmode & OP_REJOIN) != 0
                                     ? EV::joininfo_t::REJOIN_REQUEST
                                     : EV::joininfo_t::REQUEST)));
-    LMIC.dataLen = LEN_JR;
-    LMIC.devNonce++;
-    DO_DEVDB(LMIC.devNonce,devNonce);
+    ctx->dataLen = LEN_JR;
+    ctx->devNonce++;
+    DO_DEVDB(ctx->devNonce,devNonce);
 }
 
 static void startJoining (xref2osjob_t osjob) {
-    reportEvent(EV_JOINING);
+    lmic_ctx* ctx = jobCtx(osjob);
+    reportEvent(ctx, EV_JOINING);
 }
 
 // Start join procedure if not already joined.
-bit_t LMIC_startJoining (void) {
-    if( LMIC.devaddr == 0 ) {
+bit_t lmic_startJoining (lmic_ctx* ctx) {
+    if( ctx->devaddr == 0 ) {
         // There should be no TX/RX going on
-        ASSERT((LMIC.opmode & (OP_POLL|OP_TXRXPEND)) == 0);
+        ASSERT((ctx->opmode & (OP_POLL|OP_TXRXPEND)) == 0);
         // Lift any previous duty limitation
-        LMIC.globalDutyRate = 0;
+        ctx->globalDutyRate = 0;
         // Cancel scanning
-        LMIC.opmode &= ~(OP_SCAN|OP_REJOIN|OP_LINKDEAD|OP_NEXTCHNL);
+        ctx->opmode &= ~(OP_SCAN|OP_REJOIN|OP_LINKDEAD|OP_NEXTCHNL);
         // Setup state
-        LMIC.rejoinCnt = LMIC.txCnt = LMIC.pendTxConf = 0;
-        initJoinLoop();
-        LMIC.opmode |= OP_JOINING;
+        ctx->rejoinCnt = ctx->txCnt = ctx->pendTxConf = 0;
+        initJoinLoop(ctx);
+        ctx->opmode |= OP_JOINING;
         // reportEvent will call engineUpdate which then starts sending JOIN REQUESTS
-        os_setCallback(&LMIC.osjob, FUNC_ADDR(startJoining));
+        os_setCallback(&ctx->osjob, FUNC_ADDR(startJoining));
         return 1;
     }
     return 0; // already joined
@@ -1743,75 +2061,78 @@ bit_t LMIC_startJoining (void) {
 // ================================================================================
 
 static void processPingRx (xref2osjob_t osjob) {
-    if( LMIC.dataLen != 0 ) {
-        LMIC.txrxFlags = TXRX_PING;
-        if( decodeFrame() ) {
-            reportEvent(EV_RXCOMPLETE);
+    lmic_ctx* ctx = jobCtx(osjob);
+    if( ctx->dataLen != 0 ) {
+        ctx->txrxFlags = TXRX_PING;
+        if( decodeFrame(ctx) ) {
+            reportEvent(ctx, EV_RXCOMPLETE);
             return;
         }
     }
     // Pick next ping slot
-    engineUpdate();
+    engineUpdate(ctx);
 }
 
 
-static bit_t processDnData (void) {
-    ASSERT((LMIC.opmode & OP_TXRXPEND)!=0);
+static bit_t processDnData (lmic_ctx* ctx) {
+    ASSERT((ctx->opmode & OP_TXRXPEND)!=0);
 
-    if( LMIC.dataLen == 0 ) {
+    if( ctx->dataLen == 0 ) {
       norx:
-        if( LMIC.txCnt != 0 ) {
-            if( LMIC.txCnt < TXCONF_ATTEMPTS ) {
-                LMIC.txCnt += 1;
-                setDrTxpow(DRCHG_NOACK, lowerDR(LMIC.datarate, DRADJUST[LMIC.txCnt]), KEEP_TXPOW);
+        if( ctx->txCnt != 0 ) {
+            if( ctx->txCnt < TXCONF_ATTEMPTS ) {
+                ctx->txCnt += 1;
+                setDrTxpow(ctx, DRCHG_NOACK, lowerDR(ctx->datarate, DRADJUST[ctx->txCnt]), KEEP_TXPOW);
                 // Schedule another retransmission
-                txDelay(LMIC.rxtime, RETRY_PERIOD_secs);
-                LMIC.opmode &= ~OP_TXRXPEND;
-                engineUpdate();
+                txDelay(ctx, ctx->rxtime, RETRY_PERIOD_secs);
+                ctx->opmode &= ~OP_TXRXPEND;
+                engineUpdate(ctx);
                 return 1;
             }
-            LMIC.txrxFlags = TXRX_NACK | TXRX_NOPORT;
+            ctx->txrxFlags = TXRX_NACK | TXRX_NOPORT;
         } else {
             // Nothing received - implies no port
-            LMIC.txrxFlags = TXRX_NOPORT;
+            ctx->txrxFlags = TXRX_NOPORT;
         }
-        if( LMIC.adrAckReq != LINK_CHECK_OFF )
-            LMIC.adrAckReq += 1;
-        LMIC.dataBeg = LMIC.dataLen = 0;
+        if( ctx->adrAckReq != LINK_CHECK_OFF )
+            ctx->adrAckReq += 1;
+        ctx->dataBeg = ctx->dataLen = 0;
       txcomplete:
-        LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
-        if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (LMIC.opmode & OP_LINKDEAD) != 0 ) {
-            LMIC.opmode &= ~OP_LINKDEAD;
-            reportEvent(EV_LINK_ALIVE);
+        ctx->opmode &= ~(OP_TXDATA|OP_TXRXPEND);
+        saveSession(ctx, 0);
+        txqDone(ctx, ctx->txrxFlags);
+        if( (ctx->txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (ctx->opmode & OP_LINKDEAD) != 0 ) {
+            ctx->opmode &= ~OP_LINKDEAD;
+            reportEvent(ctx, EV_LINK_ALIVE);
         }
-        reportEvent(EV_TXCOMPLETE);
+        reportEvent(ctx, EV_TXCOMPLETE);
         // If we haven't heard from NWK in a while although we asked for a sign
         // assume link is dead - notify application and keep going
-        if( LMIC.adrAckReq > LINK_CHECK_DEAD ) {
+        if( ctx->adrAckReq > LINK_CHECK_DEAD ) {
             // We haven't heard from NWK for some time although we
             // asked for a response for some time - assume we're disconnected. Lower DR one notch.
             EV(devCond, ERR, (e_.reason = EV::devCond_t::LINK_DEAD,
                               e_.eui    = MAIN::CDEV->getEui(),
-                              e_.info   = LMIC.adrAckReq));
-            setDrTxpow(DRCHG_NOADRACK, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
-            LMIC.adrAckReq = LINK_CHECK_CONT;
-            LMIC.opmode |= OP_REJOIN|OP_LINKDEAD;
-            reportEvent(EV_LINK_DEAD);
+                              e_.info   = ctx->adrAckReq));
+            setDrTxpow(ctx, DRCHG_NOADRACK, decDR((dr_t)ctx->datarate), KEEP_TXPOW);
+            ctx->adrAckReq = LINK_CHECK_CONT;
+            ctx->opmode |= OP_REJOIN|OP_LINKDEAD;
+            reportEvent(ctx, EV_LINK_DEAD);
         }
         // If this falls to zero the NWK did not answer our MCMD_BCNI_REQ commands - try full scan
-        if( LMIC.bcninfoTries > 0 ) {
-            if( (LMIC.opmode & OP_TRACK) != 0 ) {
-                reportEvent(EV_BEACON_FOUND);
-                LMIC.bcninfoTries = 0;
+        if( ctx->bcninfoTries > 0 ) {
+            if( (ctx->opmode & OP_TRACK) != 0 ) {
+                reportEvent(ctx, EV_BEACON_FOUND);
+                ctx->bcninfoTries = 0;
             }
-            else if( --LMIC.bcninfoTries == 0 ) {
-                startScan();   // NWK did not answer - try scan
+            else if( --ctx->bcninfoTries == 0 ) {
+                startScan(ctx);   // NWK did not answer - try scan
             }
         }
         return 1;
     }
-    if( !decodeFrame() ) {
-        if( (LMIC.txrxFlags & TXRX_DNW1) != 0 )
+    if( !decodeFrame(ctx) ) {
+        if( (ctx->txrxFlags & TXRX_DNW1) != 0 )
             return 0;
         goto norx;
     }
@@ -1820,196 +2141,212 @@ static bit_t processDnData (void) {
 
 
 static void processBeacon (xref2osjob_t osjob) {
-    ostime_t lasttx = LMIC.bcninfo.txtime;   // save here - decodeBeacon might overwrite
-    u1_t flags = LMIC.bcninfo.flags;
+    lmic_ctx* ctx = jobCtx(osjob);
+    ostime_t lasttx = ctx->bcninfo.txtime;   // save here - decodeBeacon might overwrite
+    u1_t flags = ctx->bcninfo.flags;
     ev_t ev;
 
-    if( LMIC.dataLen != 0 && decodeBeacon() >= 1 ) {
+    if( ctx->dataLen != 0 && decodeBeacon(ctx) >= 1 ) {
         ev = EV_BEACON_TRACKED;
         if( (flags & (BCN_PARTIAL|BCN_FULL)) == 0 ) {
             // We don't have a previous beacon to calc some drift - assume
             // an max error of 13ms = 128sec*100ppm which is roughly +/-100ppm
-            calcBcnRxWindowFromMillis(13,0);
+            calcBcnRxWindowFromMillis(ctx, 13,0);
             goto rev;
         }
         // We have a previous BEACON to calculate some drift
-        s2_t drift = BCN_INTV_osticks - (LMIC.bcninfo.txtime - lasttx);
-        if( LMIC.missedBcns > 0 ) {
-            drift = LMIC.drift + (drift - LMIC.drift) / (LMIC.missedBcns+1);
+        s2_t drift = BCN_INTV_osticks - (ctx->bcninfo.txtime - lasttx);
+        if( ctx->missedBcns > 0 ) {
+            drift = ctx->drift + (drift - ctx->drift) / (ctx->missedBcns+1);
         }
-        if( (LMIC.bcninfo.flags & BCN_NODRIFT) == 0 ) {
-            s2_t diff = LMIC.drift - drift;
+        if( (ctx->bcninfo.flags & BCN_NODRIFT) == 0 ) {
+            s2_t diff = ctx->drift - drift;
             if( diff < 0 ) diff = -diff;
-            LMIC.lastDriftDiff = diff;
-            if( LMIC.maxDriftDiff < diff )
-                LMIC.maxDriftDiff = diff;
-            LMIC.bcninfo.flags &= ~BCN_NODDIFF;
+            ctx->lastDriftDiff = diff;
+            if( ctx->maxDriftDiff < diff )
+                ctx->maxDriftDiff = diff;
+            ctx->bcninfo.flags &= ~BCN_NODDIFF;
         }
-        LMIC.drift = drift;
-        LMIC.missedBcns = LMIC.rejoinCnt = 0;
-        LMIC.bcninfo.flags &= ~BCN_NODRIFT;
+        ctx->drift = drift;
+        ctx->missedBcns = ctx->rejoinCnt = 0;
+        ctx->bcninfo.flags &= ~BCN_NODRIFT;
         EV(devCond,INFO,(e_.reason = EV::devCond_t::CLOCK_DRIFT,
                          e_.eui    = MAIN::CDEV->getEui(),
                          e_.info   = drift,
                          e_.info2  = /*occasion BEACON*/0));
-        ASSERT((LMIC.bcninfo.flags & (BCN_PARTIAL|BCN_FULL)) != 0);
+        ASSERT((ctx->bcninfo.flags & (BCN_PARTIAL|BCN_FULL)) != 0);
     } else {
         ev = EV_BEACON_MISSED;
-        LMIC.bcninfo.txtime += BCN_INTV_osticks - LMIC.drift;
-        LMIC.bcninfo.time   += BCN_INTV_sec;
-        LMIC.missedBcns++;
+        ctx->bcninfo.txtime += BCN_INTV_osticks - ctx->drift;
+        ctx->bcninfo.time   += BCN_INTV_sec;
+        ctx->missedBcns++;
         // Delay any possible TX after surmised beacon - it's there although we missed it
-        txDelay(LMIC.bcninfo.txtime + BCN_RESERVE_osticks, 4);
-        if( LMIC.missedBcns > MAX_MISSED_BCNS )
-            LMIC.opmode |= OP_REJOIN;  // try if we can roam to another network
-        if( LMIC.bcnRxsyms > MAX_RXSYMS ) {
-            LMIC.opmode &= ~(OP_TRACK|OP_PINGABLE|OP_PINGINI|OP_REJOIN);
-            reportEvent(EV_LOST_TSYNC);
+        txDelay(ctx, ctx->bcninfo.txtime + BCN_RESERVE_osticks, 4);
+        if( ctx->missedBcns > MAX_MISSED_BCNS )
+            ctx->opmode |= OP_REJOIN;  // try if we can roam to another network
+        if( ctx->bcnRxsyms > MAX_RXSYMS ) {
+            ctx->opmode &= ~(OP_TRACK|OP_PINGABLE|OP_PINGINI|OP_REJOIN);
+            reportEvent(ctx, EV_LOST_TSYNC);
             return;
         }
     }
-    LMIC.bcnRxtime = LMIC.bcninfo.txtime + BCN_INTV_osticks - calcRxWindow(0,DR_BCN);
-    LMIC.bcnRxsyms = LMIC.rxsyms;    
+    ctx->bcnRxtime = ctx->bcninfo.txtime + BCN_INTV_osticks - calcRxWindow(ctx, 0,DR_BCN);
+    ctx->bcnRxsyms = ctx->rxsyms;    
   rev:
 #if CFG_us915
-    LMIC.bcnChnl = (LMIC.bcnChnl+1) & 7;
+    ctx->bcnChnl = (ctx->bcnChnl+1) & 7;
 #endif
-    if( (LMIC.opmode & OP_PINGINI) != 0 )
-        rxschedInit(&LMIC.ping);  // note: reuses LMIC.frame buffer!
-    reportEvent(ev);
+    if( (ctx->opmode & OP_PINGINI) != 0 )
+        rxschedInit(ctx, &ctx->ping);  // note: reuses ctx->frame buffer!
+    reportEvent(ctx, ev);
 }
 
 
 static void startRxBcn (xref2osjob_t osjob) {
-    LMIC.osjob.func = FUNC_ADDR(processBeacon);
-    os_radio(RADIO_RX);
+    lmic_ctx* ctx = jobCtx(osjob);
+    ctx->osjob.func = FUNC_ADDR(processBeacon);
+    os_radio(ctx, RADIO_RX);
 }
 
 
 static void startRxPing (xref2osjob_t osjob) {
-    LMIC.osjob.func = FUNC_ADDR(processPingRx);
-    os_radio(RADIO_RX);
+    lmic_ctx* ctx = jobCtx(osjob);
+    ctx->osjob.func = FUNC_ADDR(processPingRx);
+    os_radio(ctx, RADIO_RX);
 }
 
 
 // Decide what to do next for the MAC layer of a device
-static void engineUpdate (void) {
+static void engineUpdate (lmic_ctx* ctx) {
     // Check for ongoing state: scan or TX/RX transaction
-    if( (LMIC.opmode & (OP_SCAN|OP_TXRXPEND|OP_SHUTDOWN)) != 0 ) 
+    if( (ctx->opmode & (OP_SCAN|OP_TXRXPEND|OP_SHUTDOWN)) != 0 ) 
         return;
 
-    if( LMIC.devaddr == 0 && (LMIC.opmode & OP_JOINING) == 0 ) {
-        LMIC_startJoining();
+    if( ctx->devaddr == 0 && (ctx->opmode & OP_JOINING) == 0 ) {
+        lmic_startJoining(ctx);
         return;
     }
+    if( (ctx->opmode & (OP_TXDATA|OP_JOINING)) == 0 && ctx->txqLen != 0 ) {
+        // Send queued messages with the next frame
+        ctx->opmode |= OP_TXDATA;
+        ctx->txCnt = 0;
+        ctx->txqLoad = 1;
+    }
 
     ostime_t now    = os_getTime();
     ostime_t rxtime = 0;
     ostime_t txbeg  = 0;
 
-    if( (LMIC.opmode & OP_TRACK) != 0 ) {
+    if( (ctx->opmode & OP_TRACK) != 0 ) {
         // We are tracking a beacon
-        ASSERT( now + RX_RAMPUP - LMIC.bcnRxtime <= 0 );
-        rxtime = LMIC.bcnRxtime - RX_RAMPUP;
+        ASSERT( now + RX_RAMPUP - ctx->bcnRxtime <= 0 );
+        rxtime = ctx->bcnRxtime - RX_RAMPUP;
     }
 
-    if( (LMIC.opmode & (OP_JOINING|OP_REJOIN|OP_TXDATA|OP_POLL)) != 0 ) {
+    if( (ctx->opmode & (OP_JOINING|OP_REJOIN|OP_TXDATA|OP_POLL)) != 0 ) {
         // Need to TX some data...
         // Assuming txChnl points to channel which first becomes available again.
-        bit_t jacc = ((LMIC.opmode & (OP_JOINING|OP_REJOIN)) != 0 ? 1 : 0);
+        bit_t jacc = ((ctx->opmode & (OP_JOINING|OP_REJOIN)) != 0 ? 1 : 0);
         // Find next suitable channel and return availability time
-        if( (LMIC.opmode & OP_NEXTCHNL) != 0 ) {
-            txbeg = LMIC.txend = nextTx(now);
-            LMIC.opmode &= ~OP_NEXTCHNL;
+        if( (ctx->opmode & OP_NEXTCHNL) != 0 ) {
+            txbeg = ctx->txend = nextTx(ctx, now);
+            ctx->opmode &= ~OP_NEXTCHNL;
         } else {
-            txbeg = LMIC.txend;
+            txbeg = ctx->txend;
         }
         // Delayed TX or waiting for duty cycle?
-        if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  (txbeg - LMIC.globalDutyAvail) < 0 )
-            txbeg = LMIC.globalDutyAvail;
+        if( (ctx->globalDutyRate != 0 || (ctx->opmode & OP_RNDTX) != 0)  &&  (txbeg - dutyTime(ctx->globalDutyAvail)) < 0 )
+            txbeg = dutyTime(ctx->globalDutyAvail);
         // If we're tracking a beacon...
         // then make sure TX-RX transaction is complete before beacon
-        if( (LMIC.opmode & OP_TRACK) != 0 &&
+        if( (ctx->opmode & OP_TRACK) != 0 &&
             txbeg + (jacc ? JOIN_GUARD_osticks : TXRX_GUARD_osticks) - rxtime > 0 ) {
             // Not enough time to complete TX-RX before beacon - postpone after beacon.
             // In order to avoid clustering of postponed TX right after beacon randomize start!
-            txDelay(rxtime + BCN_RESERVE_osticks, 16);
+            txDelay(ctx, rxtime + BCN_RESERVE_osticks, 16);
             txbeg = 0;
             goto checkrx;
         }
         // Earliest possible time vs overhead to setup radio
-        if( txbeg - (now + TX_RAMPUP) < 0 ) {
+        if( txbeg - (now + TX_RAMPUP) <= 0 ) {
             // We could send right now!
         txbeg = now;
-            dr_t txdr = (dr_t)LMIC.datarate;
+            dr_t txdr = (dr_t)ctx->datarate;
             if( jacc ) {
                 u1_t ftype;
-                if( (LMIC.opmode & OP_REJOIN) != 0 ) {
-                    txdr = lowerDR(txdr, LMIC.rejoinCnt);
+                if( (ctx->opmode & OP_REJOIN) != 0 ) {
+                    txdr = lowerDR(txdr, ctx->rejoinCnt);
                     ftype = HDR_FTYPE_REJOIN;
                 } else {
                     ftype = HDR_FTYPE_JREQ;
                 }
-                buildJoinRequest(ftype);
-                LMIC.osjob.func = FUNC_ADDR(jreqDone);
+                buildJoinRequest(ctx, ftype);
+                ctx->osjob.func = FUNC_ADDR(jreqDone);
             } else {
-                if( LMIC.seqnoDn >= 0xFFFFFF80 ) {
+                if( ctx->seqnoDn >= 0xFFFFFF80 ) {
                     // Imminent roll over - proactively reset MAC
                     EV(specCond, INFO, (e_.reason = EV::specCond_t::DNSEQNO_ROLL_OVER,
                                         e_.eui    = MAIN::CDEV->getEui(),
-                                        e_.info   = LMIC.seqnoDn, 
+                                        e_.info   = ctx->seqnoDn, 
                                         e_.info2  = 0));
                     // Device has to react! NWK will not roll over and just stop sending.
                     // Thus, we have N frames to detect a possible lock up.
                   reset:
-                    os_setCallback(&LMIC.osjob, FUNC_ADDR(runReset));
+                    os_setCallback(&ctx->osjob, FUNC_ADDR(runReset));
                     return;
                 }
-                if( (LMIC.txCnt==0 && LMIC.seqnoUp == 0xFFFFFFFF) ) {
+                if( (ctx->txCnt==0 && ctx->seqnoUp == 0xFFFFFFFF) ) {
                     // Roll over of up seq counter
                     EV(specCond, ERR, (e_.reason = EV::specCond_t::UPSEQNO_ROLL_OVER,
                                        e_.eui    = MAIN::CDEV->getEui(),
-                                       e_.info2  = LMIC.seqnoUp));
+                                       e_.info2  = ctx->seqnoUp));
                     // Do not run RESET event callback from here!
                     // App code might do some stuff after send unaware of RESET.
                     goto reset;
                 }
-                buildDataFrame();
-                LMIC.osjob.func = FUNC_ADDR(updataDone);
+                if( ctx->txqLoad && ctx->txCnt == 0 && !loadTxq(ctx) ) {
+                    // Nothing queued fits a frame any more
+                    ctx->opmode &= ~OP_TXDATA;
+                    engineUpdate(ctx);
+                    return;
+                }
+                buildDataFrame(ctx);
+                ctx->osjob.func = FUNC_ADDR(updataDone);
             }
-            LMIC.rps    = setCr(updr2rps(txdr), (cr_t)LMIC.errcr);
-            LMIC.dndr   = txdr;  // carry TX datarate (can be != LMIC.datarate) over to txDone/setupRx1
-            LMIC.opmode = (LMIC.opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
-            updateTx(txbeg);
-            os_radio(RADIO_TX);
+            ctx->rps    = setCr(updr2rps(txdr), (cr_t)ctx->errcr);
+            ctx->dndr   = txdr;  // carry TX datarate (can be != ctx->datarate) over to txDone/setupRx1
+            ctx->opmode = (ctx->opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
+            updateTx(ctx, txbeg);
+            os_radio(ctx, RADIO_TX);
+            saveSession(ctx, 0);  // seqnoUp and duty cycle, while the frame is on air
             return;
         }
         // Cannot yet TX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (ctx->opmode & OP_TRACK) == 0 )
             goto txdelay; // We don't track the beacon - nothing else to do - so wait for the time to TX
         // Consider RX tasks
         if( txbeg == 0 ) // zero indicates no TX pending
             txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
     } else {
         // No TX pending - no scheduled RX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (ctx->opmode & OP_TRACK) == 0 )
             return;
     }
 
     // Are we pingable?
   checkrx:
-    if( (LMIC.opmode & OP_PINGINI) != 0 ) {
+    if( (ctx->opmode & OP_PINGINI) != 0 ) {
         // One more RX slot in this beacon period?
-        if( rxschedNext(&LMIC.ping, now+RX_RAMPUP) ) {
-            if( txbeg != 0  &&  (txbeg - LMIC.ping.rxtime) < 0 )
+        if( rxschedNext(ctx, &ctx->ping, now+RX_RAMPUP) ) {
+            if( txbeg != 0  &&  (txbeg - ctx->ping.rxtime) < 0 )
                 goto txdelay;
-            LMIC.rxsyms  = LMIC.ping.rxsyms;
-            LMIC.rxtime  = LMIC.ping.rxtime;
-            LMIC.freq    = LMIC.ping.freq;
-            LMIC.rps     = dndr2rps(LMIC.ping.dr);
-            LMIC.dataLen = 0;
-            ASSERT(LMIC.rxtime - now+RX_RAMPUP >= 0 );
-            os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, FUNC_ADDR(startRxPing));
+            ctx->rxsyms  = ctx->ping.rxsyms;
+            ctx->rxtime  = ctx->ping.rxtime;
+            ctx->freq    = ctx->ping.freq;
+            ctx->rps     = dndr2rps(ctx->ping.dr);
+            ctx->dataLen = 0;
+            ASSERT(ctx->rxtime - now+RX_RAMPUP >= 0 );
+            os_setTimedCallback(&ctx->osjob, ctx->rxtime - RX_RAMPUP, FUNC_ADDR(startRxPing));
             return;
         }
         // no - just wait for the beacon
@@ -2018,124 +2355,314 @@ static void engineUpdate (void) {
     if( txbeg != 0  &&  (txbeg - rxtime) < 0 )
         goto txdelay;
 
-    setBcnRxParams();
-    LMIC.rxsyms = LMIC.bcnRxsyms;
-    LMIC.rxtime = LMIC.bcnRxtime;
+    setBcnRxParams(ctx);
+    ctx->rxsyms = ctx->bcnRxsyms;
+    ctx->rxtime = ctx->bcnRxtime;
     if( now - rxtime >= 0 ) {
-        LMIC.osjob.func = FUNC_ADDR(processBeacon);
-        os_radio(RADIO_RX);
+        ctx->osjob.func = FUNC_ADDR(processBeacon);
+        os_radio(ctx, RADIO_RX);
         return;
     }
-    os_setTimedCallback(&LMIC.osjob, rxtime, FUNC_ADDR(startRxBcn));
+    os_setTimedCallback(&ctx->osjob, rxtime, FUNC_ADDR(startRxBcn));
     return;
 
   txdelay:
     EV(devCond, INFO, (e_.reason = EV::devCond_t::TX_DELAY,
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = osticks2ms(txbeg-now),
-                       e_.info2  = LMIC.seqnoUp-1));
-    os_setTimedCallback(&LMIC.osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
+                       e_.info2  = ctx->seqnoUp-1));
+    os_setTimedCallback(&ctx->osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
 }
 
 
-void LMIC_setAdrMode (bit_t enabled) {
-    LMIC.adrEnabled = enabled ? FCT_ADREN : 0;
+void lmic_setAdrMode (lmic_ctx* ctx, bit_t enabled) {
+    ctx->adrEnabled = enabled ? FCT_ADREN : 0;
 }
 
 
 //  Should we have/need an ext. API like this?
-void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
-    setDrTxpow(DRCHG_SET, dr, txpow);
+void lmic_setDrTxpow (lmic_ctx* ctx, dr_t dr, s1_t txpow) {
+    setDrTxpow(ctx, DRCHG_SET, dr, txpow);
 }
 
 
-void LMIC_shutdown (void) {
-    os_clearCallback(&LMIC.osjob);
-    os_radio(RADIO_RST);
-    LMIC.opmode |= OP_SHUTDOWN;
+void lmic_shutdown (lmic_ctx* ctx) {
+    os_clearCallback(&ctx->osjob);
+    os_radio(ctx, RADIO_RST);
+    ctx->opmode |= OP_SHUTDOWN;
 }
 
 
-void LMIC_reset (void) {
+static void resetState (lmic_ctx* ctx) {
     EV(devCond, INFO, (e_.reason = EV::devCond_t::LMIC_EV,
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = EV_RESET));
-    os_radio(RADIO_RST);
-    os_clearCallback(&LMIC.osjob);
-
-    os_clearMem((xref2u1_t)&LMIC,SIZEOFEXPR(LMIC));
-    LMIC.devaddr      =  0;
-    LMIC.devNonce     =  os_getRndU2();
-    LMIC.opmode       =  OP_NONE;
-    LMIC.errcr        =  CR_4_5;
-    LMIC.adrEnabled   =  FCT_ADREN;
-    LMIC.dn2Dr        =  DR_DNW2;   // we need this for 2nd DN window of join accept
-    LMIC.dn2Freq      =  FREQ_DNW2; // ditto
-    LMIC.ping.freq    =  FREQ_PING; // defaults for ping
-    LMIC.ping.dr      =  DR_PING;   // ditto
-    LMIC.ping.intvExp =  0xFF;
+    // report queued messages before they are cleared (messages the callback
+    // queues again are discarded)
+    txqFlush(ctx);
+    os_radio(ctx, RADIO_RST);
+    os_clearCallback(&ctx->osjob);
+    os_clearCallback(&ctx->txqjob);
+
+    struct lmic_t keep;
+    keep.cfg = ctx->cfg;
+    os_clearMem((xref2u1_t)ctx,SIZEOFEXPR(*ctx));
+    ctx->cfg = keep.cfg;
+    ctx->devaddr      =  0;
+    ctx->devNonce     =  os_getRndU2();
+    ctx->opmode       =  OP_NONE;
+    ctx->errcr        =  CR_4_5;
+    ctx->adrEnabled   =  FCT_ADREN;
+    ctx->dn2Dr        =  DR_DNW2;   // we need this for 2nd DN window of join accept
+    ctx->dn2Freq      =  FREQ_DNW2; // ditto
+    ctx->ping.freq    =  FREQ_PING; // defaults for ping
+    ctx->ping.dr      =  DR_PING;   // ditto
+    ctx->ping.intvExp =  0xFF;
 #if defined(CFG_us915)
-    initDefaultChannels();
+    initDefaultChannels(ctx);
+#endif
+    DO_DEVDB(ctx->devaddr,      devaddr);
+    DO_DEVDB(ctx->devNonce,     devNonce);
+    DO_DEVDB(ctx->dn2Dr,        dn2Dr);
+    DO_DEVDB(ctx->dn2Freq,      dn2Freq);
+    DO_DEVDB(ctx->ping.freq,    pingFreq);
+    DO_DEVDB(ctx->ping.dr,      pingDr);
+    DO_DEVDB(ctx->ping.intvExp, pingIntvExp);
+}
+
+//! Reset the MAC state. With a session store (lmic_openStore()) the stored
+//! session is resumed, else session and pending data transfers are discarded.
+void lmic_reset (lmic_ctx* ctx) {
+    resetState(ctx);
+    lmic_session_t s;
+    if( ctx->cfg.store != 0 && os_storeLoad(ctx->cfg.store, &s, NULL) && s.devaddr != 0 )
+        lmic_setSession(ctx, s.netid, s.devaddr, s.nwkKey, s.artKey);
+}
+
+
+void lmic_init (lmic_ctx* ctx) {
+    ctx->opmode = OP_SHUTDOWN;
+#if defined(CFG_jobstats)
+    os_setJobName(FUNC_ADDR(runEngineUpdate),       "runEngineUpdate");
+    os_setJobName(FUNC_ADDR(runReset),              "runReset");
+    os_setJobName(FUNC_ADDR(runTxq),                "runTxq");
+    os_setJobName(FUNC_ADDR(onJoinFailed),          "onJoinFailed");
+    os_setJobName(FUNC_ADDR(processRx2Jacc),        "processRx2Jacc");
+    os_setJobName(FUNC_ADDR(setupRx2Jacc),          "setupRx2Jacc");
+    os_setJobName(FUNC_ADDR(processRx1Jacc),        "processRx1Jacc");
+    os_setJobName(FUNC_ADDR(setupRx1Jacc),          "setupRx1Jacc");
+    os_setJobName(FUNC_ADDR(jreqDone),              "jreqDone");
+    os_setJobName(FUNC_ADDR(processRx2DnDataDelay), "processRx2DnDataDelay");
+    os_setJobName(FUNC_ADDR(processRx2DnData),      "processRx2DnData");
+    os_setJobName(FUNC_ADDR(setupRx2DnData),        "setupRx2DnData");
+    os_setJobName(FUNC_ADDR(processRx1DnData),      "processRx1DnData");
+    os_setJobName(FUNC_ADDR(setupRx1DnData),        "setupRx1DnData");
+    os_setJobName(FUNC_ADDR(updataDone),            "updataDone");
+    os_setJobName(FUNC_ADDR(onBcnRx),               "onBcnRx");
+    os_setJobName(FUNC_ADDR(startJoining),          "startJoining");
+    os_setJobName(FUNC_ADDR(processPingRx),         "processPingRx");
+    os_setJobName(FUNC_ADDR(processBeacon),         "processBeacon");
+    os_setJobName(FUNC_ADDR(startRxBcn),            "startRxBcn");
+    os_setJobName(FUNC_ADDR(startRxPing),           "startRxPing");
 #endif
-    DO_DEVDB(LMIC.devaddr,      devaddr);
-    DO_DEVDB(LMIC.devNonce,     devNonce);
-    DO_DEVDB(LMIC.dn2Dr,        dn2Dr);
-    DO_DEVDB(LMIC.dn2Freq,      dn2Freq);
-    DO_DEVDB(LMIC.ping.freq,    pingFreq);
-    DO_DEVDB(LMIC.ping.dr,      pingDr);
-    DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
-}
-
-
-void LMIC_init (void) {
-    LMIC.opmode = OP_SHUTDOWN;
 }
 
 
-void LMIC_clrTxData (void) {
-    LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND|OP_POLL);
-    LMIC.pendTxLen = 0;
-    if( (LMIC.opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
+void lmic_clrTxData (lmic_ctx* ctx) {
+    ctx->opmode &= ~(OP_TXDATA|OP_TXRXPEND|OP_POLL);
+    ctx->pendTxLen = 0;
+    txqFlush(ctx);
+    if( (ctx->opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
         return;
-    os_clearCallback(&LMIC.osjob);
-    os_radio(RADIO_RST);
-    engineUpdate();
+    os_clearCallback(&ctx->osjob);
+    os_radio(ctx, RADIO_RST);
+    engineUpdate(ctx);
 }
 
 
-void LMIC_setTxData (void) {
-    LMIC.opmode |= OP_TXDATA;
-    if( (LMIC.opmode & OP_JOINING) == 0 )
-        LMIC.txCnt = 0;             // cancel any ongoing TX/RX retries
-    engineUpdate();
+void lmic_setTxData (lmic_ctx* ctx) {
+    if( (ctx->opmode & OP_TXRXPEND) == 0 ) {
+        // pendTxData is replaced: queued messages of a frame waiting for a
+        // confirmed retry go back to the queue and are sent again
+        for( u1_t i=0; i<ctx->txqLen; i++ )
+            ctx->txq[i].inflight = 0;
+    }
+    ctx->opmode |= OP_TXDATA;
+    if( (ctx->opmode & OP_JOINING) == 0 )
+        ctx->txCnt = 0;             // cancel any ongoing TX/RX retries
+    engineUpdate(ctx);
 }
 
 
 //
-int LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
-    if( dlen > SIZEOFEXPR(LMIC.pendTxData) )
+int lmic_setTxData2 (lmic_ctx* ctx, u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
+    if( dlen > SIZEOFEXPR(ctx->pendTxData) )
         return -2;
     if( data != (xref2u1_t)0 )
-        os_copyMem(LMIC.pendTxData, data, dlen);
-    LMIC.pendTxConf = confirmed;
-    LMIC.pendTxPort = port;
-    LMIC.pendTxLen  = dlen;
-    LMIC_setTxData();
+        os_copyMem(ctx->pendTxData, data, dlen);
+    ctx->pendTxConf = confirmed;
+    ctx->pendTxPort = port;
+    ctx->pendTxLen  = dlen;
+    ctx->txqLoad    = 0;  // queued messages follow with the next frame
+    lmic_setTxData(ctx);
     return 0;
 }
 
+//! Queue an uplink message. Messages go out by priority (higher first), oldest
+//! first within a priority. Messages for the same port and confirmation mode
+//! are concatenated into one frame as far as they fit, so their payload must
+//! be self-delimiting. Each message is reported to the callback set with
+//! lmic_setTxCallback() once its frame is done.
+//! Returns the message id (>0), -1 if the queue is full or -2 if the message
+//! does not fit a frame at the current data rate.
+int lmic_queueTx (lmic_ctx* ctx, u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed, u1_t prio) {
+    if( dlen > maxPayload(ctx) )
+        return -2;
+    if( ctx->txqLen == TXQ_LEN )
+        return -1;
+    if( ++ctx->txqNextId == 0 )
+        ctx->txqNextId = 1;
+    struct lmic_txmsg_t* m = &ctx->txq[ctx->txqLen++];
+    m->id       = ctx->txqNextId;
+    m->port     = port;
+    m->prio     = prio;
+    m->conf     = confirmed;
+    m->inflight = 0;
+    m->len      = dlen;
+    os_copyMem(m->data, data, dlen);
+    // start sending from the run loop, so that messages queued together can
+    // share a frame
+    os_setCallback(&ctx->txqjob, runTxq);
+    return m->id;
+}
+
 
 // Send a payload-less message to signal device is alive
-void LMIC_sendAlive (void) {
-    LMIC.opmode |= OP_POLL;
-    engineUpdate();
+void lmic_sendAlive (lmic_ctx* ctx) {
+    ctx->opmode |= OP_POLL;
+    engineUpdate(ctx);
 }
 
 
 // Check if other networks are around.
-void LMIC_tryRejoin (void) {
-    LMIC.opmode |= OP_REJOIN;
-    engineUpdate();
+void lmic_tryRejoin (lmic_ctx* ctx) {
+    ctx->opmode |= OP_REJOIN;
+    engineUpdate(ctx);
+}
+
+// ================================================================================
+// Session store
+// The state needed to continue a session after a restart is saved whenever a
+// frame goes on air and after every TX/RX transaction. These saves are not
+// synced to disk; only reserving a block of FCNT_RESERVE uplink counters
+// is, and a restart continues after the reserved block. Times are saved as
+// waits relative to the save, the age of the copy is deducted on restore.
+
+static u4_t waitFrom (ostime64_t now, ostime64_t avail) {
+    return avail <= now ? 0 : avail - now > 0xFFFFFFFF ? 0xFFFFFFFF : (u4_t)(avail - now);
+}
+
+static ostime64_t availAfter (ostime64_t now, u4_t wait, ostime64_t age) {
+    return wait > age ? now + wait - age : now;
+}
+
+static void saveSession (lmic_ctx* ctx, bit_t durable) {
+    if( ctx->cfg.store == 0 )
+        return;
+    lmic_session_t s;
+    os_clearMem(&s, sizeof(s));  // devaddr 0: no session
+    if( ctx->devaddr != 0 ) {
+        ostime64_t now = os_getTime64();
+        s.netid          = ctx->netid;
+        s.devaddr        = ctx->devaddr;
+        os_copyMem(s.nwkKey, ctx->nwkKey, 16);
+        os_copyMem(s.artKey, ctx->artKey, 16);
+        s.seqnoUp        = ctx->seqnoUp;
+        s.seqnoUpLimit   = ctx->seqnoUpLimit;
+        s.seqnoDn        = ctx->seqnoDn;
+        s.datarate       = ctx->datarate;
+        s.adrTxPow       = ctx->adrTxPow;
+        s.adrEnabled     = ctx->adrEnabled;
+        s.adrAckReq      = ctx->adrAckReq;
+        s.dn2Dr          = ctx->dn2Dr;
+        s.dn2Freq        = ctx->dn2Freq;
+        s.globalDutyRate = ctx->globalDutyRate;
+        s.globalDutyWait = waitFrom(now, ctx->globalDutyAvail);
+#if defined(CFG_eu868)
+        os_copyMem(s.channelFreq, ctx->channelFreq, sizeof(s.channelFreq));
+        os_copyMem(s.channelDrMap, ctx->channelDrMap, sizeof(s.channelDrMap));
+        os_copyMem(s.channelMap, ctx->channelMap, sizeof(s.channelMap));
+        for( u1_t b=0; b<MAX_BANDS; b++ ) {
+            s.bands[b].txcap    = ctx->bands[b].txcap;
+            s.bands[b].txpow    = ctx->bands[b].txpow;
+            s.bands[b].lastchnl = ctx->bands[b].lastchnl;
+            s.bands[b].wait     = waitFrom(now, ctx->bands[b].avail);
+            saveBandAirtime(&ctx->bands[b], now, s.bands[b].used);
+        }
+#elif defined(CFG_us915)
+        os_copyMem(s.xchFreq, ctx->xchFreq, sizeof(s.xchFreq));
+        os_copyMem(s.xchDrMap, ctx->xchDrMap, sizeof(s.xchDrMap));
+        os_copyMem(s.channelMap, ctx->channelMap, sizeof(s.channelMap));
+#endif
+    }
+    os_storeSave(ctx->cfg.store, &s, durable);
+}
+
+// resume the stored state if it belongs to the session set up in ctx
+static bit_t restoreSession (lmic_ctx* ctx) {
+    lmic_session_t s;
+    u4_t agems;
+    if( ctx->cfg.store == 0 || !os_storeLoad(ctx->cfg.store, &s, &agems) ||
+        s.devaddr != ctx->devaddr || s.netid != ctx->netid ||
+        memcmp(s.nwkKey, ctx->nwkKey, 16) != 0 || memcmp(s.artKey, ctx->artKey, 16) != 0 )
+        return 0;
+    ostime64_t now = os_getTime64();
+    ostime64_t age = (ostime64_t)agems * OSTICKS_PER_SEC / 1000;
+    // the copy may be older than the last uplink, skip the reserved block
+    ctx->seqnoUp         = s.seqnoUpLimit > s.seqnoUp ? s.seqnoUpLimit : s.seqnoUp;
+    ctx->seqnoUpLimit    = ctx->seqnoUp;
+    ctx->seqnoDn         = s.seqnoDn;
+    ctx->datarate        = s.datarate;
+    ctx->adrTxPow        = s.adrTxPow;
+    ctx->adrEnabled      = s.adrEnabled;
+    ctx->adrAckReq       = s.adrAckReq;
+    ctx->dn2Dr           = s.dn2Dr;
+    ctx->dn2Freq         = s.dn2Freq;
+    ctx->globalDutyRate  = s.globalDutyRate;
+    ctx->globalDutyAvail = availAfter(now, s.globalDutyWait, age);
+#if defined(CFG_eu868)
+    os_copyMem(ctx->channelFreq, s.channelFreq, sizeof(s.channelFreq));
+    os_copyMem(ctx->channelDrMap, s.channelDrMap, sizeof(s.channelDrMap));
+    os_copyMem(ctx->channelMap, s.channelMap, sizeof(s.channelMap));
+    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ )
+        updateChannelMaps(ctx, chnl);
+    for( u1_t b=0; b<MAX_BANDS; b++ ) {
+        ctx->bands[b].txcap    = s.bands[b].txcap;
+        ctx->bands[b].txpow    = s.bands[b].txpow;
+        ctx->bands[b].lastchnl = s.bands[b].lastchnl;
+        ctx->bands[b].avail    = availAfter(now, s.bands[b].wait, age);
+        restoreBandAirtime(&ctx->bands[b], now, age, s.bands[b].used);
+    }
+#elif defined(CFG_us915)
+    os_copyMem(ctx->xchFreq, s.xchFreq, sizeof(s.xchFreq));
+    os_copyMem(ctx->xchDrMap, s.xchDrMap, sizeof(s.xchDrMap));
+    os_copyMem(ctx->channelMap, s.channelMap, sizeof(s.channelMap));
+#endif
+    return 1;
+}
+
+//! Keep the session of ctx in the file at path (created if missing) and
+//! resume it from there on lmic_reset() and lmic_setSession().
+//! Returns 0, or -1 if the file cannot be opened or mapped.
+int lmic_openStore (lmic_ctx* ctx, const char* path) {
+    lmic_closeStore(ctx);
+    ctx->cfg.store = os_storeOpen(path, sizeof(lmic_session_t));
+    return ctx->cfg.store != 0 ? 0 : -1;
+}
+
+void lmic_closeStore (lmic_ctx* ctx) {
+    os_storeClose(ctx->cfg.store);
+    ctx->cfg.store = 0;
 }
 
 //! \brief Setup given session keys
@@ -2144,35 +2671,74 @@ void LMIC_tryRejoin (void) {
 //! It is crucial that the combinations `devaddr/nwkkey` and `devaddr/artkey`
 //! are unique within the network identified by `netid`.
 //! NOTE: on Harvard architectures when session keys are in flash:
-//!  Caller has to fill in LMIC.{nwk,art}Key  before and pass {nwk,art}Key are NULL
+//!  Caller has to fill in ctx->{nwk,art}Key  before and pass {nwk,art}Key are NULL
 //! \param netid a 24 bit number describing the network id this device is using
 //! \param devaddr the 32 bit session address of the device. It is strongly recommended
 //!    to ensure that different devices use different numbers with high probability.
 //! \param nwkKey  the 16 byte network session key used for message integrity.
-//!     If NULL the caller has copied the key into `LMIC.nwkKey` before.
+//!     If NULL the caller has copied the key into `ctx->nwkKey` before.
 //! \param artKey  the 16 byte application router session key used for message confidentiality.
-//!     If NULL the caller has copied the key into `LMIC.artKey` before.
-void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey) {
-    LMIC.netid = netid;
-    LMIC.devaddr = devaddr;
+//!     If NULL the caller has copied the key into `ctx->artKey` before.
+//! If the session store holds state of this very session (same netid, devaddr
+//! and keys) frame counters, channels, ADR and duty cycle state are resumed.
+void lmic_setSession (lmic_ctx* ctx, u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey) {
+    ctx->netid = netid;
+    ctx->devaddr = devaddr;
     if( nwkKey != (xref2u1_t)0 )
-        os_copyMem(LMIC.nwkKey, nwkKey, 16);
+        os_copyMem(ctx->nwkKey, nwkKey, 16);
     if( artKey != (xref2u1_t)0 )
-        os_copyMem(LMIC.artKey, artKey, 16);
+        os_copyMem(ctx->artKey, artKey, 16);
+    setSessKeys(ctx);
     
 #if defined(CFG_eu868)
-    initDefaultChannels(0);
+    initDefaultChannels(ctx, 0);
 #endif
  
-    LMIC.opmode &= ~(OP_JOINING|OP_TRACK|OP_REJOIN|OP_TXRXPEND|OP_PINGINI);
-    LMIC.opmode |= OP_NEXTCHNL;
-    stateJustJoined();
-    DO_DEVDB(LMIC.netid,   netid);
-    DO_DEVDB(LMIC.devaddr, devaddr);
-    DO_DEVDB(LMIC.nwkKey,  nwkkey);
-    DO_DEVDB(LMIC.artKey,  artkey);
-    DO_DEVDB(LMIC.seqnoUp, seqnoUp);
-    DO_DEVDB(LMIC.seqnoDn, seqnoDn);
+    ctx->opmode &= ~(OP_JOINING|OP_TRACK|OP_REJOIN|OP_TXRXPEND|OP_PINGINI);
+    ctx->opmode |= OP_NEXTCHNL;
+    stateJustJoined(ctx);
+    restoreSession(ctx);
+    saveSession(ctx, 0);
+    DO_DEVDB(ctx->netid,   netid);
+    DO_DEVDB(ctx->devaddr, devaddr);
+    DO_DEVDB(ctx->nwkKey,  nwkkey);
+    DO_DEVDB(ctx->artKey,  artkey);
+    DO_DEVDB(ctx->seqnoUp, seqnoUp);
+    DO_DEVDB(ctx->seqnoDn, seqnoDn);
+}
+
+// Pick the channel for the next uplink at the current data rate (txChnl) and
+// return the earliest time it may be sent. Used by the MAC before every
+// uplink; exposed for planning tools.
+ostime_t lmic_selectChannel (lmic_ctx* ctx, ostime_t now) {
+    return nextTx(ctx, now);
+}
+
+//! Tell what the next uplink may use: when it can start at the earliest
+//! (as engineUpdate() would schedule it now, without beacon guard times), the
+//! largest application payload that fits one frame at the current data rate
+//! with the pending MAC options, and on EU868 the airtime left by band over
+//! the last hour.
+void lmic_getTxBudget (lmic_ctx* ctx, lmic_txbudget_t* budget) {
+    ostime_t now = os_getTime();
+    ostime_t txbeg = now;
+#if defined(CFG_eu868)
+    u8_t cand[MAX_BANDS][CHMAP_WORDS];
+    int band = nextBand(ctx, cand);
+    if( band >= 0 )
+        txbeg = dutyTime(ctx->bands[band].avail);
+    ostime64_t now64 = os_extendTime(now);
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ ) {
+        u2_t txcap = ctx->bands[bi].txcap;
+        ostime_t limit = 3600*OSTICKS_PER_SEC / (txcap > 1 ? txcap : 1);
+        ostime_t used = bandAirtime(&ctx->bands[bi], now64);
+        budget->bandLeft[bi] = used < limit ? limit - used : 0;
+    }
+#endif
+    if( (ctx->globalDutyRate != 0 || (ctx->opmode & OP_RNDTX) != 0)  &&  (txbeg - dutyTime(ctx->globalDutyAvail)) < 0 )
+        txbeg = dutyTime(ctx->globalDutyAvail);
+    budget->txbeg = txbeg;
+    budget->maxPayload = maxPayload(ctx);
 }
 
 // Enable/disable link check validation.
@@ -2183,9 +2749,131 @@ void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t
 // This mode can be disabled and no connectivity prove (ADRACKREQ) is requested
 // nor is the datarate changed.
 // This must be called only if a session is established (e.g. after EV_JOINED)
-void LMIC_setLinkCheckMode (bit_t enabled) {
-    LMIC.adrChanged = 0;
-    LMIC.adrAckReq = enabled ? LINK_CHECK_INIT : LINK_CHECK_OFF;
+void lmic_setLinkCheckMode (lmic_ctx* ctx, bit_t enabled) {
+    ctx->adrChanged = 0;
+    ctx->adrAckReq = enabled ? LINK_CHECK_INIT : LINK_CHECK_OFF;
 }
 
  
+
+// Report events of this context to evcb instead of onEvent().
+void lmic_setEventCallback (lmic_ctx* ctx, lmic_evcb_t evcb) {
+    ctx->cfg.evcb = evcb;
+}
+
+// Report queued messages (lmic_queueTx()) to this callback when done
+void lmic_setTxCallback (lmic_ctx* ctx, lmic_txcb_t txcb) {
+    ctx->cfg.txcb = txcb;
+}
+
+// Use these EUIs and device key for joining instead of asking
+// os_getArtEui(), os_getDevEui() and os_getDevKey().
+void lmic_setIdentity (lmic_ctx* ctx, xref2cu1_t artEui, xref2cu1_t devEui, xref2cu1_t devKey) {
+    os_copyMem(ctx->cfg.artEui, artEui, 8);
+    os_copyMem(ctx->cfg.devEui, devEui, 8);
+    os_copyMem(ctx->cfg.devKey, devKey, 16);
+    ctx->cfg.hasIdent = 1;
+    ctx->devRkOk = 0;
+}
+
+
+// ================================================================================
+// Default context
+
+#if defined(CFG_eu868)
+bit_t LMIC_setupBand (u1_t bandidx, s1_t txpow, u2_t txcap) {
+    return lmic_setupBand(&LMIC, bandidx, txpow, txcap);
+}
+#endif
+
+bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
+    return lmic_setupChannel(&LMIC, chidx, freq, drmap, band);
+}
+
+void LMIC_disableChannel (u1_t channel) {
+    lmic_disableChannel(&LMIC, channel);
+}
+
+void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
+    lmic_setDrTxpow(&LMIC, dr, txpow);
+}
+
+void LMIC_setAdrMode (bit_t enabled) {
+    lmic_setAdrMode(&LMIC, enabled);
+}
+
+bit_t LMIC_startJoining (void) {
+    return lmic_startJoining(&LMIC);
+}
+
+void LMIC_shutdown (void) {
+    lmic_shutdown(&LMIC);
+}
+
+void LMIC_init (void) {
+    lmic_init(&LMIC);
+}
+
+void LMIC_reset (void) {
+    lmic_reset(&LMIC);
+}
+
+void LMIC_clrTxData (void) {
+    lmic_clrTxData(&LMIC);
+}
+
+void LMIC_setTxData (void) {
+    lmic_setTxData(&LMIC);
+}
+
+int LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
+    return lmic_setTxData2(&LMIC, port, data, dlen, confirmed);
+}
+
+int LMIC_queueTx (u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed, u1_t prio) {
+    return lmic_queueTx(&LMIC, port, data, dlen, confirmed, prio);
+}
+
+void LMIC_sendAlive (void) {
+    lmic_sendAlive(&LMIC);
+}
+
+bit_t LMIC_enableTracking (u1_t tryBcnInfo) {
+    return lmic_enableTracking(&LMIC, tryBcnInfo);
+}
+
+void LMIC_disableTracking (void) {
+    lmic_disableTracking(&LMIC);
+}
+
+void LMIC_stopPingable (void) {
+    lmic_stopPingable(&LMIC);
+}
+
+void LMIC_setPingable (u1_t intvExp) {
+    lmic_setPingable(&LMIC, intvExp);
+}
+
+void LMIC_tryRejoin (void) {
+    lmic_tryRejoin(&LMIC);
+}
+
+void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey) {
+    lmic_setSession(&LMIC, netid, devaddr, nwkKey, artKey);
+}
+
+int LMIC_openStore (const char* path) {
+    return lmic_openStore(&LMIC, path);
+}
+
+void LMIC_setLinkCheckMode (bit_t enabled) {
+    lmic_setLinkCheckMode(&LMIC, enabled);
+}
+
+ostime_t LMIC_selectChannel (ostime_t now) {
+    return lmic_selectChannel(&LMIC, now);
+}
+
+void LMIC_getTxBudget (lmic_txbudget_t* budget) {
+    lmic_getTxBudget(&LMIC, budget);
+}
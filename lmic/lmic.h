@@ -25,8 +25,10 @@
 #define LMIC_VERSION_MINOR 5
 #define LMIC_VERSION_BUILD 1431528305
 
-enum { MAX_FRAME_LEN      =  64 };   //!< Library cap on max frame length
+enum { MAX_FRAME_LEN      = MAX_LEN_FRAME };   //!< Library cap on max frame length
 enum { TXCONF_ATTEMPTS    =   8 };   //!< Transmit attempts for confirmed frames
+enum { FCNT_RESERVE       =  64 };   //!< Uplink counters reserved per durable session save
+enum { TXQ_LEN            =   8 };   //!< Uplink messages queued by lmic_queueTx()
 enum { MAX_MISSED_BCNS    =  20 };   // threshold for triggering rejoin requests
 enum { MAX_RXSYMS         = 100 };   // stop tracking beacon beyond this
 
@@ -43,16 +45,18 @@ enum { RETRY_PERIOD_secs  =     3 };  // secs - random period for retrying a con
 
 #if defined(CFG_eu868) // EU868 spectrum ====================================================
 
-enum { MAX_CHANNELS = 16 };      //!< Max supported channels
+enum { MAX_CHANNELS = 72 };      //!< Max supported channels
 enum { MAX_BANDS    =  4 };
-
-enum { LIMIT_CHANNELS = (1<<4) };   // EU868 will never have more channels
+enum { CHMAP_WORDS  = (MAX_CHANNELS+63)/64 };  // channel bitmap: bit i of word i/64 is channel i
+enum { DUTY_SLOTS   = 12 };      // airtime of the last hour in 5 minute slots
 //! \internal
 struct band_t {
     u2_t     txcap;     // duty cycle limitation: 1/txcap
     s1_t     txpow;     // maximum TX power
     u1_t     lastchnl;  // last used channel
-    ostime_t avail;     // channel is blocked until this time
+    ostime64_t avail;   // channel is blocked until this time
+    u4_t     usedSlot;  // latest slot with airtime (time / 5min)
+    ostime_t used[DUTY_SLOTS];  // airtime sent in slot usedSlot-i at [(usedSlot-i) % DUTY_SLOTS]
 };
 TYPEDEF_xref2band_t; //!< \internal
 
@@ -128,6 +132,7 @@ enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
        TXRX_PORT   = 0x10,   // set if a frame with a port was RXed, LMIC.frame[LMIC.dataBeg-1] => port
        TXRX_DNW1   = 0x01,   // received in 1st DN slot
        TXRX_DNW2   = 0x02,   // received in 2dn DN slot
+       TXRX_DROP   = 0x08,   // queued message dropped without being sent (lmic_queueTx)
        TXRX_PING   = 0x04 }; // received in a scheduled RX slot
 // Event types for event callback
 enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
@@ -137,6 +142,68 @@ enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
              EV_RXCOMPLETE, EV_LINK_DEAD, EV_LINK_ALIVE };
 typedef enum _ev_t ev_t;
 
+// Session state kept across restarts by the store (see lmic_openStore())
+typedef struct lmic_session_t {
+    u4_t        netid;
+    devaddr_t   devaddr;
+    u1_t        nwkKey[16];
+    u1_t        artKey[16];
+    u4_t        seqnoUp;
+    u4_t        seqnoUpLimit;     // uplink counters below are reserved, resume from here
+    u4_t        seqnoDn;
+    u1_t        datarate;
+    s1_t        adrTxPow;
+    u1_t        adrEnabled;
+    s1_t        adrAckReq;
+    u1_t        dn2Dr;
+    u4_t        dn2Freq;
+    u1_t        globalDutyRate;
+    u4_t        globalDutyWait;   // osticks after the save until the device may send again
+#if defined(CFG_eu868)
+    u4_t        channelFreq[MAX_CHANNELS];
+    u2_t        channelDrMap[MAX_CHANNELS];
+    u8_t        channelMap[CHMAP_WORDS];
+    struct {
+        u2_t    txcap;
+        s1_t    txpow;
+        u1_t    lastchnl;
+        u4_t    wait;             // osticks after the save until the band is available
+        u4_t    used[DUTY_SLOTS]; // airtime in the slot i slots before the one of the save
+    } bands[MAX_BANDS];
+#elif defined(CFG_us915)
+    u4_t        xchFreq[MAX_XCHANNELS];
+    u2_t        xchDrMap[MAX_XCHANNELS];
+    u2_t        channelMap[(72+MAX_XCHANNELS+15)/16];
+#endif
+} lmic_session_t;
+
+// What the next uplink may use, see lmic_getTxBudget()
+typedef struct lmic_txbudget_t {
+    ostime_t    txbeg;        // earliest start of the next uplink
+    u1_t        maxPayload;   // max application payload at the current data rate
+#if defined(CFG_eu868)
+    ostime_t    bandLeft[MAX_BANDS];  // airtime left by band over the last hour
+#endif
+} lmic_txbudget_t;
+
+//! One LMIC context (device session). The LMIC_* functions work on the
+//! default context LMIC, the lmic_* functions on the one passed to them.
+typedef struct lmic_t lmic_ctx;
+typedef void (*lmic_evcb_t) (lmic_ctx* ctx, ev_t ev);
+// called for every queued message once its frame is done with the txrxFlags
+// of the transaction, or with TXRX_DROP if the message was never sent
+typedef void (*lmic_txcb_t) (lmic_ctx* ctx, u2_t id, u1_t txrxFlags);
+
+//! \internal
+struct lmic_txmsg_t {
+    u2_t        id;
+    u1_t        port;
+    u1_t        prio;
+    u1_t        conf;
+    u1_t        inflight;     // packed into the current frame
+    u1_t        len;
+    u1_t        data[MAX_LEN_PAYLOAD];
+};
 
 struct lmic_t {
     // Radio settings TX/RX (also accessed by HAL)
@@ -157,7 +224,9 @@ struct lmic_t {
     band_t      bands[MAX_BANDS];
     u4_t        channelFreq[MAX_CHANNELS];
     u2_t        channelDrMap[MAX_CHANNELS];
-    u2_t        channelMap;
+    u8_t        channelMap[CHMAP_WORDS];              // enabled channels
+    u8_t        bandChannels[MAX_BANDS][CHMAP_WORDS]; // defined channels by band
+    u8_t        drChannels[16][CHMAP_WORDS];          // defined channels by data rate
 #elif defined(CFG_us915)
     u4_t        xchFreq[MAX_XCHANNELS];    // extra channel frequencies (if device is behind a repeater)
     u2_t        xchDrMap[MAX_XCHANNELS];   // extra channel datarate ranges  ---XXX: ditto
@@ -166,7 +235,7 @@ struct lmic_t {
 #endif
     u1_t        txChnl;          // channel for next TX
     u1_t        globalDutyRate;  // max rate: 1/2^k
-    ostime_t    globalDutyAvail; // time device can send again
+    ostime64_t  globalDutyAvail; // time device can send again
     
     u4_t        netid;        // current network id (~0 - none)
     u2_t        opmode;
@@ -184,12 +253,20 @@ struct lmic_t {
     u1_t        pendTxLen;    // +0x80 = confirmed
     u1_t        pendTxData[MAX_LEN_PAYLOAD];
 
+    // Uplink queue (lmic_queueTx), oldest message first
+    struct lmic_txmsg_t txq[TXQ_LEN];
+    u1_t        txqLen;
+    u1_t        txqLoad;      // next frame takes its payload from the queue
+    u2_t        txqNextId;
+    osjob_t     txqjob;       // loads the queue once the caller has queued all messages
+
     u2_t        devNonce;     // last generated nonce
     u1_t        nwkKey[16];   // network session key
     u1_t        artKey[16];   // application router session key
     devaddr_t   devaddr;
     u4_t        seqnoDn;      // device level down stream seqno
     u4_t        seqnoUp;
+    u4_t        seqnoUpLimit; // seqnoUp reserved in the session store up to here
 
     u1_t        dnConf;       // dn frame confirm pending: LORA::FCT_ACK or 0
     s1_t        adrAckReq;    // counter until we reset data rate (0=off)
@@ -224,6 +301,24 @@ struct lmic_t {
     u1_t        bcnRxsyms;    // 
     ostime_t    bcnRxtime;
     bcninfo_t   bcninfo;      // Last received beacon info
+
+    // Context configuration (kept by lmic_reset)
+    struct {
+        lmic_evcb_t evcb;     // event callback (0: onEvent)
+        lmic_txcb_t txcb;     // queued message completion (0: none)
+        bit_t       hasIdent; // EUIs and key below are set (else os_getArtEui() etc. are used)
+        u1_t        artEui[8];
+        u1_t        devEui[8];
+        u1_t        devKey[16];
+        os_store_t* store;    // session store (0: none)
+    } cfg;
+    // AES state of this context: expanded keys and chaining block
+    os_aeskey_t nwkRk;        // nwkKey
+    os_aeskey_t artRk;        // artKey
+    os_aeskey_t devRk;        // device key, expanded on first use (devRkOk)
+    bit_t       devRkOk;
+    u1_t        micB0[2][16]; // B0 blocks of the session MICs (up, down) without seqno and length
+    u4_t        aesAux[16/sizeof(u4_t)];
 };
 //! \var struct lmic_t LMIC
 //! The state of LMIC MAC layer is encapsulated in this variable.
@@ -248,6 +343,7 @@ void  LMIC_reset        (void);
 void  LMIC_clrTxData    (void);
 void  LMIC_setTxData    (void);
 int   LMIC_setTxData2   (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
+int   LMIC_queueTx      (u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed, u1_t prio);
 void  LMIC_sendAlive    (void);
 
 bit_t LMIC_enableTracking  (u1_t tryBcnInfo);
@@ -258,7 +354,50 @@ void  LMIC_setPingable   (u1_t intvExp);
 void  LMIC_tryRejoin     (void);
 
 void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
+int  LMIC_openStore  (const char* path);
 void LMIC_setLinkCheckMode (bit_t enabled);
+ostime_t LMIC_selectChannel (ostime_t now);
+void LMIC_getTxBudget (lmic_txbudget_t* budget);
+
+// Same for any context. All contexts share the scheduler (os_runloop) and
+// the radio, so their TX/RX operations must not overlap.
+#if defined(CFG_eu868)
+bit_t lmic_setupBand (lmic_ctx* ctx, u1_t bandidx, s1_t txpow, u2_t txcap);
+#endif
+bit_t lmic_setupChannel (lmic_ctx* ctx, u1_t channel, u4_t freq, u2_t drmap, s1_t band);
+void  lmic_disableChannel (lmic_ctx* ctx, u1_t channel);
+
+void  lmic_setDrTxpow   (lmic_ctx* ctx, dr_t dr, s1_t txpow);
+void  lmic_setAdrMode   (lmic_ctx* ctx, bit_t enabled);
+bit_t lmic_startJoining (lmic_ctx* ctx);
+
+void  lmic_shutdown     (lmic_ctx* ctx);
+void  lmic_init         (lmic_ctx* ctx);
+void  lmic_reset        (lmic_ctx* ctx);
+void  lmic_clrTxData    (lmic_ctx* ctx);
+void  lmic_setTxData    (lmic_ctx* ctx);
+int   lmic_setTxData2   (lmic_ctx* ctx, u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
+int   lmic_queueTx      (lmic_ctx* ctx, u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed, u1_t prio);
+void  lmic_sendAlive    (lmic_ctx* ctx);
+
+bit_t lmic_enableTracking  (lmic_ctx* ctx, u1_t tryBcnInfo);
+void  lmic_disableTracking (lmic_ctx* ctx);
+
+void  lmic_stopPingable  (lmic_ctx* ctx);
+void  lmic_setPingable   (lmic_ctx* ctx, u1_t intvExp);
+void  lmic_tryRejoin     (lmic_ctx* ctx);
+
+void lmic_setSession (lmic_ctx* ctx, u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
+int  lmic_openStore  (lmic_ctx* ctx, const char* path);
+void lmic_closeStore (lmic_ctx* ctx);
+void lmic_setLinkCheckMode (lmic_ctx* ctx, bit_t enabled);
+ostime_t lmic_selectChannel (lmic_ctx* ctx, ostime_t now);
+void lmic_getTxBudget (lmic_ctx* ctx, lmic_txbudget_t* budget);
+
+// Context configuration
+void lmic_setEventCallback (lmic_ctx* ctx, lmic_evcb_t evcb);
+void lmic_setTxCallback (lmic_ctx* ctx, lmic_txcb_t txcb);
+void lmic_setIdentity (lmic_ctx* ctx, xref2cu1_t artEui, xref2cu1_t devEui, xref2cu1_t devKey);
 
 // Special APIs - for development or testing
 // !!!See implementation for caveats!!!
@@ -33,7 +33,7 @@ enum { DR_PAGE_US915 = 0x10 };
 
 // Global maximum frame length
 enum { STD_PREAMBLE_LEN  =  8 };
-enum { MAX_LEN_FRAME     = 64 };
+enum { MAX_LEN_FRAME     = 255 }; // LoRa length field is one byte
 enum { LEN_DEVNONCE      =  2 };
 enum { LEN_ARTNONCE      =  3 };
 enum { LEN_NETID         =  3 };
@@ -381,6 +381,8 @@ inline dr_t  lowerDR  (dr_t dr, u1_t n) { while(n--){dr=decDR(dr);} return dr; }
 s1_t pow2dBm (u1_t mcmd_ladr_p1);
 // Calculate airtime
 ostime_t calcAirTime (rps_t rps, u1_t plen);
+// Same, always computed (calcAirTime() looks most frames up in a table)
+ostime_t calcAirTimeFormula (rps_t rps, u1_t plen);
 // Sensitivity at given SF/BW
 int getSensitivity (rps_t rps);
 
@@ -12,28 +12,293 @@
 #include "lmic.h"
 
 // RUNTIME STATE
+// Timed jobs are kept in an intrusive pairing heap ordered by (deadline, seq),
+// runnable jobs in a doubly-linked FIFO, so that queuing and cancelling jobs
+// stays cheap with many jobs waiting (O(1) insert, O(log n) amortized removal).
 static struct {
-    osjob_t* scheduledjobs;
-    osjob_t* runnablejobs;
+    osjob_t* timers;        // heap root (earliest deadline)
+    osjob_t* runnablehead;
+    osjob_t* runnabletail;
+    u4_t     seq;
+    osjob_t* posted;        // stack of jobs posted by other threads
+#if defined(CFG_jobstats)
+    u4_t     ntimers, nrunnable;
+    u4_t     maxTimers, maxRunnable;
+#endif
 } OS;
 
+enum { OSJOB_IDLE = 0, OSJOB_RUNNABLE = 0xA5, OSJOB_SCHEDULED = 0x5A };
+
+// ---------------------------------------- statistics
+
+#if defined(CFG_jobstats)
+
+static struct osjobstat_t jobstats[OSJOBSTAT_MAX];
+static u1_t njobstats;
+
+static struct osjobstat_t* findJobStat (osjobcb_t func) {
+    for( u1_t i=0; i<njobstats; i++ ) {
+        if( jobstats[i].func == func )
+            return &jobstats[i];
+    }
+    if( njobstats == OSJOBSTAT_MAX )
+        return &jobstats[OSJOBSTAT_MAX-1];
+    jobstats[njobstats].func = func;
+    return &jobstats[njobstats++];
+}
+
+static u1_t bucket (u4_t us) {
+    u1_t b = us ? 32 - __builtin_clz(us) : 0;
+    return b < OSJOBSTAT_BUCKETS ? b : OSJOBSTAT_BUCKETS-1;
+}
+
+void os_setJobName (osjobcb_t func, str_t name) {
+    findJobStat(func)->name = name;
+}
+
+const struct osjobstat_t* os_getJobStats (u1_t* count) {
+    *count = njobstats;
+    return jobstats;
+}
+
+void os_getQueueStats (u4_t* maxTimers, u4_t* maxRunnable) {
+    *maxTimers = OS.maxTimers;
+    *maxRunnable = OS.maxRunnable;
+}
+
+// clear all counters, but keep the callback names
+void os_resetJobStats () {
+    for( u1_t i=0; i<njobstats; i++ ) {
+        struct osjobstat_t* st = &jobstats[i];
+        st->runs = st->lateMax = st->runMax = 0;
+        memset(st->late, 0, sizeof(st->late));
+        memset(st->run, 0, sizeof(st->run));
+    }
+    OS.maxTimers = OS.ntimers;
+    OS.maxRunnable = OS.nrunnable;
+}
+
+static void dumpHist (const char* key, const u4_t* hist) {
+    fprintf(stderr, " %s=", key);
+    const char* sep = "";
+    for( u1_t b=0; b<OSJOBSTAT_BUCKETS; b++ ) {
+        if( hist[b] == 0 )
+            continue;
+        if( b == OSJOBSTAT_BUCKETS-1 )
+            fprintf(stderr, "%s>=%u:%u", sep, 1u << (b-1), hist[b]);
+        else
+            fprintf(stderr, "%s<%u:%u", sep, 1u << b, hist[b]);
+        sep = ",";
+    }
+}
+
+// one line per callback and one for the queues, as key=value pairs
+void os_dumpJobStats () {
+    ostime64_t now = os_getTime64();
+    for( u1_t i=0; i<njobstats; i++ ) {
+        struct osjobstat_t* st = &jobstats[i];
+        if( st->runs == 0 )
+            continue;
+        if( st->name )
+            fprintf(stderr, "jobstat ticks=%lld job=%s", now, st->name);
+        else
+            fprintf(stderr, "jobstat ticks=%lld job=%p", now, (void*)st->func);
+        fprintf(stderr, " runs=%u late_max_us=%u run_max_us=%u", st->runs, st->lateMax, st->runMax);
+        dumpHist("late_us", st->late);
+        dumpHist("run_us", st->run);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "jobstat ticks=%lld queue timers=%u timers_max=%u runnable=%u runnable_max=%u\n",
+            now, OS.ntimers, OS.maxTimers, OS.nrunnable, OS.maxRunnable);
+}
+
+#if CFG_jobstats > 0
+static osjob_t dumpjob;
+
+static void dumpJobStats (osjob_t* job) {
+    os_dumpJobStats();
+    os_setTimedCallback64(job, job->deadline + sec2osticks(CFG_jobstats), FUNC_ADDR(dumpJobStats));
+}
+#endif
+
+static void initJobStats () {
+    memset(jobstats, 0, sizeof(jobstats));
+    njobstats = 0;
+#if CFG_jobstats > 0
+    os_setJobName(FUNC_ADDR(dumpJobStats), "os_dumpJobStats");
+#endif
+}
+
+static void runJob (osjob_t* j) {
+    osjobcb_t func = j->func;
+    ostime64_t late = os_getTime64() - j->deadline;
+    u8_t t0 = hal_nanos();
+    func(j);
+    u8_t run = (hal_nanos() - t0) / 1000;
+    // lateness is counted in ticks, timed jobs may run up to a few ticks early
+    late = late > 0 ? late * 1000000 / OSTICKS_PER_SEC : 0;
+    if( late > 0xFFFFFFFF )
+        late = 0xFFFFFFFF;
+    if( run > 0xFFFFFFFF )
+        run = 0xFFFFFFFF;
+    struct osjobstat_t* st = findJobStat(func);
+    st->runs++;
+    st->late[bucket(late)]++;
+    st->run[bucket(run)]++;
+    if( late > st->lateMax )
+        st->lateMax = late;
+    if( run > st->runMax )
+        st->runMax = run;
+}
+
+#endif // CFG_jobstats
+
 void os_init () {
     memset(&OS, 0x00, sizeof(OS));
+#if defined(CFG_jobstats)
+    initJobStats(); // before LMIC_init() names its jobs
+#endif
     hal_init();
     radio_init();
     LMIC_init();
+#if defined(CFG_jobstats) && CFG_jobstats > 0
+    os_setTimedCallback64(&dumpjob, os_getTime64() + sec2osticks(CFG_jobstats), FUNC_ADDR(dumpJobStats));
+#endif
 }
 
 ostime_t os_getTime () {
     return hal_ticks();
 }
 
-static u1_t unlinkjob (osjob_t** pnext, osjob_t* job) {
-    for( ; *pnext; pnext = &((*pnext)->next)) {
-        if(*pnext == job) { // unlink
-            *pnext = job->next;
-            return 1;
+ostime64_t os_getTime64 () {
+    return hal_ticks64();
+}
+
+// 64-bit time closest to now with the given lower 32 bits
+ostime64_t os_extendTime (ostime_t time) {
+    ostime64_t now = os_getTime64();
+    return now + (ostime_t)(time - (ostime_t)now);
+}
+
+// ---------------------------------------- timer heap
+
+static int before (osjob_t* a, osjob_t* b) {
+    return a->deadline < b->deadline || (a->deadline == b->deadline && (s4_t)(a->seq - b->seq) < 0);
+}
+
+// link two heap roots, the later one becomes first child of the earlier one
+static osjob_t* meld (osjob_t* a, osjob_t* b) {
+    if( before(b, a) ) {
+        osjob_t* t = a; a = b; b = t;
+    }
+    b->prev = a;
+    b->next = a->child;
+    if( a->child )
+        a->child->prev = b;
+    a->child = b;
+    return a;
+}
+
+// combine the children of a removed node into one heap (two-pass pairing)
+static osjob_t* mergePairs (osjob_t* first) {
+    osjob_t* pairs = NULL;
+    while( first ) {
+        osjob_t* a = first;
+        osjob_t* b = a->next;
+        first = b ? b->next : NULL;
+        a->prev = a->next = NULL;
+        if( b ) {
+            b->prev = b->next = NULL;
+            a = meld(a, b);
         }
+        a->next = pairs;
+        pairs = a;
+    }
+    if( !pairs )
+        return NULL;
+    osjob_t* root = pairs;
+    pairs = pairs->next;
+    root->next = NULL;
+    while( pairs ) {
+        osjob_t* n = pairs->next;
+        pairs->next = NULL;
+        root = meld(root, pairs);
+        pairs = n;
+    }
+    return root;
+}
+
+static void heapInsert (osjob_t* job) {
+    job->prev = job->next = job->child = NULL;
+    job->seq = OS.seq++;
+    OS.timers = OS.timers ? meld(OS.timers, job) : job;
+#if defined(CFG_jobstats)
+    if( ++OS.ntimers > OS.maxTimers )
+        OS.maxTimers = OS.ntimers;
+#endif
+}
+
+static void heapRemove (osjob_t* job) {
+    if( job == OS.timers ) {
+        OS.timers = mergePairs(job->child);
+    } else {
+        if( job->prev->child == job )
+            job->prev->child = job->next;
+        else
+            job->prev->next = job->next;
+        if( job->next )
+            job->next->prev = job->prev;
+        osjob_t* sub = mergePairs(job->child);
+        if( sub )
+            OS.timers = meld(OS.timers, sub);
+    }
+    job->prev = job->next = job->child = NULL;
+#if defined(CFG_jobstats)
+    OS.ntimers--;
+#endif
+}
+
+// ---------------------------------------- run queue
+
+static void runAppend (osjob_t* job) {
+    job->next = NULL;
+    job->prev = OS.runnabletail;
+    if( OS.runnabletail )
+        OS.runnabletail->next = job;
+    else
+        OS.runnablehead = job;
+    OS.runnabletail = job;
+#if defined(CFG_jobstats)
+    if( ++OS.nrunnable > OS.maxRunnable )
+        OS.maxRunnable = OS.nrunnable;
+#endif
+}
+
+static void runRemove (osjob_t* job) {
+    if( job->prev )
+        job->prev->next = job->next;
+    else
+        OS.runnablehead = job->next;
+    if( job->next )
+        job->next->prev = job->prev;
+    else
+        OS.runnabletail = job->prev;
+    job->prev = job->next = NULL;
+#if defined(CFG_jobstats)
+    OS.nrunnable--;
+#endif
+}
+
+// Unlinking trusts the job's state and links instead of searching the queues,
+// so a job must be zero-initialized before its first use; one with garbage
+// fields is not safe to clear. The links are still checked to agree with the
+// state before a job is unlinked.
+static int isQueued (osjob_t* job) {
+    switch( job->state ) {
+    case OSJOB_RUNNABLE:
+        return job->prev ? job->prev->next == job : OS.runnablehead == job;
+    case OSJOB_SCHEDULED:
+        return job == OS.timers || (job->prev && (job->prev->child == job || job->prev->next == job));
     }
     return 0;
 }
@@ -41,65 +306,136 @@ static u1_t unlinkjob (osjob_t** pnext, osjob_t* job) {
 // clear scheduled job
 void os_clearCallback (osjob_t* job) {
     hal_disableIRQs();
-    unlinkjob(&OS.scheduledjobs, job) || unlinkjob(&OS.runnablejobs, job);
+    if( isQueued(job) ) {
+        if( job->state == OSJOB_RUNNABLE )
+            runRemove(job);
+        else
+            heapRemove(job);
+    }
+    job->state = OSJOB_IDLE;
     hal_enableIRQs();
 }
 
 // schedule immediately runnable job
 void os_setCallback (osjob_t* job, osjobcb_t cb) {
-    osjob_t** pnext;
     hal_disableIRQs();
     // remove if job was already queued
     os_clearCallback(job);
     // fill-in job
     job->func = cb;
-    job->next = NULL;
+    job->state = OSJOB_RUNNABLE;
+#if defined(CFG_jobstats)
+    job->deadline = os_getTime64(); // lateness of runnable jobs is their queuing delay
+#endif
     // add to end of run queue
-    for(pnext=&OS.runnablejobs; *pnext; pnext=&((*pnext)->next));
-    *pnext = job;
+    runAppend(job);
     hal_enableIRQs();
 }
 
 // schedule timed job
 void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t cb) {
-    osjob_t** pnext;
+    os_setTimedCallback64(job, os_extendTime(time), cb);
+}
+
+void os_setTimedCallback64 (osjob_t* job, ostime64_t time, osjobcb_t cb) {
     hal_disableIRQs();
     // remove if job was already queued
     os_clearCallback(job);
     // fill-in job
     job->deadline = time;
     job->func = cb;
-    job->next = NULL;
+    job->state = OSJOB_SCHEDULED;
     // insert into schedule
-    for(pnext=&OS.scheduledjobs; *pnext; pnext=&((*pnext)->next)) {
-        if((*pnext)->deadline - time > 0) { // (cmp diff, not abs!)
-            // enqueue before next element and stop
-            job->next = *pnext;
-            break;
-        }
+    heapInsert(job);
+    hal_enableIRQs();
+}
+
+// ---------------------------------------- posted jobs
+// Other threads must not touch OS or LMIC. They post jobs onto a lock-free
+// stack instead, which the run loop takes as a whole (so there is no ABA
+// problem) and appends to the run queue in posting order. A job must be
+// zero-initialized before it is posted for the first time, and posting a job
+// that has not been taken yet has no effect.
+
+void os_postCallback (osjob_t* job, osjobcb_t cb) {
+    u1_t idle = 0;
+    if( !__atomic_compare_exchange_n(&job->posted, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+        return;
+    job->postfunc = cb;
+    osjob_t* head = __atomic_load_n(&OS.posted, __ATOMIC_RELAXED);
+    do {
+        job->postnext = head;
+    } while( !__atomic_compare_exchange_n(&OS.posted, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+    // the run loop drains the whole stack after waking up, so only the
+    // first job posted onto an empty stack has to wake it
+    if( head == NULL )
+        hal_wakeup();
+}
+
+static void takePosted () {
+    osjob_t* j = __atomic_exchange_n(&OS.posted, NULL, __ATOMIC_ACQUIRE);
+    osjob_t* fifo = NULL;
+    while( j ) {
+        osjob_t* n = j->postnext;
+        j->postnext = fifo;
+        fifo = j;
+        j = n;
+    }
+    while( fifo ) {
+        j = fifo;
+        fifo = j->postnext;
+        osjobcb_t cb = j->postfunc;
+        __atomic_store_n(&j->posted, 0, __ATOMIC_RELEASE); // may be posted again from here on
+        os_setCallback(j, cb);
+    }
+}
+
+// deadlines further out than this are approached in steps, so the 32-bit
+// HAL timer never sees a target that looks like it is in the past
+#define MAX_TIMER_DELTA 0x40000000
+
+static u1_t checkDeadline (ostime64_t deadline) {
+    ostime64_t now = os_getTime64();
+    if(deadline - now > MAX_TIMER_DELTA) {
+        hal_checkTimer((ostime_t)(now + MAX_TIMER_DELTA));
+        return 0;
+    }
+    return hal_checkTimer((ostime_t)deadline);
+}
+
+// execute one job from timer or run queue, or sleep if there is none
+void os_runloop_once () {
+    osjob_t* j = NULL;
+    hal_disableIRQs();
+    if(__atomic_load_n(&OS.posted, __ATOMIC_RELAXED)) {
+        takePosted();
+    }
+    // check for runnable jobs
+    if(OS.runnablehead) {
+        j = OS.runnablehead;
+        runRemove(j);
+    } else if(OS.timers && checkDeadline(OS.timers->deadline)) { // check for expired timed jobs
+        j = OS.timers;
+        heapRemove(j);
+    } else { // nothing pending
+        hal_sleep(); // wake by irq (timer already restarted)
+    }
+    if(j) {
+        j->state = OSJOB_IDLE;
     }
-    *pnext = job;
     hal_enableIRQs();
+    if(j) { // run job callback
+#if defined(CFG_jobstats)
+        runJob(j);
+#else
+        j->func(j);
+#endif
+    }
 }
 
 // execute jobs from timer and from run queue
 void os_runloop () {
     while(1) {
-        osjob_t* j = NULL;
-        hal_disableIRQs();
-        // check for runnable jobs
-        if(OS.runnablejobs) {
-            j = OS.runnablejobs;
-            OS.runnablejobs = j->next;
-        } else if(OS.scheduledjobs && hal_checkTimer(OS.scheduledjobs->deadline)) { // check for expired timed jobs
-            j = OS.scheduledjobs;
-            OS.scheduledjobs = j->next;
-        } else { // nothing pending
-            hal_sleep(); // wake by irq (timer already restarted)
-        }
-       hal_enableIRQs();
-        if(j) { // run job callback
-            j->func(j);
-        }
+        os_runloop_once();
     }
 }
@@ -81,6 +81,7 @@ void radio_init (void);
 void radio_irq_handler (u1_t dio);
 void os_init (void);
 void os_runloop (void);
+void os_runloop_once (void);
 
 //================================================================================
 
@@ -100,6 +101,10 @@ void os_runloop (void);
 #endif
 
 typedef s4_t  ostime_t;
+typedef s8_t  ostime64_t;  // does not wrap - ostime_t is its lower 32 bits
+
+// radio_irq_handler() with the time the DIO line was raised (if known to the HAL)
+void radio_irq_handler_at (u1_t dio, ostime_t now);
 
 #if !HAS_ostick_conv
 #define us2osticks(us)   ((ostime_t)( ((s8_t)(us) * OSTICKS_PER_SEC) / 1000000))
@@ -118,9 +123,17 @@ typedef s4_t  ostime_t;
 struct osjob_t;  // fwd decl.
 typedef void (*osjobcb_t) (struct osjob_t*);
 struct osjob_t {
-    struct osjob_t* next;
-    ostime_t deadline;
+    struct osjob_t* next;   // run queue: next job / timer heap: next sibling
+    struct osjob_t* prev;   // run queue: previous job / timer heap: previous sibling or parent
+    struct osjob_t* child;  // timer heap: first child
+    ostime64_t deadline;
+    u4_t       seq;         // keeps jobs with equal deadlines in FIFO order
+    u1_t       state;       // OSJOB_IDLE, OSJOB_RUNNABLE or OSJOB_SCHEDULED
     osjobcb_t  func;
+    // os_postCallback() from other threads
+    struct osjob_t* postnext;
+    osjobcb_t  postfunc;
+    u1_t       posted;
 };
 TYPEDEF_xref2osjob_t;
 
@@ -136,23 +149,38 @@ void os_getArtEui (xref2u1_t buf);
 #ifndef os_getDevEui
 void os_getDevEui (xref2u1_t buf);
 #endif
+// A job must be zero-initialized (static storage or cleared) before it is
+// first passed to any of the os_*Callback() functions.
 #ifndef os_setCallback
 void os_setCallback (xref2osjob_t job, osjobcb_t cb);
 #endif
 #ifndef os_setTimedCallback
 void os_setTimedCallback (xref2osjob_t job, ostime_t time, osjobcb_t cb);
 #endif
+#ifndef os_setTimedCallback64
+void os_setTimedCallback64 (xref2osjob_t job, ostime64_t time, osjobcb_t cb);
+#endif
+#ifndef os_postCallback
+void os_postCallback (xref2osjob_t job, osjobcb_t cb);
+#endif
 #ifndef os_clearCallback
 void os_clearCallback (xref2osjob_t job);
 #endif
 #ifndef os_getTime
 ostime_t os_getTime (void);
 #endif
+#ifndef os_getTime64
+ostime64_t os_getTime64 (void);
+#endif
+#ifndef os_extendTime
+ostime64_t os_extendTime (ostime_t time);
+#endif
 #ifndef os_getTimeSecs
 uint os_getTimeSecs (void);
 #endif
 #ifndef os_radio
-void os_radio (u1_t mode);
+struct lmic_t;
+void os_radio (struct lmic_t* ctx, u1_t mode);
 #endif
 #ifndef os_getBattLevel
 u1_t os_getBattLevel (void);
@@ -193,6 +221,46 @@ u2_t os_crc16 (xref2u1_t d, uint len);
 
 #endif // !HAS_os_calls
 
+// ======================================================================
+// Scheduler statistics
+
+#if defined(CFG_jobstats)
+// histogram bucket 0 counts 0us, bucket i values in [2^(i-1), 2^i) us and
+// the last bucket all larger values
+#define OSJOBSTAT_BUCKETS 20
+// number of callbacks tracked, all further callbacks share the last entry
+#define OSJOBSTAT_MAX     32
+
+struct osjobstat_t {
+    osjobcb_t func;
+    str_t     name;                     // set by os_setJobName()
+    u4_t      runs;
+    u4_t      lateMax;                  // us
+    u4_t      runMax;                   // us
+    u4_t      late[OSJOBSTAT_BUCKETS];  // dispatch time - deadline (timed jobs) or - queuing time
+    u4_t      run[OSJOBSTAT_BUCKETS];   // time spent in the callback
+};
+
+void os_setJobName (osjobcb_t func, str_t name);
+const struct osjobstat_t* os_getJobStats (u1_t* count);
+void os_getQueueStats (u4_t* maxTimers, u4_t* maxRunnable);
+void os_resetJobStats (void);
+void os_dumpJobStats (void);
+#endif // CFG_jobstats
+
+// ======================================================================
+// Persistent state (store.c)
+// A memory-mapped file with two checksummed copies of a blob of the given
+// size. os_storeLoad() returns the newest valid copy and its age in ms,
+// os_storeSave() overwrites the older copy. A durable save writes both copies
+// and waits until they are on disk.
+
+typedef struct os_store_t os_store_t;
+os_store_t* os_storeOpen (const char* path, u2_t size);
+void  os_storeClose (os_store_t* st);
+bit_t os_storeLoad (os_store_t* st, void* data, u4_t* agems);
+void  os_storeSave (os_store_t* st, const void* data, bit_t durable);
+
 // ======================================================================
 // AES support 
 // !!Keep in sync with lorabase.hpp!!
@@ -211,6 +279,39 @@ extern xref2u1_t AESaux;
 #ifndef os_aes
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len);
 #endif
+#ifndef os_aes_r
+// os_aes() on the given key schedule (11*16 bytes, the 128-bit key in the
+// first 16) and chaining block (16 bytes) instead of AESkey and AESaux
+u4_t os_aes_r (u1_t mode, xref2u1_t buf, u2_t len, u4_t* key, u4_t* aux);
+#endif
+#ifndef os_aes_k
+// AES-128 key expanded once by os_aesKey() for any number of os_aes_k() calls
+typedef struct os_aeskey_t {
+    u4_t rk[11*16/sizeof(u4_t)];   // round keys, words for the table code
+    u1_t rkb[11*16];               // same in byte order for AES instructions
+    u1_t sk[2][16];                // CMAC subkeys K1 and K2
+} os_aeskey_t;
+void os_aesKey (os_aeskey_t* k, xref2cu1_t key);
+// os_aes() with an expanded key and the given chaining block (16 bytes)
+u4_t os_aes_k (u1_t mode, xref2u1_t buf, u2_t len, const os_aeskey_t* key, u4_t* aux);
+// Select the AES implementation by name ("aesni", "armv8", "table") or the
+// fastest one the CPU supports (NULL). Returns 0 if it is not available.
+bit_t os_aesSelect (const char* name);
+// name of the AES implementation in use
+const char* os_aesBackend (void);
+// One frame of an os_aesBatch(): arguments as for os_aes_k(), its result
+// is stored in res. Every frame needs its own chaining block.
+typedef struct os_aesjob_t {
+    u1_t               mode;
+    u2_t               len;
+    u1_t*              buf;
+    const os_aeskey_t* key;
+    u4_t*              aux;
+    u4_t               res;
+} os_aesjob_t;
+// os_aes_k() on n independent frames, interleaved where that is faster
+void os_aesBatch (os_aesjob_t* jobs, int n);
+#endif
 
 
 
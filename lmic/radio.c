@@ -9,7 +9,6 @@
  *    IBM Zurich Research Lab - initial API, implementation and documentation
  *******************************************************************************/
 
-#include <wiringPi.h>
 #include "lmic.h"
 
 // ---------------------------------------- 
@@ -227,7 +226,7 @@
 #define MAP_DIO0_LORA_TXDONE   0x40  // 01------
 #define MAP_DIO1_LORA_RXTOUT   0x00  // --00----
 #define MAP_DIO1_LORA_NOP      0x30  // --11----
-#define MAP_DIO2_LORA_NOP      0xC0  // ----11--
+#define MAP_DIO2_LORA_NOP      0x0C  // ----11--
 
 #define MAP_DIO0_FSK_READY     0x00  // 00------ (packet sent / payload ready)
 #define MAP_DIO1_FSK_NOP       0x30  // --11----
@@ -250,6 +249,9 @@
 // RADIO STATE
 // (initialized by radio_init(), used by radio_rand1())
 static u1_t randbuf[16];
+// context whose frame is sent or received (set by os_radio(), used by the
+// IRQ handler) - contexts sharing the radio have to take turns
+static lmic_ctx* radioCtx = &LMIC;
 
 
 #ifdef CFG_sx1276_radio
@@ -261,36 +263,127 @@ static u1_t randbuf[16];
 #endif
 
 
-static void writeReg (u1_t addr, u1_t data ) {
+static void spiWriteReg (u1_t addr, u1_t data ) {
     hal_pin_nss(0);
-    hal_spi(addr | 0x80);
-    hal_spi(data);
+    hal_spi_reg(addr | 0x80, data);
     hal_pin_nss(1);
 }
 
-static u1_t readReg (u1_t addr) {
+static u1_t spiReadReg (u1_t addr) {
     hal_pin_nss(0);
-    hal_spi(addr & 0x7F);
-    u1_t val = hal_spi(0x00);
+    u1_t val = hal_spi_reg(addr & 0x7F, 0x00);
     hal_pin_nss(1);
     return val;
 }
 
+// REGISTER SHADOW
+// Write-through copy of the configuration registers, so that read-modify-write
+// sequences and state checks do not need a bus transfer. Registers 0x0D-0x3F
+// are banked per modem (LoRa/FSK) and are dropped whenever the modem changes.
+// Registers changed by the chip itself (FIFO, IRQ flags, RSSI/SNR, counters)
+// are never shadowed. Note that for RegOpMode the mode bits reflect the last
+// mode written, not transitions made by the chip (e.g. TX -> STANDBY).
+static u1_t regshadow[0x80];
+static u1_t regvalid[0x80/8];
+
+static void clearShadow (u1_t lo, u1_t hi) {
+    for( u1_t a=lo; a<=hi; a++ )
+        regvalid[a>>3] &= ~(1<<(a&7));
+}
+
+static bit_t isVolatileReg (u1_t addr) {
+    if( addr == RegFifo || addr >= 0x80 )
+        return 1;
+    if( addr < 0x0D || addr > 0x3F )
+        return 0; // common registers
+    if( (regvalid[RegOpMode>>3] & (1<<(RegOpMode&7))) == 0 )
+        return 1; // modem unknown - bank unknown
+    if( regshadow[RegOpMode] & OPMODE_LORA ) {
+        switch( addr ) {
+        case LORARegFifoAddrPtr:
+        case LORARegFifoRxCurrentAddr:
+        case LORARegIrqFlags:
+        case LORARegRxNbBytes:
+        case LORARegRxHeaderCntValueMsb:
+        case LORARegRxHeaderCntValueLsb:
+        case LORARegRxPacketCntValueMsb:
+        case LORARegRxpacketCntValueLsb:
+        case LORARegModemStat:
+        case LORARegPktSnrValue:
+        case LORARegPktRssiValue:
+        case LORARegRssiValue:
+        case LORARegHopChannel:
+        case LORARegFifoRxByteAddr:
+        case LORARegFeiMsb:
+        case LORAFeiMib:
+        case LORARegFeiLsb:
+        case LORARegRssiWideband:
+            return 1;
+        }
+    } else {
+        switch( addr ) {
+        case FSKRegRssiValue:
+        case FSKRegAfcMsb:
+        case FSKRegAfcLsb:
+        case FSKRegFeiMsb:
+        case FSKRegFeiLsb:
+        case FSKRegPayloadLength:
+        case FSKRegImageCal:
+        case FSKRegTemp:
+        case FSKRegIrqFlags1:
+        case FSKRegIrqFlags2:
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void writeReg (u1_t addr, u1_t data ) {
+    spiWriteReg(addr, data);
+    if( addr == RegOpMode && ((regshadow[RegOpMode] ^ data) & OPMODE_LORA) != 0 )
+        clearShadow(0x0D, 0x3F); // other register bank now visible
+    if( !isVolatileReg(addr) ) {
+        regshadow[addr] = data;
+        regvalid[addr>>3] |= 1<<(addr&7);
+    }
+}
+
+static u1_t readReg (u1_t addr) {
+    if( regvalid[addr>>3] & (1<<(addr&7)) )
+        return regshadow[addr];
+    u1_t val = spiReadReg(addr);
+    if( !isVolatileReg(addr) ) {
+        regshadow[addr] = val;
+        regvalid[addr>>3] |= 1<<(addr&7);
+    }
+    return val;
+}
+
+#ifdef CFG_regverify
+// cross-check every shadowed register against the chip
+static void verifyShadow () {
+    for( u1_t a=1; a<0x80; a++ ) {
+        if( (regvalid[a>>3] & (1<<(a&7))) == 0 )
+            continue;
+        u1_t mask = (a == RegOpMode) ? (u1_t)~OPMODE_MASK : 0xFF;
+        u1_t v = spiReadReg(a);
+        if( ((v ^ regshadow[a]) & mask) != 0 ) {
+            fprintf(stderr, "register 0x%02x: shadow 0x%02x, chip 0x%02x\n", a, regshadow[a], v);
+            ASSERT(0);
+        }
+    }
+}
+#endif
+
 static void writeBuf (u1_t addr, xref2u1_t buf, u1_t len) {
     hal_pin_nss(0);
-    hal_spi(addr | 0x80);
-    for (u1_t i=0; i<len; i++) {
-        hal_spi(buf[i]);
-    }
+    hal_spi_burst(addr | 0x80, buf, len, 1);
     hal_pin_nss(1);
 }
 
 static void readBuf (u1_t addr, xref2u1_t buf, u1_t len) {
     hal_pin_nss(0);
-    hal_spi(addr & 0x7F);
-    for (u1_t i=0; i<len; i++) {
-        buf[i] = hal_spi(0x00);
-    }
+    hal_spi_burst(addr & 0x7F, buf, len, 0);
     hal_pin_nss(1);
 }
 
@@ -316,19 +409,19 @@ static void opmodeFSK() {
 
 // configure LoRa modem (cfg1, cfg2)
 static void configLoraModem () {
-    sf_t sf = getSf(LMIC.rps);
+    sf_t sf = getSf(radioCtx->rps);
 
 #ifdef CFG_sx1276_radio
         u1_t mc1 = 0, mc2 = 0, mc3 = 0;
 
-        switch (getBw(LMIC.rps)) {
+        switch (getBw(radioCtx->rps)) {
         case BW125: mc1 |= SX1276_MC1_BW_125; break;
         case BW250: mc1 |= SX1276_MC1_BW_250; break;
         case BW500: mc1 |= SX1276_MC1_BW_500; break;
         default:
             ASSERT(0);
         }
-        switch( getCr(LMIC.rps) ) {
+        switch( getCr(radioCtx->rps) ) {
         case CR_4_5: mc1 |= SX1276_MC1_CR_4_5; break;
         case CR_4_6: mc1 |= SX1276_MC1_CR_4_6; break;
         case CR_4_7: mc1 |= SX1276_MC1_CR_4_7; break;
@@ -337,45 +430,45 @@ static void configLoraModem () {
             ASSERT(0);
         }
 
-        if (getIh(LMIC.rps)) {
+        if (getIh(radioCtx->rps)) {
             mc1 |= SX1276_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeReg(LORARegPayloadLength, getIh(radioCtx->rps)); // required length
         }
         // set ModemConfig1
         writeReg(LORARegModemConfig1, mc1);
 
         mc2 = (SX1272_MC2_SF7 + ((sf-1)<<4));
-        if (getNocrc(LMIC.rps) == 0) {
+        if (getNocrc(radioCtx->rps) == 0) {
             mc2 |= SX1276_MC2_RX_PAYLOAD_CRCON;
         }
         writeReg(LORARegModemConfig2, mc2);
         
         mc3 = SX1276_MC3_AGCAUTO;
-        if ((sf == SF11 || sf == SF12) && getBw(LMIC.rps) == BW125) {
+        if ((sf == SF11 || sf == SF12) && getBw(radioCtx->rps) == BW125) {
             mc3 |= SX1276_MC3_LOW_DATA_RATE_OPTIMIZE;
         }
         writeReg(LORARegModemConfig3, mc3);
 #elif CFG_sx1272_radio
-        u1_t mc1 = (getBw(LMIC.rps)<<6);
+        u1_t mc1 = (getBw(radioCtx->rps)<<6);
 
-        switch( getCr(LMIC.rps) ) {
+        switch( getCr(radioCtx->rps) ) {
         case CR_4_5: mc1 |= SX1272_MC1_CR_4_5; break;
         case CR_4_6: mc1 |= SX1272_MC1_CR_4_6; break;
         case CR_4_7: mc1 |= SX1272_MC1_CR_4_7; break;
         case CR_4_8: mc1 |= SX1272_MC1_CR_4_8; break;
         }
         
-        if ((sf == SF11 || sf == SF12) && getBw(LMIC.rps) == BW125) {
+        if ((sf == SF11 || sf == SF12) && getBw(radioCtx->rps) == BW125) {
             mc1 |= SX1272_MC1_LOW_DATA_RATE_OPTIMIZE;
         }
         
-        if (getNocrc(LMIC.rps) == 0) {
+        if (getNocrc(radioCtx->rps) == 0) {
             mc1 |= SX1272_MC1_RX_PAYLOAD_CRCON;
         }
         
-        if (getIh(LMIC.rps)) {
+        if (getIh(radioCtx->rps)) {
             mc1 |= SX1272_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeReg(LORARegPayloadLength, getIh(radioCtx->rps)); // required length
         }
         // set ModemConfig1
         writeReg(LORARegModemConfig1, mc1);
@@ -389,7 +482,7 @@ static void configLoraModem () {
 
 static void configChannel () {
     // set frequency: FQ = (FRF * 32 Mhz) / (2 ^ 19)
-    u8_t frf = ((u8_t)LMIC.freq << 19) / 32000000;
+    u8_t frf = ((u8_t)radioCtx->freq << 19) / 32000000;
     writeReg(RegFrfMsb, (u1_t)(frf>>16));
     writeReg(RegFrfMid, (u1_t)(frf>> 8));
     writeReg(RegFrfLsb, (u1_t)(frf>> 0));
@@ -400,7 +493,7 @@ static void configChannel () {
 static void configPower () {
 #ifdef CFG_sx1276_radio
     // no boost used for now
-    s1_t pw = (s1_t)LMIC.txpow;
+    s1_t pw = (s1_t)radioCtx->txpow;
     if(pw >= 17) {
         pw = 15;
     } else if(pw < 2) {
@@ -412,7 +505,7 @@ static void configPower () {
 
 #elif CFG_sx1272_radio
     // set PA config (2-17 dBm using PA_BOOST)
-    s1_t pw = (s1_t)LMIC.txpow;
+    s1_t pw = (s1_t)radioCtx->txpow;
     if(pw > 17) {
         pw = 17;
     } else if(pw < 2) {
@@ -454,11 +547,11 @@ static void txfsk () {
     writeReg(RegDioMapping1, MAP_DIO0_FSK_READY|MAP_DIO1_FSK_NOP|MAP_DIO2_FSK_TXNOP);
 
     // initialize the payload size and address pointers    
-    writeReg(FSKRegPayloadLength, LMIC.dataLen+1); // (insert length byte into payload))
+    writeReg(FSKRegPayloadLength, radioCtx->dataLen+1); // (insert length byte into payload))
 
     // download length byte and buffer to the radio FIFO
-    writeReg(RegFifo, LMIC.dataLen);
-    writeBuf(RegFifo, LMIC.frame, LMIC.dataLen);
+    writeReg(RegFifo, radioCtx->dataLen);
+    writeBuf(RegFifo, radioCtx->frame, radioCtx->dataLen);
 
     // enable antenna switch for TX
     hal_pin_rxtx(1);
@@ -495,10 +588,10 @@ static void txlora () {
     // initialize the payload size and address pointers    
     writeReg(LORARegFifoTxBaseAddr, 0x00);
     writeReg(LORARegFifoAddrPtr, 0x00);
-    writeReg(LORARegPayloadLength, LMIC.dataLen);
+    writeReg(LORARegPayloadLength, radioCtx->dataLen);
        
     // download buffer to the radio FIFO
-    writeBuf(RegFifo, LMIC.frame, LMIC.dataLen);
+    writeBuf(RegFifo, radioCtx->frame, radioCtx->dataLen);
 
     // enable antenna switch for TX
     hal_pin_rxtx(1);
@@ -510,7 +603,7 @@ static void txlora () {
 // start transmitter (buf=LMIC.frame, len=LMIC.dataLen)
 static void starttx () {
     ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
-    if(getSf(LMIC.rps) == FSK) { // FSK modem
+    if(getSf(radioCtx->rps) == FSK) { // FSK modem
         txfsk();
     } else { // LoRa modem
         txlora();
@@ -547,11 +640,11 @@ static void rxlora (u1_t rxmode) {
     // set LNA gain
     writeReg(RegLna, LNA_RX_GAIN); 
     // set max payload size
-    writeReg(LORARegPayloadMaxLength, 64);
+    writeReg(LORARegPayloadMaxLength, MAX_LEN_FRAME);
     // use inverted I/Q signal (prevent mote-to-mote communication)
     writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)|(1<<6));
     // set symbol timeout (for single rx)
-    writeReg(LORARegSymbTimeoutLsb, LMIC.rxsyms);
+    writeReg(LORARegSymbTimeoutLsb, radioCtx->rxsyms);
     // set sync word
     writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
     
@@ -567,7 +660,7 @@ static void rxlora (u1_t rxmode) {
 
     // now instruct the radio to receive
     if (rxmode == RXMODE_SINGLE) { // single rx
-        hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
+        hal_waitUntil(radioCtx->rxtime); // busy wait until exact rx time
         opmode(OPMODE_RX_SINGLE);
     } else { // continous rx (scan or rssi)
         opmode(OPMODE_RX); 
@@ -621,13 +714,13 @@ static void rxfsk (u1_t rxmode) {
     hal_pin_rxtx(0);
     
     // now instruct the radio to receive
-    hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
+    hal_waitUntil(radioCtx->rxtime); // busy wait until exact rx time
     opmode(OPMODE_RX); // no single rx mode available in FSK
 }
 
 static void startrx (u1_t rxmode) {
     ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
-    if(getSf(LMIC.rps) == FSK) { // FSK modem
+    if(getSf(radioCtx->rps) == FSK) { // FSK modem
         rxfsk(rxmode);
     } else { // LoRa modem
         rxlora(rxmode);
@@ -648,12 +741,14 @@ void radio_init () {
     hal_pin_rst(1); // drive RST pin high
     //delay(100);
     hal_waitUntil(os_getTime()+ms2osticks(3)); // wait >100us
+    clearShadow(0x00, 0x7F);
     u1_t v = readReg(RegVersion);
 #else
     hal_pin_rst(1); // drive RST pin high
     hal_waitUntil(os_getTime()+ms2osticks(1)); // wait >100us
     hal_pin_rst(2); // configure RST pin floating!
     hal_waitUntil(os_getTime()+ms2osticks(5)); // wait 5ms
+    clearShadow(0x00, 0x7F);
     u1_t v = readReg(RegVersion);
 #endif
 
@@ -669,7 +764,7 @@ void radio_init () {
     opmode(OPMODE_SLEEP);
     // seed 15-byte randomness via noise rssi
     rxlora(RXMODE_RSSI);
-    while( (readReg(RegOpMode) & OPMODE_MASK) != OPMODE_RX ); // continuous rx
+    while( (spiReadReg(RegOpMode) & OPMODE_MASK) != OPMODE_RX ); // continuous rx
     for(int i=1; i<16; i++) {
         for(int j=0; j<8; j++) {
             u1_t b; // wait for two non-identical subsequent least-significant bits
@@ -684,8 +779,8 @@ void radio_init () {
     writeReg(RegPaConfig, 0);
     
     // Launch Rx chain calibration for LF band
-    writeReg(FSKRegImageCal, (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
-    while((readReg(FSKRegImageCal)&RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING){ ; }
+    spiWriteReg(FSKRegImageCal, (spiReadReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
+    while((spiReadReg(FSKRegImageCal)&RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING){ ; }
 
     // Sets a Frequency in HF band
     u4_t frf = 868000000;
@@ -694,8 +789,8 @@ void radio_init () {
     writeReg(RegFrfLsb, (u1_t)(frf>> 0));
 
     // Launch Rx chain calibration for HF band 
-    writeReg(FSKRegImageCal, (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
-    while((readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING) { ; }
+    spiWriteReg(FSKRegImageCal, (spiReadReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
+    while((spiReadReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING) { ; }
 #endif /* CFG_sx1276mb1_board */
 
     opmode(OPMODE_SLEEP);
@@ -737,31 +832,34 @@ static const u2_t LORA_RXDONE_FIXUP[] = {
 // called by hal ext IRQ handler
 // (radio goes to stanby mode after tx/rx operations)
 void radio_irq_handler (u1_t dio) {
-    ostime_t now = os_getTime();
+    radio_irq_handler_at(dio, os_getTime());
+}
+
+void radio_irq_handler_at (u1_t dio, ostime_t now) {
     if( (readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
         u1_t flags = readReg(LORARegIrqFlags);
         if( flags & IRQ_LORA_TXDONE_MASK ) {
             // save exact tx time
-            LMIC.txend = now - us2osticks(43); // TXDONE FIXUP
+            radioCtx->txend = now - us2osticks(43); // TXDONE FIXUP
         } else if( flags & IRQ_LORA_RXDONE_MASK ) {
             // save exact rx time
-            if(getBw(LMIC.rps) == BW125) {
-                now -= LORA_RXDONE_FIXUP[getSf(LMIC.rps)];
+            if(getBw(radioCtx->rps) == BW125) {
+                now -= LORA_RXDONE_FIXUP[getSf(radioCtx->rps)];
             }
-            LMIC.rxtime = now;
+            radioCtx->rxtime = now;
             // read the PDU and inform the MAC that we received something
-            LMIC.dataLen = (readReg(LORARegModemConfig1) & SX1272_MC1_IMPLICIT_HEADER_MODE_ON) ?
+            radioCtx->dataLen = (readReg(LORARegModemConfig1) & SX1272_MC1_IMPLICIT_HEADER_MODE_ON) ?
                 readReg(LORARegPayloadLength) : readReg(LORARegRxNbBytes);
             // set FIFO read address pointer
             writeReg(LORARegFifoAddrPtr, readReg(LORARegFifoRxCurrentAddr)); 
             // now read the FIFO
-            readBuf(RegFifo, LMIC.frame, LMIC.dataLen);
+            readBuf(RegFifo, radioCtx->frame, radioCtx->dataLen);
             // read rx quality parameters
-            LMIC.snr  = readReg(LORARegPktSnrValue); // SNR [dB] * 4
-            LMIC.rssi = readReg(LORARegPktRssiValue) - 125 + 64; // RSSI [dBm] (-196...+63)
+            radioCtx->snr  = readReg(LORARegPktSnrValue); // SNR [dB] * 4
+            radioCtx->rssi = readReg(LORARegPktRssiValue) - 125 + 64; // RSSI [dBm] (-196...+63)
         } else if( flags & IRQ_LORA_RXTOUT_MASK ) {
             // indicate timeout
-            LMIC.dataLen = 0;
+            radioCtx->dataLen = 0;
         }
         // mask all radio IRQs
         writeReg(LORARegIrqFlagsMask, 0xFF);
@@ -772,20 +870,20 @@ void radio_irq_handler (u1_t dio) {
         u1_t flags2 = readReg(FSKRegIrqFlags2);
         if( flags2 & IRQ_FSK2_PACKETSENT_MASK ) {
             // save exact tx time
-            LMIC.txend = now;
+            radioCtx->txend = now;
         } else if( flags2 & IRQ_FSK2_PAYLOADREADY_MASK ) {
             // save exact rx time
-            LMIC.rxtime = now;
+            radioCtx->rxtime = now;
             // read the PDU and inform the MAC that we received something
-            LMIC.dataLen = readReg(FSKRegPayloadLength);
+            radioCtx->dataLen = readReg(FSKRegPayloadLength);
             // now read the FIFO
-            readBuf(RegFifo, LMIC.frame, LMIC.dataLen);
+            readBuf(RegFifo, radioCtx->frame, radioCtx->dataLen);
             // read rx quality parameters
-            LMIC.snr  = 0; // determine snr
-            LMIC.rssi = 0; // determine rssi
+            radioCtx->snr  = 0; // determine snr
+            radioCtx->rssi = 0; // determine rssi
         } else if( flags1 & IRQ_FSK1_TIMEOUT_MASK ) {
             // indicate timeout
-            LMIC.dataLen = 0;
+            radioCtx->dataLen = 0;
         } else {
             fprintf(stderr, "OhOh. Unknown interrupt flags for FSK\n");
             while(1);
@@ -794,11 +892,22 @@ void radio_irq_handler (u1_t dio) {
     // go from stanby to sleep
     opmode(OPMODE_SLEEP);
     // run os job (use preset func ptr)
-    os_setCallback(&LMIC.osjob, LMIC.osjob.func);
+    os_setCallback(&radioCtx->osjob, radioCtx->osjob.func);
 }
 
-void os_radio (u1_t mode) {
+#ifdef CFG_regverify
+static u2_t verifycnt;
+#endif
+
+void os_radio (lmic_ctx* ctx, u1_t mode) {
     hal_disableIRQs();
+    radioCtx = ctx;
+#ifdef CFG_regverify
+    if( ++verifycnt >= CFG_regverify ) {
+        verifycnt = 0;
+        verifyShadow();
+    }
+#endif
     switch (mode) {
       case RADIO_RST:
         // put radio to sleep
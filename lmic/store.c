@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * Persistent state for the LMIC on Linux: a small memory-mapped file holding
+ * two copies of a state blob. Each copy carries a generation counter and a
+ * CRC-32, a save overwrites the older copy, so a crash or power loss in the
+ * middle of a save leaves the previous copy intact. Each copy starts on a
+ * page of its own (at least 4096 bytes), so the two never share a page or a
+ * disk sector that a torn write could destroy together.
+ *******************************************************************************/
+
+#include "lmic.h"
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+enum { STORE_MAGIC = 0x314D4C53 };  // "SLM1"
+
+struct store_slot_t {
+    u4_t magic;
+    u4_t gen;       // incremented on every save, newest valid copy wins
+    u8_t wallms;    // CLOCK_REALTIME of the save
+    u4_t size;
+    u4_t crc;       // over everything above (crc=0) and the data
+    u1_t data[];
+};
+
+struct os_store_t {
+    int   fd;
+    u2_t  size;
+    u4_t  stride;   // bytes per slot
+    u1_t* map;
+    int   cur;      // slot with the newest valid copy (-1: none)
+};
+
+static struct store_slot_t* slot (os_store_t* st, int i) {
+    return (struct store_slot_t*)(st->map + i*st->stride);
+}
+
+static u4_t crc32 (u4_t crc, const u1_t* buf, u4_t len) {
+    crc = ~crc;
+    while( len-- ) {
+        crc ^= *buf++;
+        for( u1_t k=0; k<8; k++ )
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static u4_t slotCrc (os_store_t* st, struct store_slot_t* s) {
+    struct store_slot_t hdr = *s;
+    hdr.crc = 0;
+    return crc32(crc32(0, (const u1_t*)&hdr, sizeof(hdr)), s->data, st->size);
+}
+
+static bit_t slotValid (os_store_t* st, struct store_slot_t* s) {
+    return s->magic == STORE_MAGIC && s->size == st->size && s->crc == slotCrc(st, s);
+}
+
+static u8_t wallms () {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u8_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+os_store_t* os_storeOpen (const char* path, u2_t size) {
+    os_store_t* st = (os_store_t*)calloc(1, sizeof(os_store_t));
+    if( st == NULL )
+        return NULL;
+    st->size = size;
+    long page = sysconf(_SC_PAGESIZE);
+    if( page < 4096 )
+        page = 4096;
+    st->stride = (sizeof(struct store_slot_t) + size + page - 1) / page * page;
+    st->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if( st->fd < 0 || ftruncate(st->fd, 2*st->stride) < 0 || fsync(st->fd) < 0 )
+        goto fail;
+    st->map = (u1_t*)mmap(NULL, 2*st->stride, PROT_READ|PROT_WRITE, MAP_SHARED, st->fd, 0);
+    if( st->map == MAP_FAILED )
+        goto fail;
+    st->cur = -1;
+    for( int i=0; i<2; i++ ) {
+        if( slotValid(st, slot(st, i)) &&
+            (st->cur < 0 || (s4_t)(slot(st, i)->gen - slot(st, st->cur)->gen) > 0) )
+            st->cur = i;
+    }
+    return st;
+  fail:
+    if( st->fd >= 0 )
+        close(st->fd);
+    free(st);
+    return NULL;
+}
+
+void os_storeClose (os_store_t* st) {
+    if( st == NULL )
+        return;
+    msync(st->map, 2*st->stride, MS_SYNC);
+    munmap(st->map, 2*st->stride);
+    close(st->fd);
+    free(st);
+}
+
+bit_t os_storeLoad (os_store_t* st, void* data, u4_t* agems) {
+    if( st->cur < 0 )
+        return 0;
+    struct store_slot_t* s = slot(st, st->cur);
+    memcpy(data, s->data, st->size);
+    if( agems ) {
+        u8_t now = wallms();
+        *agems = now <= s->wallms ? 0 : now - s->wallms > 0xFFFFFFFF ? 0xFFFFFFFF : (u4_t)(now - s->wallms);
+    }
+    return 1;
+}
+
+static void writeSlot (os_store_t* st, const void* data) {
+    int next = st->cur < 0 ? 0 : 1 - st->cur;
+    struct store_slot_t* s = slot(st, next);
+    s->magic  = STORE_MAGIC;
+    s->gen    = st->cur < 0 ? 1 : slot(st, st->cur)->gen + 1;
+    s->wallms = wallms();
+    s->size   = st->size;
+    memcpy(s->data, data, st->size);
+    s->crc    = slotCrc(st, s);
+    st->cur = next;
+}
+
+void os_storeSave (os_store_t* st, const void* data, bit_t durable) {
+    writeSlot(st, data);
+    if( !durable ) {
+        // the page cache survives a crash of the process, write back in the
+        // background for power loss
+        msync(st->map, 2*st->stride, MS_ASYNC);
+        return;
+    }
+    // put both copies on disk, a torn save later on can only destroy one
+    msync(st->map, 2*st->stride, MS_SYNC);
+    writeSlot(st, data);
+    msync(st->map, 2*st->stride, MS_SYNC);
+}
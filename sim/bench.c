@@ -0,0 +1,709 @@
+// lmic-bench: micro benchmarks for the LMIC core, run on the simulation HAL.
+//
+//   lmic-bench              run all benchmarks with default sizes
+//   lmic-bench NAME [ARGS]  run one benchmark
+//
+// Every measurement is printed as one line of key=value pairs starting with
+// bench=NAME. Each benchmark also checks its results; the exit code is
+// non-zero if any check failed.
+
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "lmic.h"
+#include "sx127x.h"
+
+// not used by the benchmarks, but required by the LMIC core
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+void onEvent (ev_t ev) { }
+
+static u8_t wall_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void report (const char* bench, const char* op, long n, u8_t ns) {
+    printf("bench=%s op=%s n=%ld ns_per_op=%.1f\n", bench, op, n, n ? (double)ns / n : 0.0);
+}
+
+static int check (const char* bench, const char* what, int ok) {
+    if( !ok )
+        printf("bench=%s check=%s result=FAIL\n", bench, what);
+    return ok ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// sched: insert, reschedule, cancel and dispatch many timed jobs
+
+static osjob_t*   jobs;
+static long       njobs;
+static long       fired;
+static int        badorder;
+static ostime64_t lastdl;
+
+static void onTimedJob (osjob_t* j) {
+    if( j->deadline < lastdl || os_getTime64() < j->deadline || (j - jobs) % 4 == 0 )
+        badorder++;
+    lastdl = j->deadline;
+    fired++;
+}
+
+static void onRunJob (osjob_t* j) {
+    if( j - jobs != fired )
+        badorder++;
+    fired++;
+}
+
+static int benchSched (int argc, char** argv) {
+    njobs = argc > 0 ? atol(argv[0]) : 100000;
+    jobs = (osjob_t*)calloc(njobs, sizeof(osjob_t));
+    const ostime64_t range = sec2osticks(3600);
+    ostime64_t now = os_getTime64();
+    int fails = 0;
+    u8_t t0;
+
+    t0 = wall_ns();
+    for( long i=0; i<njobs; i++ )
+        os_setTimedCallback64(&jobs[i], now + 1 + rand() % range, onTimedJob);
+    report("sched", "insert", njobs, wall_ns() - t0);
+
+    t0 = wall_ns();
+    for( long i=0; i<njobs; i++ )
+        os_setTimedCallback64(&jobs[rand() % njobs], now + 1 + rand() % range, onTimedJob);
+    report("sched", "reschedule", njobs, wall_ns() - t0);
+
+    long cancelled = 0;
+    t0 = wall_ns();
+    for( long i=0; i<njobs; i+=4, cancelled++ )
+        os_clearCallback(&jobs[i]);
+    report("sched", "cancel", cancelled, wall_ns() - t0);
+
+    fired = badorder = 0;
+    lastdl = 0;
+    t0 = wall_ns();
+    while( fired < njobs - cancelled )
+        os_runloop_once();
+    report("sched", "dispatch", fired, wall_ns() - t0);
+    fails += check("sched", "timed_order", badorder == 0);
+
+    fired = badorder = 0;
+    t0 = wall_ns();
+    for( long i=0; i<njobs; i++ )
+        os_setCallback(&jobs[i], onRunJob);
+    while( fired < njobs )
+        os_runloop_once();
+    report("sched", "runnable", njobs, wall_ns() - t0);
+    fails += check("sched", "fifo_order", badorder == 0);
+
+    free(jobs);
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+// post: producer threads post jobs with os_postCallback(), the main thread
+// runs them
+
+static int       nproducers;
+static long      nposts;            // per producer
+static osjob_t*  postjobs;
+static long*     lastseen;          // per producer: index of the last job run
+static osjob_t   polljob;
+
+static void onPostJob (osjob_t* j) {
+    long k = j - postjobs;
+    long p = k / nposts;
+    if( k % nposts != lastseen[p] + 1 )
+        badorder++;
+    lastseen[p] = k % nposts;
+    fired++;
+}
+
+// hal_sleep() of the simulation exits when nothing is pending, so keep a
+// timer armed while the producers are running
+static void onPoll (osjob_t* j) {
+    if( fired < nproducers * nposts )
+        os_setTimedCallback(j, os_getTime() + 1, onPoll);
+}
+
+static void* producer (void* arg) {
+    osjob_t* jobs = (osjob_t*)arg;
+    for( long i=0; i<nposts; i++ )
+        os_postCallback(&jobs[i], onPostJob);
+    return NULL;
+}
+
+static int benchPost (int argc, char** argv) {
+    nproducers = argc > 0 ? atoi(argv[0]) : 4;
+    nposts = argc > 1 ? atol(argv[1]) : 100000;
+    postjobs = (osjob_t*)calloc(nproducers * nposts, sizeof(osjob_t));
+    lastseen = (long*)malloc(nproducers * sizeof(long));
+    pthread_t* threads = (pthread_t*)malloc(nproducers * sizeof(pthread_t));
+    for( int p=0; p<nproducers; p++ )
+        lastseen[p] = -1;
+    fired = badorder = 0;
+
+    u8_t t0 = wall_ns();
+    os_setCallback(&polljob, onPoll);
+    for( int p=0; p<nproducers; p++ )
+        pthread_create(&threads[p], NULL, producer, &postjobs[p * nposts]);
+    while( fired < nproducers * nposts )
+        os_runloop_once();
+    u8_t t = wall_ns() - t0;
+    for( int p=0; p<nproducers; p++ )
+        pthread_join(threads[p], NULL);
+    os_clearCallback(&polljob);
+
+    printf("bench=post op=post_run producers=%d n=%ld ns_per_op=%.1f\n",
+           nproducers, fired, (double)t / fired);
+    int fails = check("post", "fifo_per_producer", badorder == 0);
+    free(threads);
+    free(lastseen);
+    free(postjobs);
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+// airtime: calcAirTime() table lookups against the formula
+
+static int benchAirtime (int argc, char** argv) {
+    long n = argc > 0 ? atol(argv[0]) : 10000000;
+    int fails = 0;
+
+    // bit-exact over every sf/bw/cr/crc/header combination and length
+    long mismatches = 0, combos = 0;
+    for( int sf=FSK; sf<=SF12; sf++ )
+    for( int bw=BW125; bw<=BW500; bw++ )
+    for( int cr=CR_4_5; cr<=CR_4_8; cr++ )
+    for( int nocrc=0; nocrc<2; nocrc++ )
+    for( int ih=0; ih<256; ih+=255 ) {
+        rps_t rps = makeRps(sf, bw, cr, ih, nocrc);
+        for( int plen=0; plen<256; plen++, combos++ ) {
+            if( calcAirTime(rps, plen) != calcAirTimeFormula(rps, plen) )
+                mismatches++;
+        }
+    }
+    printf("bench=airtime op=verify n=%ld mismatches=%ld\n", combos, mismatches);
+    fails += check("airtime", "bit_exact", mismatches == 0);
+
+    // random uplinks over the LoRa data rates of the region
+#if defined(CFG_eu868)
+    const int maxdr = DR_SF7B;
+#else
+    const int maxdr = DR_SF8C;
+#endif
+    rps_t* rps = (rps_t*)malloc(n * sizeof(rps_t));
+    u1_t* plen = (u1_t*)malloc(n);
+    for( long i=0; i<n; i++ ) {
+        rps[i] = updr2rps(rand() % (maxdr+1));
+        plen[i] = rand();
+    }
+    volatile ostime_t sink = 0;
+    u8_t t0 = wall_ns();
+    for( long i=0; i<n; i++ )
+        sink += calcAirTimeFormula(rps[i], plen[i]);
+    report("airtime", "formula", n, wall_ns() - t0);
+    t0 = wall_ns();
+    for( long i=0; i<n; i++ )
+        sink += calcAirTime(rps[i], plen[i]);
+    report("airtime", "table", n, wall_ns() - t0);
+    free(rps);
+    free(plen);
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+// chan: uplink channel selection with every channel of a plan defined
+//
+// EU868: all channels in one band, every fourth one without SF7. US915: the
+// 125 kHz channels of the plan enabled except every fourth one.
+
+#if defined(CFG_eu868)
+enum { CHAN_MAX = MAX_CHANNELS, CHAN_MIN = 16 };
+#else
+enum { CHAN_MAX = 64, CHAN_MIN = 8 };
+#endif
+
+static int benchChan (int argc, char** argv) {
+    long n = argc > 0 ? atol(argv[0]) : 1000000;
+    int fails = 0;
+    for( int nch=CHAN_MIN; nch<=CHAN_MAX; nch+=CHAN_MAX-CHAN_MIN ) {
+        lmic_ctx* ctx = (lmic_ctx*)calloc(1, sizeof(lmic_ctx));
+        lmic_reset(ctx);
+#if defined(CFG_eu868)
+        for( int i=0; i<MAX_CHANNELS; i++ )
+            lmic_disableChannel(ctx, i);
+        for( int i=0; i<nch; i++ )
+            lmic_setupChannel(ctx, i, 863100000 + i*95000,
+                              i % 4 == 3 ? DR_RANGE_MAP(DR_SF12,DR_SF8) : 0, BAND_CENTI);
+#else
+        for( int i=0; i<64; i++ )
+            ctx->channelMap[i>>4] &= ~(1 << (i & 0xF));
+        for( int i=0; i<nch; i++ )
+            if( i % 4 != 3 )
+                ctx->channelMap[i>>4] |= 1 << (i & 0xF);
+#endif
+        ctx->datarate = DR_SF7;
+
+        long* count = (long*)calloc(CHAN_MAX, sizeof(long));
+        ostime_t now = os_getTime();
+        u8_t t0 = wall_ns();
+        for( long i=0; i<n; i++ ) {
+            lmic_selectChannel(ctx, now);
+            count[ctx->txChnl]++;
+        }
+        u8_t t = wall_ns() - t0;
+        printf("bench=chan op=select channels=%d n=%ld ns_per_op=%.1f\n", nch, n, (double)t / n);
+
+        // round robin over exactly the channels usable at SF7 (the US915 one
+        // restarts at a random channel whenever its counter wraps to 0)
+        long usable = nch - nch/4, bad = 0;
+        for( int i=0; i<CHAN_MAX; i++ ) {
+            long want = i < nch && i % 4 != 3 ? n / usable : 0;
+#if defined(CFG_eu868)
+            long lo = want, hi = want + 1;
+#else
+            long lo = want ? want - want/100 - 1 : 0, hi = want ? want + want/100 + 1 : 0;
+#endif
+            if( count[i] < lo || count[i] > hi )
+                bad++;
+        }
+        fails += check("chan", "round_robin", bad == 0);
+        free(count);
+        free(ctx);
+    }
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+// aesbatch: CTR and MIC over many frames with different keys, one os_aes_k()
+// call per frame against one os_aesBatch() call. Every variant runs several
+// rounds over the same frames, the fastest round counts.
+
+static int benchAesBatch (int argc, char** argv) {
+    long n = argc > 0 ? atol(argv[0]) : 1000;
+    int len = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100;
+    int fails = 0;
+    os_aeskey_t* keys = (os_aeskey_t*)malloc(n * sizeof(os_aeskey_t));
+    u1_t* single = (u1_t*)malloc(n * len);
+    u1_t* batch = (u1_t*)malloc(n * len);
+    u4_t* aux = (u4_t*)malloc(n * 16);
+    u4_t* res = (u4_t*)malloc(n * sizeof(u4_t));
+    os_aesjob_t* jobs = (os_aesjob_t*)malloc(n * sizeof(os_aesjob_t));
+    for( long i=0; i<n; i++ ) {
+        u1_t key[16];
+        for( int k=0; k<16; k++ )
+            key[k] = rand();
+        os_aesKey(&keys[i], key);
+    }
+    for( long i=0; i<n*len; i++ )
+        single[i] = batch[i] = rand();
+
+    static const struct { const char* op; u1_t mode; } modes[] = {
+        { "ctr", AES_CTR }, { "mic", AES_MIC },
+    };
+    for( u1_t m=0; m<sizeof(modes)/sizeof(modes[0]); m++ ) {
+        u1_t mode = modes[m].mode;
+        for( long i=0; i<n; i++ ) {
+            jobs[i].mode = mode;
+            jobs[i].len  = len;
+            jobs[i].buf  = batch + i*len;
+            jobs[i].key  = &keys[i];
+            jobs[i].aux  = &aux[4*i];
+        }
+        u8_t best1 = ~(u8_t)0, bestb = ~(u8_t)0;
+        for( int r=0; r<rounds; r++ ) {
+            u8_t t0 = wall_ns();
+            for( long i=0; i<n; i++ ) {
+                memset(&aux[4*i], (u1_t)i, 16);
+                res[i] = os_aes_k(mode, single + i*len, len, &keys[i], &aux[4*i]);
+            }
+            u8_t t1 = wall_ns();
+            for( long i=0; i<n; i++ )
+                memset(&aux[4*i], (u1_t)i, 16);
+            os_aesBatch(jobs, n);
+            u8_t t2 = wall_ns();
+            if( t1 - t0 < best1 ) best1 = t1 - t0;
+            if( t2 - t1 < bestb ) bestb = t2 - t1;
+        }
+        printf("bench=aesbatch op=%s backend=%s len=%d n=%ld ns_per_frame_single=%.1f ns_per_frame_batch=%.1f speedup=%.2f\n",
+               modes[m].op, os_aesBackend(), len, n, (double)best1 / n, (double)bestb / n,
+               bestb ? (double)best1 / bestb : 0.0);
+        long bad = 0;
+        for( long i=0; i<n; i++ )
+            if( jobs[i].res != res[i] || memcmp(batch + i*len, single + i*len, len) != 0 )
+                bad++;
+        fails += check("aesbatch", modes[m].op, bad == 0);
+    }
+    free(jobs);
+    free(res);
+    free(aux);
+    free(batch);
+    free(single);
+    free(keys);
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+// aes: conformance of every available AES backend against published vectors
+// and whole LoRaWAN frames, then ECB, CTR and CMAC speed at LoRaWAN sizes.
+//
+// RFC 4493 and FIPS-197 / SP 800-38A vectors check the primitives. The
+// LoRaWAN frames go through the MAC on the radio model, so aes_encrypt,
+// aes_cipher, aes_appendMic, aes_verifyMic and aes_sessKeys are covered as
+// used. The uplink is the published lora-packet example frame, the other
+// expected bytes were computed with OpenSSL.
+
+static const u1_t rfcKey[16] = {
+    0x2b,0x7e,0x15,0x16, 0x28,0xae,0xd2,0xa6, 0xab,0xf7,0x15,0x88, 0x09,0xcf,0x4f,0x3c,
+};
+static const u1_t rfcMsg[64] = {
+    0x6b,0xc1,0xbe,0xe2, 0x2e,0x40,0x9f,0x96, 0xe9,0x3d,0x7e,0x11, 0x73,0x93,0x17,0x2a,
+    0xae,0x2d,0x8a,0x57, 0x1e,0x03,0xac,0x9c, 0x9e,0xb7,0x6f,0xac, 0x45,0xaf,0x8e,0x51,
+    0x30,0xc8,0x1c,0x46, 0xa3,0x5c,0xe4,0x11, 0xe5,0xfb,0xc1,0x19, 0x1a,0x0a,0x52,0xef,
+    0xf6,0x9f,0x24,0x45, 0xdf,0x4f,0x9b,0x17, 0xad,0x2b,0x41,0x7b, 0xe6,0x6c,0x37,0x10,
+};
+// RFC 4493 examples 2-4 (example 1, the empty message, is not a LoRaWAN MIC:
+// os_aes() MICs at least one byte)
+static const struct { u1_t len; u1_t tag[16]; } rfcTags[] = {
+    { 16, { 0x07,0x0a,0x16,0xb4, 0x6b,0x4d,0x41,0x44, 0xf7,0x9b,0xdd,0x9d, 0xd0,0x4a,0x28,0x7c } },
+    { 40, { 0xdf,0xa6,0x67,0x47, 0xde,0x9a,0xe6,0x30, 0x30,0xca,0x32,0x61, 0x14,0x97,0xc8,0x27 } },
+    { 64, { 0x51,0xf0,0xbe,0xbf, 0x7e,0x3b,0x9d,0x92, 0xfc,0x49,0x74,0x17, 0x79,0x36,0x3c,0xfe } },
+};
+// SP 800-38A F.5.1, CTR-AES128 with rfcKey over rfcMsg
+static const u1_t ctrIv[16] = {
+    0xf0,0xf1,0xf2,0xf3, 0xf4,0xf5,0xf6,0xf7, 0xf8,0xf9,0xfa,0xfb, 0xfc,0xfd,0xfe,0xff,
+};
+static const u1_t ctrOut[64] = {
+    0x87,0x4d,0x61,0x91, 0xb6,0x20,0xe3,0x26, 0x1b,0xef,0x68,0x64, 0x99,0x0d,0xb6,0xce,
+    0x98,0x06,0xf6,0x6b, 0x79,0x70,0xfd,0xff, 0x86,0x17,0x18,0x7b, 0xb9,0xff,0xfd,0xff,
+    0x5a,0xe4,0xdf,0x3e, 0xdb,0xd5,0xd3,0x5e, 0x5b,0x4f,0x09,0x02, 0x0d,0xb0,0x3e,0xab,
+    0x1e,0x03,0x1d,0xda, 0x2f,0xbe,0x03,0xd1, 0x79,0x21,0x70,0xa0, 0xf3,0x00,0x9c,0xee,
+};
+// FIPS-197 C.1
+static const u1_t ecbKey[16] = {
+    0x00,0x01,0x02,0x03, 0x04,0x05,0x06,0x07, 0x08,0x09,0x0a,0x0b, 0x0c,0x0d,0x0e,0x0f,
+};
+static const u1_t ecbIn[16] = {
+    0x00,0x11,0x22,0x33, 0x44,0x55,0x66,0x77, 0x88,0x99,0xaa,0xbb, 0xcc,0xdd,0xee,0xff,
+};
+static const u1_t ecbOut[16] = {
+    0x69,0xc4,0xe0,0xd8, 0x6a,0x7b,0x04,0x30, 0xd8,0xcd,0xb7,0x80, 0x70,0xb4,0xc5,0x5a,
+};
+
+// OTAA with appKey and devNonce 0x1234: join request, join accept and the
+// session keys derived from it (devaddr 0x12345678, netid 0x13)
+static const u1_t joinKey[16] = {
+    0x00,0x11,0x22,0x33, 0x44,0x55,0x66,0x77, 0x88,0x99,0xaa,0xbb, 0xcc,0xdd,0xee,0xff,
+};
+static const u1_t joinArtEui[8] = { 0x00,0x00,0x00,0xd0, 0x7e,0xd5,0xb3,0x70 };
+static const u1_t joinDevEui[8] = { 0x01,0x02,0x03,0x04, 0x05,0x06,0x07,0x08 };
+static const u1_t joinReq[LEN_JR] = {
+    0x00, 0x00,0x00,0x00,0xd0,0x7e,0xd5,0xb3,0x70, 0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,
+    0x34,0x12, 0xdb,0x14,0xad,0x4f,
+};
+static const u1_t joinAcc[LEN_JA] = {
+    0x20, 0xa7,0x11,0x38,0xfe, 0x8e,0xea,0x89,0xfe, 0xc3,0x87,0x2e,0xb7, 0x0e,0x9b,0xa8,0x19,
+};
+static const u1_t joinNwkKey[16] = {
+    0xcf,0xa3,0xf1,0x88, 0x52,0xee,0x54,0x8c, 0x01,0x2e,0xe2,0xb7, 0xb6,0x1f,0x6d,0x1e,
+};
+static const u1_t joinArtKey[16] = {
+    0xda,0x3d,0xae,0xd3, 0xc7,0x38,0x27,0x9c, 0x62,0xc2,0x0b,0x70, 0x11,0x5c,0x5e,0x3c,
+};
+// ABP session devaddr 0x49BE7DF1: uplink FCnt 2 "test" on port 1, downlink
+// FCnt 0 "ok" on port 1
+static const u1_t abpNwkKey[16] = {
+    0x44,0x02,0x42,0x41, 0xed,0x4c,0xe9,0xa6, 0x8c,0x6a,0x8b,0xc0, 0x55,0x23,0x3f,0xd3,
+};
+static const u1_t abpArtKey[16] = {
+    0xec,0x92,0x58,0x02, 0xae,0x43,0x0c,0xa7, 0x7f,0xd3,0xdd,0x73, 0xcb,0x2c,0xc5,0x88,
+};
+static const u1_t abpUp[] = {
+    0x40, 0xf1,0x7d,0xbe,0x49, 0x00, 0x02,0x00, 0x01, 0x95,0x43,0x78,0x76, 0x2b,0x11,0xff,0x0d,
+};
+static const u1_t abpDn[] = {
+    0x60, 0xf1,0x7d,0xbe,0x49, 0x00, 0x00,0x00, 0x01, 0x31,0x22, 0xc0,0x4d,0x9e,0x1d,
+};
+
+// tag or counter block left in aux by os_aes()
+static bit_t auxIs (const u4_t* aux, const u1_t* want) {
+    u1_t b[16];
+    for( u1_t i=0; i<4; i++ )
+        os_wmsbf4(b+4*i, aux[i]);
+    return memcmp(b, want, 16) == 0;
+}
+
+static int aesPrimitives () {
+    int fails = 0;
+    os_aeskey_t key;
+    u4_t aux[4];
+    u1_t buf[64];
+
+    os_aesKey(&key, ecbKey);
+    memcpy(buf, ecbIn, 16);
+    os_aes_k(AES_ENC, buf, 16, &key, aux);
+    fails += check("aes", "fips197_ecb", memcmp(buf, ecbOut, 16) == 0);
+    // the classic entry point on AESkey
+    memcpy(AESkey, ecbKey, 16);
+    memcpy(buf, ecbIn, 16);
+    os_aes(AES_ENC, buf, 16);
+    fails += check("aes", "fips197_os_aes", memcmp(buf, ecbOut, 16) == 0);
+
+    os_aesKey(&key, rfcKey);
+    memcpy(buf, rfcMsg, 64);
+    memcpy(aux, ctrIv, 16);
+    os_aes_k(AES_CTR, buf, 64, &key, aux);
+    fails += check("aes", "sp800_38a_ctr", memcmp(buf, ctrOut, 64) == 0);
+
+    for( u1_t i=0; i<sizeof(rfcTags)/sizeof(rfcTags[0]); i++ ) {
+        memcpy(buf, rfcMsg, 64);
+        u4_t mic = os_aes_k(AES_MIC|AES_MICNOAUX, buf, rfcTags[i].len, &key, aux);
+        char what[32];
+        snprintf(what, sizeof(what), "rfc4493_cmac_%d", rfcTags[i].len);
+        fails += check("aes", what, auxIs(aux, rfcTags[i].tag) && mic == os_rmsbf4(rfcTags[i].tag)
+                       && memcmp(buf, rfcMsg, 64) == 0);
+        memcpy(AESkey, rfcKey, 16);
+        mic = os_aes(AES_MIC|AES_MICNOAUX, buf, rfcTags[i].len);
+        snprintf(what, sizeof(what), "rfc4493_os_aes_%d", rfcTags[i].len);
+        fails += check("aes", what, auxIs(AESAUX, rfcTags[i].tag) && mic == os_rmsbf4(rfcTags[i].tag));
+    }
+    return fails;
+}
+
+static lmic_ctx*           aesCtx;   // device under test
+static struct sx127x_frame aesUp;    // first frame sent by the device (len=0: none yet)
+static const u1_t*         aesDn;    // answer to it in RX1 (NULL: none)
+static u1_t                aesDnLen;
+static ev_t                aesEv;
+
+static void aesOnUplink (const struct sx127x_frame* up) {
+    if( aesUp.len == 0 )
+        aesUp = *up;
+    if( aesDn == NULL )
+        return;
+    struct sx127x_frame dn;
+    memcpy(dn.data, aesDn, aesDnLen);
+    dn.len   = aesDnLen;
+    // RX1 as set up by the MAC
+#if defined(CFG_eu868)
+    dn.freq  = up->freq;
+    dn.rps   = setNocrc(up->rps, 1);
+#else
+    dr_t dr  = aesCtx->dndr < DR_SF8C ? aesCtx->dndr + DR_SF10CR - DR_SF10 : DR_SF7CR;
+    dn.freq  = US915_500kHz_DNFBASE + (aesCtx->txChnl & 0x7) * US915_500kHz_DNFSTEP;
+    dn.rps   = dndr2rps(dr);
+#endif
+    bit_t jacc = (up->data[OFF_DAT_HDR] & HDR_FTYPE) == HDR_FTYPE_JREQ;
+    dn.start = up->end + (jacc ? sec2osticks(DELAY_JACC1) : sec2osticks(DELAY_DNW1));
+    dn.end   = dn.start + calcAirTime(dn.rps, dn.len);
+    dn.rssi  = -60;
+    dn.snr   = 8*4;
+    sx127x_inject(&dn);
+    aesDn = NULL;
+}
+
+static void aesOnEvent (lmic_ctx* ctx, ev_t ev) {
+    aesEv = ev;
+}
+
+// run the scheduler until the device reports ev (bounded, a rejected
+// downlink would make the MAC retry for a long time)
+static bit_t aesRunUntil (ev_t ev) {
+    aesEv = (ev_t)0;
+    for( int i=0; i<1000 && aesEv != ev; i++ )
+        os_runloop_once();
+    return aesEv == ev;
+}
+
+// stdout to /dev/null while the MAC runs, it logs every uplink frequency
+static int aesMute () {
+    fflush(stdout);
+    int fd = dup(1);
+    int nul = open("/dev/null", O_WRONLY);
+    dup2(nul, 1);
+    close(nul);
+    return fd;
+}
+
+static void aesUnmute (int fd) {
+    fflush(stdout);
+    dup2(fd, 1);
+    close(fd);
+}
+
+static int aesLorawan () {
+    int fails = 0, out = aesMute();
+    lmic_ctx* ctx = (lmic_ctx*)calloc(1, sizeof(lmic_ctx));
+    aesCtx = ctx;
+    lmic_init(ctx);
+    lmic_setEventCallback(ctx, aesOnEvent);
+    lmic_setIdentity(ctx, joinArtEui, joinDevEui, joinKey);
+    lmic_reset(ctx);
+    sx127x_onTx(aesOnUplink);
+
+    ctx->devNonce = 0x1234;
+    aesUp.len = 0;
+    aesDn = joinAcc;
+    aesDnLen = sizeof(joinAcc);
+    lmic_startJoining(ctx);
+    bit_t joined = aesRunUntil(EV_JOINED);
+    bit_t jreqOk = aesUp.len == LEN_JR && memcmp(aesUp.data, joinReq, LEN_JR) == 0;
+    bit_t jaccOk = joined && ctx->devaddr == 0x12345678 && ctx->netid == 0x13 &&
+        memcmp(ctx->nwkKey, joinNwkKey, 16) == 0 && memcmp(ctx->artKey, joinArtKey, 16) == 0;
+    if( !joined )
+        lmic_reset(ctx);  // stop joining
+
+    lmic_setSession(ctx, 0x13, 0x49BE7DF1, (u1_t*)abpNwkKey, (u1_t*)abpArtKey);
+    lmic_setAdrMode(ctx, 0);
+    lmic_setLinkCheckMode(ctx, 0);
+    ctx->seqnoUp = 2;
+    aesUp.len = 0;
+    aesDn = abpDn;
+    aesDnLen = sizeof(abpDn);
+    u1_t data[] = { 't', 'e', 's', 't' };
+    lmic_setTxData2(ctx, 1, data, sizeof(data), 0);
+    bit_t done = aesRunUntil(EV_TXCOMPLETE);
+    bit_t upOk = aesUp.len == sizeof(abpUp) && memcmp(aesUp.data, abpUp, sizeof(abpUp)) == 0;
+    bit_t dnOk = done && (ctx->txrxFlags & TXRX_PORT) && ctx->frame[ctx->dataBeg-1] == 1 &&
+        ctx->dataLen == 2 && memcmp(ctx->frame+ctx->dataBeg, "ok", 2) == 0;
+
+    sx127x_onTx(NULL);
+    lmic_shutdown(ctx);
+    free(ctx);
+    aesUnmute(out);
+    fails += check("aes", "lorawan_join_request", jreqOk);
+    fails += check("aes", "lorawan_join_accept", jaccOk);
+    fails += check("aes", "lorawan_uplink", upOk);
+    fails += check("aes", "lorawan_downlink", dnOk);
+    return fails;
+}
+
+// CPU cycles from the perf counter, or else the x86 time stamp counter
+static int         cycFd = -1;
+static const char* cycSrc;
+
+static void cycInit () {
+    if( cycSrc != NULL )
+        return;
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CPU_CYCLES;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    cycFd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+    cycSrc = cycFd >= 0 ? "perf" : "none";
+#if defined(__x86_64__) || defined(__i386__)
+    if( cycFd < 0 )
+        cycSrc = "tsc";
+#endif
+}
+
+static u8_t cycles () {
+    u8_t c = 0;
+    if( cycFd >= 0 ) {
+        if( read(cycFd, &c, sizeof(c)) != sizeof(c) )
+            c = 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    else
+        c = __rdtsc();
+#endif
+    return c;
+}
+
+static void aesSpeed (long n) {
+    static const struct { const char* op; u1_t mode; } ops[] = {
+        { "ecb", AES_ENC }, { "ctr", AES_CTR }, { "cmac", AES_MIC },
+    };
+    static const int lens[] = { 16, 64, 255 };
+    os_aeskey_t key;
+    os_aesKey(&key, rfcKey);
+    u1_t buf[256];
+    u4_t aux[4];
+    for( int i=0; i<256; i++ )
+        buf[i] = rand();
+    for( u1_t o=0; o<sizeof(ops)/sizeof(ops[0]); o++ )
+    for( u1_t l=0; l<sizeof(lens)/sizeof(lens[0]); l++ ) {
+        // ECB works on whole blocks
+        int len = ops[o].mode == AES_ENC ? (lens[l] + 15) & ~15 : lens[l];
+        u8_t bestns = ~(u8_t)0, bestcyc = ~(u8_t)0;
+        for( int r=0; r<5; r++ ) {
+            u8_t t0 = wall_ns(), c0 = cycles();
+            for( long i=0; i<n; i++ ) {
+                memcpy(aux, ctrIv, 16);
+                os_aes_k(ops[o].mode, buf, len, &key, aux);
+            }
+            u8_t c = cycles() - c0, t = wall_ns() - t0;
+            if( t < bestns ) bestns = t;
+            if( c < bestcyc ) bestcyc = c;
+        }
+        printf("bench=aes op=%s backend=%s len=%d n=%ld ns_per_op=%.1f ops_per_sec=%.0f",
+               ops[o].op, os_aesBackend(), len, n, (double)bestns / n, bestns ? 1e9 * n / bestns : 0.0);
+        if( cycFd >= 0 || strcmp(cycSrc, "tsc") == 0 )
+            printf(" cycles_per_byte=%.2f cycles=%s", (double)bestcyc / n / len, cycSrc);
+        printf("\n");
+    }
+}
+
+static int benchAes (int argc, char** argv) {
+    long n = argc > 0 ? atol(argv[0]) : 20000;
+    static const char* const backends[] = { "aesni", "armv8", "table" };
+    int fails = 0;
+    cycInit();
+    for( u1_t b=0; b<sizeof(backends)/sizeof(backends[0]); b++ ) {
+        if( !os_aesSelect(backends[b]) ) {
+            printf("bench=aes backend=%s available=0\n", backends[b]);
+            continue;
+        }
+        int f = aesPrimitives() + aesLorawan();
+        printf("bench=aes op=verify backend=%s available=1 failed=%d\n", backends[b], f);
+        fails += f;
+        aesSpeed(n);
+    }
+    os_aesSelect(NULL);
+    return fails;
+}
+
+// -----------------------------------------------------------------------------
+
+static const struct {
+    const char* name;
+    int (*run) (int argc, char** argv);
+} benches[] = {
+    { "sched", benchSched },
+    { "post",  benchPost },
+    { "airtime", benchAirtime },
+    { "chan",  benchChan },
+    { "aesbatch", benchAesBatch },
+    { "aes",   benchAes },
+};
+
+int main (int argc, char** argv) {
+    int fails = 0, found = 0;
+    srand(1);
+    os_init();
+    for( u1_t i=0; i<sizeof(benches)/sizeof(benches[0]); i++ ) {
+        if( argc > 1 && strcmp(argv[1], benches[i].name) != 0 )
+            continue;
+        found = 1;
+        fails += benches[i].run(argc > 1 ? argc-2 : 0, argv + 2);
+    }
+    if( !found ) {
+        fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+        return 2;
+    }
+    return fails ? 1 : 0;
+}
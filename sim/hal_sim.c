@@ -0,0 +1,190 @@
+// HAL for running LMIC without hardware: the radio is the software model in
+// sx127x.c, SPI transfers are register accesses on that model and DIO
+// interrupts are its flag lines, sampled whenever interrupts are re-enabled.
+//
+// Time is virtual: it only advances when LMIC waits. hal_waitUntil() sets the
+// clock to its target and hal_sleep() jumps to the earlier of the armed timer
+// (the next scheduled job) and the next radio event, so code runs in zero
+// simulated time and idle periods cost nothing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lmic.h"
+#include "sx127x.h"
+
+enum { NUM_DIO = 3 };
+
+// -----------------------------------------------------------------------------
+// I/O
+
+void hal_pin_nss (u1_t val) {
+}
+
+void hal_pin_rxtx (u1_t val) {
+}
+
+// the radio is reset while RST is active (low on the SX1276, high on the SX1272)
+void hal_pin_rst (u1_t val) {
+#ifdef CFG_sx1276_radio
+    if( val == 0 )
+        sx127x_reset();
+#else
+    if( val == 1 )
+        sx127x_reset();
+#endif
+}
+
+static u1_t diolevel;
+
+static void hal_io_check () {
+    ostime64_t at;
+    sx127x_update();
+    u1_t lv = sx127x_dio(&at);
+    u1_t rise = lv & ~diolevel;
+    diolevel = lv;
+    for( u1_t i = 0; i < NUM_DIO; i++ ) {
+        if( rise & (1 << i) ) {
+            radio_irq_handler_at(i, (ostime_t)at);
+        }
+    }
+    if( rise ) {
+        diolevel = sx127x_dio(NULL); // handlers clear the flags
+    }
+}
+
+// -----------------------------------------------------------------------------
+// SPI
+
+// radio.c only uses register and burst transfers
+u1_t hal_spi (u1_t out) {
+    hal_failed(__FILE__, __LINE__);
+    return 0;
+}
+
+u1_t hal_spi_reg (u1_t addr, u1_t data) {
+    return sx127x_reg(addr, data);
+}
+
+void hal_spi_burst (u1_t addr, u1_t* buf, u1_t len, u1_t dir) {
+    sx127x_burst(addr, buf, len, dir);
+}
+
+// -----------------------------------------------------------------------------
+// TIME
+
+static u8_t clock_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u8_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static u8_t tstart_ns;   // wall clock at hal_init()
+static u8_t vticks;      // virtual time
+
+u8_t hal_ticks64 (void) {
+    return vticks;
+}
+
+u4_t hal_ticks (void) {
+    return (u4_t)hal_ticks64();
+}
+
+#if defined(CFG_jobstats)
+// wall clock, so run times show the real cost of the callbacks
+u8_t hal_nanos (void) {
+    return clock_ns();
+}
+#endif
+
+static void waitTicks64 (ostime64_t time) {
+    if( time > (ostime64_t)vticks )
+        vticks = time;
+}
+
+static ostime64_t extend (u4_t time) {
+    ostime64_t now = hal_ticks64();
+    return now + (s4_t)(time - (u4_t)now);
+}
+
+void hal_waitUntil (u4_t time) {
+    waitTicks64(extend(time));
+}
+
+static bit_t      timerArmed;
+static ostime64_t timerTarget;
+
+u1_t hal_checkTimer (u4_t time) {
+    ostime64_t t = extend(time);
+    if( t - (ostime64_t)hal_ticks64() <= 5 ) {
+        // due: move the clock onto the deadline, otherwise a job that
+        // re-checks time would see it a few ticks early forever
+        waitTicks64(t);
+        timerArmed = 0;
+        return 1;
+    }
+    timerArmed = 1;
+    timerTarget = t;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// IRQ / SLEEP
+
+static u1_t irqlevel;
+static u8_t idle_ticks;
+
+void hal_disableIRQs () {
+    irqlevel++;
+}
+
+void hal_enableIRQs () {
+    if( --irqlevel == 0 ) {
+        hal_io_check();
+    }
+}
+
+static u1_t wakeup;
+
+// the simulation is single-threaded, a wakeup only makes the next
+// hal_sleep() return without advancing time
+void hal_wakeup () {
+    __atomic_store_n(&wakeup, 1, __ATOMIC_RELEASE);
+}
+
+// sleep until the armed timer expires or the radio model has its next event
+void hal_sleep () {
+    if( __atomic_exchange_n(&wakeup, 0, __ATOMIC_ACQUIRE) )
+        return;
+    ostime64_t wake = sx127x_update();
+    if( timerArmed && timerTarget < wake )
+        wake = timerTarget;
+    if( wake == SX127X_NEVER ) {
+        fprintf(stderr, "sim: no timer armed and radio idle - nothing left to do\n");
+        exit(0);
+    }
+    u8_t t0 = vticks;
+    waitTicks64(wake);
+    idle_ticks += vticks - t0;
+    if( timerArmed && timerTarget <= (ostime64_t)hal_ticks64() )
+        timerArmed = 0;
+}
+
+// idle is simulated time spent sleeping, busy the wall clock time used
+void hal_cpuStats (u8_t* idle, u8_t* busy) {
+    *idle = idle_ticks * US_PER_OSTICK;
+    *busy = (clock_ns() - tstart_ns) / 1000;
+}
+
+// -----------------------------------------------------------------------------
+
+void hal_init () {
+    tstart_ns = clock_ns();
+    vticks = 0;
+    sx127x_reset();
+}
+
+void hal_failed (const char *file, u2_t line) {
+    fprintf(stderr, "FAILURE %s:%d\n", file, line);
+    exit(1);
+}
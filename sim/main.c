@@ -0,0 +1,295 @@
+// lmic-sim: run ABP devices against the radio model and a minimal network
+// server that answers in RX1.
+//
+//   -n N   stop after N uplinks per device (default 10)
+//   -i S   seconds between uplinks of a device (default 60)
+//   -l L   uplink payload length (default 16)
+//   -c     send confirmed uplinks (the network acks them)
+//   -d K   network sends a downlink on port 1 for every K-th uplink
+//   -s S   random seed for the radio noise (default 1)
+//   -f N   simulate a fleet of N devices (default 1), each with its own LMIC
+//          context, sending in turn since they share the radio
+//   -a     airtime aware: send as soon as the duty cycle allows, filling the
+//          frame (lmic_getTxBudget()), instead of every interval seconds
+//   -p F   keep the session of device k in file F.k (F for device 0), so that
+//          a second run resumes frame counters and duty cycle state
+//   -q K   queue K messages of len bytes per uplink with lmic_queueTx(), the
+//          first one with high priority; the LMIC packs them into frames
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "lmic.h"
+#include "sx127x.h"
+
+static const u4_t DEVADDR = 0x26011234;
+static const u1_t NWKSKEY[16] = { 0x2B,0x7E,0x15,0x16,0x28,0xAE,0xD2,0xA6,0xAB,0xF7,0x15,0x88,0x09,0xCF,0x4F,0x3C };
+static const u1_t APPSKEY[16] = { 0x3C,0x4F,0xCF,0x09,0x88,0x15,0xF7,0xAB,0xA6,0xD2,0xAE,0x28,0x16,0x15,0x7E,0x2B };
+
+// not used with ABP, but required by the LMIC core
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+static int  numUp = 10;
+static int  interval = 60;
+static int  payloadLen = 16;
+static int  confirmed;
+static int  dnEvery;
+static int  fleet = 1;
+static int  adaptive;
+static int  burst;
+
+static u4_t queuedCnt, deliveredCnt, droppedCnt;
+
+static u4_t upCnt, txCnt, ackCnt, rxCnt;
+
+// device k has address DEVADDR+k, device 0 is the default context LMIC
+static struct device {
+    lmic_ctx* ctx;
+    u4_t      seqnoDn;  // network side
+} *devices;
+static int sender;      // device sending next
+
+static osjob_t sendjob;
+
+static double simTime () {
+    return (double)os_getTime64() / OSTICKS_PER_SEC;
+}
+
+// -----------------------------------------------------------------------------
+// NETWORK
+
+// AES state of the network, separate from the one the devices use (and draw
+// their random numbers from)
+static os_aeskey_t netNwkKey, netAppKey;
+static u4_t netAux[16/sizeof(u4_t)];
+
+static u4_t frameMic (u4_t devaddr, u4_t seqno, int dndir, const u1_t* pdu, int len) {
+    u1_t* aux = (u1_t*)netAux;
+    os_clearMem(aux, 16);
+    aux[0]  = 0x49;
+    aux[5]  = dndir;
+    aux[15] = len;
+    os_wlsbf4(aux+ 6, devaddr);
+    os_wlsbf4(aux+10, seqno);
+    return os_aes_k(AES_MIC, (u1_t*)pdu, len, &netNwkKey, netAux);  // MIC only reads the frame
+}
+
+static void dnCipher (u4_t devaddr, u4_t seqnoDn, u1_t* payload, int len) {
+    u1_t* aux = (u1_t*)netAux;
+    os_clearMem(aux, 16);
+    aux[0] = aux[15] = 1;
+    aux[5] = 1;
+    os_wlsbf4(aux+ 6, devaddr);
+    os_wlsbf4(aux+10, seqnoDn);
+    os_aes_k(AES_CTR, payload, len, &netAppKey, netAux);
+}
+
+// called by the radio model for every frame the device starts to send
+static void onUplink (const struct sx127x_frame* up) {
+    u1_t ftype = up->data[OFF_DAT_HDR] & HDR_FTYPE;
+    if( ftype != HDR_FTYPE_DAUP && ftype != HDR_FTYPE_DCUP )
+        return;
+    u4_t devaddr = os_rlsbf4(up->data+OFF_DAT_ADDR);
+    if( devaddr - DEVADDR >= (u4_t)fleet )
+        return;
+    u4_t* seqnoDn = &devices[devaddr - DEVADDR].seqnoDn;
+    u2_t fcnt = os_rlsbf2(up->data+OFF_DAT_SEQNO);
+    bit_t micok = up->len >= OFF_DAT_OPTS+4 &&
+        frameMic(devaddr, fcnt, 0, up->data, up->len-4) == os_rmsbf4(up->data+up->len-4);
+    upCnt++;
+    printf("%12.3f up   ", simTime());
+    if( fleet > 1 )
+        printf("dev=%u ", devaddr - DEVADDR);
+    printf("fcnt=%u freq=%u sf=%d len=%u airtime=%.1fms%s\n",
+           fcnt, up->freq, getSf(up->rps)+6,
+           up->len, (double)osticks2us(up->end - up->start) / 1000, micok ? "" : " mic=bad");
+    if( !micok )
+        return;
+
+    bit_t ack = (ftype == HDR_FTYPE_DCUP);
+    bit_t data = (dnEvery != 0 && upCnt % dnEvery == 0);
+    if( !ack && !data )
+        return;
+
+    struct sx127x_frame dn;
+    u1_t* d = dn.data;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, devaddr);
+    d[OFF_DAT_FCT] = ack ? FCT_ACK : 0;
+    os_wlsbf2(d+OFF_DAT_SEQNO, *seqnoDn);
+    int len = OFF_DAT_OPTS;
+    if( data ) {
+        d[len++] = 1; // port
+        os_wlsbf4(d+len, upCnt);
+        dnCipher(devaddr, *seqnoDn, d+len, 4);
+        len += 4;
+    }
+    os_wmsbf4(d+len, frameMic(devaddr, *seqnoDn, 1, d, len));
+    len += 4;
+
+    // RX1: same channel and data rate, DELAY_DNW1 after the end of the uplink
+    dn.len   = len;
+    dn.freq  = up->freq;
+    dn.rps   = setNocrc(up->rps, 1);
+    dn.start = up->end + sec2osticks(DELAY_DNW1);
+    dn.end   = dn.start + calcAirTime(dn.rps, len);
+    dn.rssi  = -60;
+    dn.snr   = 8*4;
+    sx127x_inject(&dn);
+    printf("%12.3f dn   fcnt=%u ack=%d len=%d\n", (double)dn.start / OSTICKS_PER_SEC, *seqnoDn, ack, len);
+    (*seqnoDn)++;
+}
+
+// -----------------------------------------------------------------------------
+// DEVICE
+
+static void finish () {
+    u8_t idle, busy;
+    hal_cpuStats(&idle, &busy);
+    printf("uplinks=%u acked=%u downlinks=%u simtime=%.3fs cpu_busy=%.3fs\n",
+           txCnt, ackCnt, rxCnt, simTime(), (double)busy / 1e6);
+    if( burst )
+        printf("queued=%u delivered=%u dropped=%u\n", queuedCnt, deliveredCnt, droppedCnt);
+#if defined(CFG_jobstats)
+    os_dumpJobStats();
+#endif
+    exit(0);
+}
+
+static void do_send (osjob_t* j) {
+    u1_t data[MAX_LEN_PAYLOAD];
+    int len = payloadLen;
+    if( adaptive ) {
+        lmic_txbudget_t b;
+        lmic_getTxBudget(devices[sender].ctx, &b);
+        len = b.maxPayload;
+        printf("%12.3f budget txbeg=%+.3f max=%d", simTime(),
+               (double)(b.txbeg - os_getTime()) / OSTICKS_PER_SEC, b.maxPayload);
+#if defined(CFG_eu868)
+        printf(" left_ms=%.0f/%.0f/%.0f/%.0f",
+               (double)osticks2ms(b.bandLeft[0]), (double)osticks2ms(b.bandLeft[1]),
+               (double)osticks2ms(b.bandLeft[2]), (double)osticks2ms(b.bandLeft[3]));
+#endif
+        printf("\n");
+    }
+    for( int i=0; i<len; i++ )
+        data[i] = (u1_t)(txCnt + i);
+    if( !burst ) {
+        lmic_setTxData2(devices[sender].ctx, 1, data, len, confirmed);
+        return;
+    }
+    for( int k=0; k<burst; k++ ) {
+        int id = lmic_queueTx(devices[sender].ctx, 1, data, len, confirmed, k == 0);
+        if( id > 0 )
+            queuedCnt++;
+        else
+            droppedCnt++;
+    }
+}
+
+static void onMessageDone (lmic_ctx* ctx, u2_t id, u1_t txrxFlags) {
+    if( txrxFlags & (TXRX_DROP|TXRX_NACK) )
+        droppedCnt++;
+    else
+        deliveredCnt++;
+}
+
+static void onDeviceEvent (lmic_ctx* ctx, ev_t ev) {
+    switch( ev ) {
+    case EV_TXCOMPLETE:
+        txCnt++;
+        if( ctx->txrxFlags & TXRX_ACK )
+            ackCnt++;
+        if( ctx->dataLen )
+            rxCnt++;
+        printf("%12.3f done flags=0x%02x rx=%u\n", simTime(), ctx->txrxFlags, ctx->dataLen);
+        if( (int)txCnt >= numUp * fleet )
+            finish();
+        // the devices take turns, each one sends every interval seconds
+        sender = (sender + 1) % fleet;
+        if( adaptive ) {
+            lmic_txbudget_t b;
+            lmic_getTxBudget(devices[sender].ctx, &b);
+            os_setTimedCallback(&sendjob, b.txbeg, do_send);
+        } else {
+            os_setTimedCallback(&sendjob, os_getTime() + sec2osticks(interval) / fleet, do_send);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void onEvent (ev_t ev) {
+    onDeviceEvent(&LMIC, ev);
+}
+
+int main (int argc, char** argv) {
+    int opt;
+    unsigned seed = 1;
+    const char* store = NULL;
+    while( (opt = getopt(argc, argv, "n:i:l:cd:s:f:ap:q:")) != -1 ) {
+        switch( opt ) {
+        case 'n': numUp = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'l': payloadLen = atoi(optarg); break;
+        case 'c': confirmed = 1; break;
+        case 'd': dnEvery = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 'f': fleet = atoi(optarg); break;
+        case 'a': adaptive = 1; break;
+        case 'p': store = optarg; break;
+        case 'q': burst = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n uplinks] [-i interval] [-l len] [-c] [-d every] [-s seed] [-f devices] [-a] [-p file] [-q msgs]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( payloadLen < 0 || payloadLen > MAX_LEN_PAYLOAD ) {
+        fprintf(stderr, "payload length must be 0..%d\n", MAX_LEN_PAYLOAD);
+        return 1;
+    }
+    if( fleet < 1 ) {
+        fprintf(stderr, "fleet size must be at least 1\n");
+        return 1;
+    }
+    srand(seed);
+    sx127x_onTx(onUplink);
+    os_aesKey(&netNwkKey, NWKSKEY);
+    os_aesKey(&netAppKey, APPSKEY);
+
+    os_init();
+#if defined(CFG_jobstats)
+    os_setJobName(do_send, "do_send");
+#endif
+    devices = (struct device*)calloc(fleet, sizeof(struct device));
+    for( int k=0; k<fleet; k++ ) {
+        lmic_ctx* ctx = k == 0 ? &LMIC : (lmic_ctx*)calloc(1, sizeof(lmic_ctx));
+        devices[k].ctx = ctx;
+        if( k > 0 )
+            lmic_init(ctx);
+        lmic_setEventCallback(ctx, onDeviceEvent);
+        lmic_setTxCallback(ctx, onMessageDone);
+        if( store ) {
+            char path[256];
+            snprintf(path, sizeof(path), k == 0 ? "%s" : "%s.%d", store, k);
+            if( lmic_openStore(ctx, path) < 0 ) {
+                perror(path);
+                return 1;
+            }
+        }
+        lmic_reset(ctx);
+        lmic_setSession(ctx, 0x1, DEVADDR + k, (u1_t*)NWKSKEY, (u1_t*)APPSKEY);
+        devices[k].seqnoDn = ctx->seqnoDn;  // the network keeps its counters too
+        lmic_setAdrMode(ctx, 0);
+        lmic_setLinkCheckMode(ctx, 0);
+        lmic_disableTracking(ctx);
+        lmic_stopPingable(ctx);
+        lmic_setDrTxpow(ctx, DR_SF7, 14);
+    }
+
+    os_setCallback(&sendjob, do_send);
+    os_runloop();
+    return 0;
+}
@@ -0,0 +1,463 @@
+// Software model of the SX1272/SX1276 radio as seen through its SPI register
+// interface.
+//
+// Emulated: the register map (with the per-modem banks at 0x0D-0x3F), the
+// LoRa FIFO with its address pointers, the FSK FIFO, the op-mode state
+// machine (LongRangeMode only switchable in SLEEP, TX and single RX falling
+// back to STANDBY), IRQ flags (LoRa write-1-to-clear, masked by
+// RegIrqFlagsMask) and the DIO0..DIO2 mapping. Transmissions last
+// calcAirTime() of the configured rps/length. Receptions pick up frames
+// injected with sx127x_inject() that match frequency, SF and BW and start
+// while the receiver is listening. RegRssiWideband returns random noise so
+// radio_init() can seed its random generator.
+
+#include <stdlib.h>
+#include "sx127x.h"
+
+#define RegFifo                    0x00
+#define RegOpMode                  0x01
+#define RegFrfMsb                  0x06
+#define RegFrfMid                  0x07
+#define RegFrfLsb                  0x08
+#define RegPaConfig                0x09
+#define RegPaRamp                  0x0A
+#define RegOcp                     0x0B
+#define RegLna                     0x0C
+#define LORARegFifoAddrPtr         0x0D
+#define LORARegFifoTxBaseAddr      0x0E
+#define LORARegFifoRxBaseAddr      0x0F
+#define LORARegFifoRxCurrentAddr   0x10
+#define LORARegIrqFlagsMask        0x11
+#define LORARegIrqFlags            0x12
+#define LORARegRxNbBytes           0x13
+#define LORARegPktSnrValue         0x19
+#define LORARegPktRssiValue        0x1A
+#define LORARegRssiValue           0x1B
+#define LORARegModemConfig1        0x1D
+#define LORARegModemConfig2        0x1E
+#define LORARegSymbTimeoutLsb      0x1F
+#define LORARegPreambleLsb         0x21
+#define LORARegPayloadLength       0x22
+#define LORARegPayloadMaxLength    0x23
+#define LORARegModemConfig3        0x26
+#define LORARegRssiWideband        0x2C
+#define LORARegDetectOptimize      0x31
+#define LORARegInvertIQ            0x33
+#define LORARegDetectionThreshold  0x37
+#define LORARegSyncWord            0x39
+#define FSKRegRssiValue            0x11
+#define FSKRegRxTimeout2           0x21
+#define FSKRegPayloadLength        0x32
+#define FSKRegImageCal             0x3B
+#define FSKRegIrqFlags1            0x3E
+#define FSKRegIrqFlags2            0x3F
+#define RegDioMapping1             0x40
+#define RegVersion                 0x42
+
+#define OPMODE_LORA      0x80
+#define OPMODE_MASK      0x07
+#define OPMODE_SLEEP     0x00
+#define OPMODE_STANDBY   0x01
+#define OPMODE_TX        0x03
+#define OPMODE_RX        0x05
+#define OPMODE_RX_SINGLE 0x06
+
+#define IRQ_LORA_RXTOUT_MASK 0x80
+#define IRQ_LORA_RXDONE_MASK 0x40
+#define IRQ_LORA_TXDONE_MASK 0x08
+#define IRQ_LORA_CDDONE_MASK 0x04
+#define IRQ_LORA_FHSSCH_MASK 0x02
+#define IRQ_LORA_CDDETD_MASK 0x01
+
+#define IRQ_FSK1_TIMEOUT_MASK       0x04
+#define IRQ_FSK2_PACKETSENT_MASK    0x08
+#define IRQ_FSK2_PAYLOADREADY_MASK  0x04
+#define IRQ_FSK2_CRCOK_MASK         0x02
+
+enum { EV_NONE, EV_TXDONE, EV_RXDONE, EV_RXTOUT };
+
+enum { MAX_AIR = 16 };
+
+static u1_t common[0x80];      // registers outside the banked range
+static u1_t bank[2][0x40];     // 0x0D-0x3F: [0]=FSK, [1]=LoRa
+static u1_t fifo[256];
+static u1_t fskwr, fskrd;      // FSK FIFO write/read positions
+
+static u1_t       evkind;      // pending internal event
+static ostime64_t evtime;
+static bit_t      listening;   // receiver waiting for a frame
+static ostime64_t rxopened;    // ... since this time
+static ostime64_t lastrise;    // time of the last event that raised a flag
+
+static struct sx127x_frame txframe;
+static struct sx127x_frame rxframe;
+static struct sx127x_frame air[MAX_AIR];
+static u1_t nair;
+
+static void (*txhook) (const struct sx127x_frame* f);
+
+
+static bit_t isLora () {
+    return (common[RegOpMode] & OPMODE_LORA) != 0;
+}
+
+static u1_t* reg (u1_t addr) {
+    if( addr >= 0x0D && addr <= 0x3F )
+        return &bank[isLora()][addr];
+    return &common[addr];
+}
+
+static u4_t frequency () {
+    u4_t frf = ((u4_t)common[RegFrfMsb] << 16) | ((u4_t)common[RegFrfMid] << 8) | common[RegFrfLsb];
+    return (u4_t)(((u8_t)frf * 32000000) >> 19);
+}
+
+// decode the LoRa modem configuration back into LMIC radio parameters
+static rps_t loraRps () {
+    u1_t mc1 = bank[1][LORARegModemConfig1];
+    u1_t mc2 = bank[1][LORARegModemConfig2];
+    int sf = (mc2 >> 4) - 6;
+#ifdef CFG_sx1276_radio
+    int bw = (mc1 >> 4) - 7;
+    int cr = ((mc1 >> 1) & 7) - 1;
+    int ih = mc1 & 0x01;
+    int nocrc = (mc2 & 0x04) == 0;
+#else
+    int bw = mc1 >> 6;
+    int cr = ((mc1 >> 3) & 7) - 1;
+    int ih = mc1 & 0x04;
+    int nocrc = (mc1 & 0x02) == 0;
+#endif
+    if( sf < SF7 || sf > SF12 )
+        sf = SFrfu;
+    if( bw < BW125 || bw > BW500 )
+        bw = BWrfu;
+    if( cr < CR_4_5 || cr > CR_4_8 )
+        cr = CR_4_5;
+    return makeRps((sf_t)sf, (bw_t)bw, (cr_t)cr, ih ? bank[1][LORARegPayloadLength] : 0, nocrc);
+}
+
+// LoRa symbol time in ticks
+static ostime_t symTime (rps_t rps) {
+    s8_t bwhz = 125000 << (getBw(rps) == BWrfu ? 0 : getBw(rps));
+    return (ostime_t)(((s8_t)1 << (getSf(rps) + 6)) * OSTICKS_PER_SEC / bwhz);
+}
+
+static void raiseLora (u1_t mask, ostime64_t t) {
+    if( (bank[1][LORARegIrqFlagsMask] & mask) == 0 ) {
+        bank[1][LORARegIrqFlags] |= mask;
+        lastrise = t;
+    }
+}
+
+static void raiseFsk (u1_t r, u1_t mask, ostime64_t t) {
+    bank[0][r] |= mask;
+    lastrise = t;
+}
+
+static void setEvent (u1_t kind, ostime64_t t) {
+    evkind = kind;
+    evtime = t;
+}
+
+// find a frame on air the receiver can lock onto when listening from 'from'
+// (preamble not yet over) until 'until' (symbol/preamble timeout)
+static int findFrame (rps_t rps, ostime64_t from, ostime64_t until) {
+    u4_t freq = frequency();
+    int best = -1;
+    for( int i=0; i<nair; i++ ) {
+        struct sx127x_frame* f = &air[i];
+        s4_t df = (s4_t)(f->freq - freq);
+        if( df < -100 || df > 100 )
+            continue;
+        if( getSf(rps) == FSK ) {
+            if( getSf(f->rps) != FSK )
+                continue;
+        } else if( !sameSfBw(f->rps, rps) ) {
+            continue;
+        }
+        if( f->start < from || f->start > until )
+            continue;
+        if( best < 0 || f->start < air[best].start )
+            best = i;
+    }
+    return best;
+}
+
+static void startTx (ostime64_t now) {
+    struct sx127x_frame* f = &txframe;
+    if( isLora() ) {
+        u1_t base = bank[1][LORARegFifoTxBaseAddr];
+        f->len = bank[1][LORARegPayloadLength];
+        for( int i=0; i<f->len; i++ )
+            f->data[i] = fifo[(u1_t)(base+i)];
+        f->rps = loraRps();
+    } else {
+        // variable length packet: length byte followed by the payload
+        f->len = fifo[0];
+        for( int i=0; i<f->len; i++ )
+            f->data[i] = fifo[1+i];
+        f->rps = makeRps(FSK, BW125, CR_4_5, 0, 0);
+    }
+    f->freq = frequency();
+    f->start = now;
+    f->end = now + calcAirTime(f->rps, f->len);
+    f->rssi = f->snr = 0;
+    setEvent(EV_TXDONE, f->end);
+    if( txhook )
+        txhook(f);
+}
+
+// look for a frame to receive; for continuous RX this is repeated on every
+// update until one shows up
+static void listen () {
+    ostime64_t opened = rxopened;
+    u1_t mode = common[RegOpMode] & OPMODE_MASK;
+    if( isLora() ) {
+        rps_t rps = loraRps();
+        if( getSf(rps) == SFrfu || getBw(rps) == BWrfu )
+            return; // e.g. RSSI sampling - nothing to decode
+        ostime_t tsym = symTime(rps);
+        ostime64_t until = SX127X_NEVER;
+        if( mode == OPMODE_RX_SINGLE ) {
+            u2_t syms = ((bank[1][LORARegModemConfig2] & 0x03) << 8) | bank[1][LORARegSymbTimeoutLsb];
+            until = opened + (ostime64_t)syms * tsym;
+        }
+        int i = findFrame(rps, opened - 4*tsym, until);
+        if( i >= 0 ) {
+            rxframe = air[i];
+            setEvent(EV_RXDONE, rxframe.end);
+        } else if( until != SX127X_NEVER ) {
+            setEvent(EV_RXTOUT, until);
+        }
+    } else {
+        rps_t rps = makeRps(FSK, BW125, CR_4_5, 0, 0);
+        // preamble timeout in units of 16 bits at 50kbps
+        ostime64_t until = bank[0][FSKRegRxTimeout2] == 0 ? SX127X_NEVER
+            : opened + us2osticks(bank[0][FSKRegRxTimeout2] * 320);
+        int i = findFrame(rps, opened - us2osticks(480), until);
+        if( i >= 0 ) {
+            rxframe = air[i];
+            setEvent(EV_RXDONE, rxframe.end);
+        } else if( until != SX127X_NEVER ) {
+            setEvent(EV_RXTOUT, until);
+        }
+    }
+}
+
+static void writeOpMode (u1_t val) {
+    u1_t old = common[RegOpMode];
+    if( ((old ^ val) & OPMODE_LORA) != 0 && (old & OPMODE_MASK) != OPMODE_SLEEP )
+        val = (val & ~OPMODE_LORA) | (old & OPMODE_LORA); // LongRangeMode is only writable in SLEEP
+    common[RegOpMode] = val;
+    if( ((old ^ val) & (OPMODE_LORA|OPMODE_MASK)) == 0 )
+        return; // no mode change
+    ostime64_t now = hal_ticks64();
+    setEvent(EV_NONE, SX127X_NEVER);
+    listening = 0;
+    switch( val & OPMODE_MASK ) {
+    case OPMODE_SLEEP:
+        fskwr = fskrd = 0;
+        bank[0][FSKRegIrqFlags1] = bank[0][FSKRegIrqFlags2] = 0;
+        break;
+    case OPMODE_TX:
+        startTx(now);
+        break;
+    case OPMODE_RX:
+    case OPMODE_RX_SINGLE:
+        rxopened = now;
+        listening = 1;
+        listen();
+        break;
+    }
+}
+
+static void toStandby () {
+    common[RegOpMode] = (common[RegOpMode] & ~OPMODE_MASK) | OPMODE_STANDBY;
+    listening = 0;
+}
+
+static void rxDone (ostime64_t t) {
+    struct sx127x_frame* f = &rxframe;
+    if( isLora() ) {
+        u1_t base = bank[1][LORARegFifoRxBaseAddr];
+        for( int i=0; i<f->len; i++ )
+            fifo[(u1_t)(base+i)] = f->data[i];
+        bank[1][LORARegFifoRxCurrentAddr] = base;
+        bank[1][LORARegRxNbBytes] = f->len;
+        bank[1][LORARegPktSnrValue] = (u1_t)f->snr;
+        bank[1][LORARegPktRssiValue] = (u1_t)(f->rssi + 157);
+        raiseLora(IRQ_LORA_RXDONE_MASK, t);
+        if( (common[RegOpMode] & OPMODE_MASK) == OPMODE_RX_SINGLE )
+            toStandby();
+        else
+            rxopened = t; // continuous RX: look for the next frame
+    } else {
+        for( int i=0; i<f->len; i++ )
+            fifo[i] = f->data[i];
+        fskrd = 0;
+        fskwr = f->len;
+        bank[0][FSKRegPayloadLength] = f->len;
+        raiseFsk(FSKRegIrqFlags2, IRQ_FSK2_PAYLOADREADY_MASK|IRQ_FSK2_CRCOK_MASK, t);
+        listening = 0;
+    }
+}
+
+void sx127x_reset () {
+    memset(common, 0, sizeof(common));
+    memset(bank, 0, sizeof(bank));
+    memset(fifo, 0, sizeof(fifo));
+    fskwr = fskrd = 0;
+    setEvent(EV_NONE, SX127X_NEVER);
+    listening = 0;
+    lastrise = 0;
+#ifdef CFG_sx1276_radio
+    common[RegOpMode]    = 0x09; // FSK, STANDBY, low frequency mode
+    common[RegVersion]   = 0x12;
+    bank[1][LORARegModemConfig1] = 0x72;
+#else
+    common[RegOpMode]    = 0x01; // FSK, STANDBY
+    common[RegVersion]   = 0x22;
+    bank[1][LORARegModemConfig1] = 0x08;
+#endif
+    common[RegFrfMsb]    = 0x6C;
+    common[RegFrfMid]    = 0x80;
+    common[RegPaConfig]  = 0x4F;
+    common[RegPaRamp]    = 0x09;
+    common[RegOcp]       = 0x2B;
+    common[RegLna]       = 0x20;
+    bank[1][LORARegFifoTxBaseAddr]     = 0x80;
+    bank[1][LORARegModemConfig2]       = 0x70;
+    bank[1][LORARegSymbTimeoutLsb]     = 0x64;
+    bank[1][LORARegPreambleLsb]        = 0x08;
+    bank[1][LORARegPayloadLength]      = 0x01;
+    bank[1][LORARegPayloadMaxLength]   = 0xFF;
+    bank[1][LORARegModemConfig3]       = 0x04;
+    bank[1][LORARegDetectOptimize]     = 0xC3;
+    bank[1][LORARegInvertIQ]           = 0x27;
+    bank[1][LORARegDetectionThreshold] = 0x0A;
+    bank[1][LORARegSyncWord]           = 0x12;
+    bank[0][FSKRegImageCal]            = 0x82;
+}
+
+u1_t sx127x_reg (u1_t addr, u1_t data) {
+    u1_t a = addr & 0x7F;
+    if( addr & 0x80 ) { // write
+        u1_t old = *reg(a);
+        if( a == RegFifo ) {
+            if( isLora() )
+                fifo[bank[1][LORARegFifoAddrPtr]++] = data;
+            else
+                fifo[fskwr++] = data;
+        } else if( a == RegOpMode ) {
+            writeOpMode(data);
+        } else if( a == RegVersion ) {
+            // read-only
+        } else if( isLora() && a == LORARegIrqFlags ) {
+            bank[1][LORARegIrqFlags] &= ~data; // write 1 to clear
+        } else if( !isLora() && (a == FSKRegIrqFlags1 || a == FSKRegIrqFlags2) ) {
+            // status only
+        } else {
+            *reg(a) = data;
+        }
+        return old;
+    }
+    // read
+    if( a == RegFifo )
+        return isLora() ? fifo[bank[1][LORARegFifoAddrPtr]++] : fifo[fskrd++];
+    if( isLora() && a == LORARegRssiWideband )
+        return (u1_t)rand();
+    if( isLora() && a == LORARegRssiValue )
+        return (u1_t)(20 + rand() % 8);
+    if( !isLora() && a == FSKRegRssiValue )
+        return (u1_t)(200 + rand() % 16);
+    return *reg(a);
+}
+
+void sx127x_burst (u1_t addr, u1_t* buf, u1_t len, u1_t dir) {
+    for( int i=0; i<len; i++ ) {
+        if( dir )
+            sx127x_reg(addr | 0x80, buf[i]);
+        else
+            buf[i] = sx127x_reg(addr & 0x7F, 0x00);
+    }
+}
+
+ostime64_t sx127x_update () {
+    ostime64_t now = hal_ticks64();
+    if( evkind != EV_NONE && evtime <= now ) {
+        ostime64_t t = evtime;
+        u1_t kind = evkind;
+        setEvent(EV_NONE, SX127X_NEVER);
+        switch( kind ) {
+        case EV_TXDONE:
+            if( isLora() )
+                raiseLora(IRQ_LORA_TXDONE_MASK, t);
+            else
+                raiseFsk(FSKRegIrqFlags2, IRQ_FSK2_PACKETSENT_MASK, t);
+            fskwr = fskrd = 0;
+            toStandby();
+            break;
+        case EV_RXDONE:
+            rxDone(t);
+            break;
+        case EV_RXTOUT:
+            if( isLora() ) {
+                raiseLora(IRQ_LORA_RXTOUT_MASK, t);
+                toStandby();
+            } else {
+                raiseFsk(FSKRegIrqFlags1, IRQ_FSK1_TIMEOUT_MASK, t);
+                listening = 0;
+            }
+            break;
+        }
+    }
+    // drop frames that are completely over
+    for( int i=0; i<nair; ) {
+        if( air[i].end < now ) {
+            air[i] = air[--nair];
+        } else {
+            i++;
+        }
+    }
+    // continuous RX keeps listening for new frames
+    if( evkind == EV_NONE && listening )
+        listen();
+    return evtime;
+}
+
+u1_t sx127x_dio (ostime64_t* changed) {
+    u1_t map = common[RegDioMapping1];
+    u1_t lv = 0;
+    if( isLora() ) {
+        u1_t f = bank[1][LORARegIrqFlags];
+        static const u1_t dio0[4] = { IRQ_LORA_RXDONE_MASK, IRQ_LORA_TXDONE_MASK, IRQ_LORA_CDDONE_MASK, 0 };
+        static const u1_t dio1[4] = { IRQ_LORA_RXTOUT_MASK, IRQ_LORA_FHSSCH_MASK, IRQ_LORA_CDDETD_MASK, 0 };
+        static const u1_t dio2[4] = { IRQ_LORA_FHSSCH_MASK, IRQ_LORA_FHSSCH_MASK, IRQ_LORA_FHSSCH_MASK, 0 };
+        if( f & dio0[(map>>6)&3] ) lv |= 1;
+        if( f & dio1[(map>>4)&3] ) lv |= 2;
+        if( f & dio2[(map>>2)&3] ) lv |= 4;
+    } else {
+        // packet mode; FIFO level lines are not modelled
+        u1_t f1 = bank[0][FSKRegIrqFlags1];
+        u1_t f2 = bank[0][FSKRegIrqFlags2];
+        if( ((map>>6)&3) == 0 && (f2 & (IRQ_FSK2_PACKETSENT_MASK|IRQ_FSK2_PAYLOADREADY_MASK)) ) lv |= 1;
+        if( ((map>>6)&3) == 1 && (f2 & IRQ_FSK2_CRCOK_MASK) ) lv |= 1;
+        if( ((map>>2)&3) == 2 && (f1 & IRQ_FSK1_TIMEOUT_MASK) ) lv |= 4;
+    }
+    if( changed )
+        *changed = lastrise;
+    return lv;
+}
+
+void sx127x_onTx (void (*cb) (const struct sx127x_frame* f)) {
+    txhook = cb;
+}
+
+void sx127x_inject (const struct sx127x_frame* f) {
+    if( nair == MAX_AIR ) {
+        fprintf(stderr, "sx127x: too many frames on air, dropping one\n");
+        return;
+    }
+    air[nair++] = *f;
+}
@@ -0,0 +1,61 @@
+// Software model of the SX1272/SX1276 radio as seen through its SPI register
+// interface. Used by the simulation HAL (hal_sim.c) in place of real hardware.
+
+#ifndef _sx127x_h_
+#define _sx127x_h_
+
+#include "lmic.h"
+
+#define SX127X_NEVER ((ostime64_t)0x7FFFFFFFFFFFFFFFLL)
+
+// frame on air (sent by the radio or injected for reception)
+struct sx127x_frame {
+    ostime64_t start;   // begin of preamble
+    ostime64_t end;     // end of last symbol
+    u4_t       freq;    // carrier frequency in Hz
+    rps_t      rps;     // sf/bw/cr (sf=FSK for FSK frames)
+    s1_t       rssi;    // packet RSSI in dBm (rx only)
+    s1_t       snr;     // SNR in dB*4 (rx only)
+    u1_t       len;
+    u1_t       data[256];
+};
+
+/*
+ * put all registers, FIFO and pending events back to power-on state.
+ */
+void sx127x_reset (void);
+
+/*
+ * 2-byte register transaction (addr bit 7 set = write), return the byte
+ * clocked out during the data phase.
+ */
+u1_t sx127x_reg (u1_t addr, u1_t data);
+
+/*
+ * burst transaction (dir=1: write buf to addr, dir=0: read addr into buf).
+ */
+void sx127x_burst (u1_t addr, u1_t* buf, u1_t len, u1_t dir);
+
+/*
+ * advance the radio state machine to the current time and return the time
+ * of its next internal event (SX127X_NEVER if none is pending).
+ */
+ostime64_t sx127x_update (void);
+
+/*
+ * return the DIO0..DIO2 line levels (bit n = DIOn) and the time of the
+ * last level change.
+ */
+u1_t sx127x_dio (ostime64_t* changed);
+
+/*
+ * register a callback invoked for every frame the radio starts to transmit.
+ */
+void sx127x_onTx (void (*cb) (const struct sx127x_frame* f));
+
+/*
+ * queue a frame on air for reception (start/end must be set).
+ */
+void sx127x_inject (const struct sx127x_frame* f);
+
+#endif // _sx127x_h_
@@ -45,6 +45,8 @@ using namespace std;
 string filenameLorawanConfig = "/boot/d0logging/lorawan.conf";
 string filenameLastReadingPath = "/boot/d0logging/lastreadingpath.conf";
 string pathLastReading;
+//Session store, keeps frame counters and duty cycle state across restarts
+string filenameSession = "/boot/d0logging/lorawan.session";
 
 //MeterID
 string meterId;
@@ -210,7 +212,6 @@ void os_getDevKey(u1_t *buf)
 }
 
 u4_t cntr=0;
-u1_t mydata[100];
 static osjob_t sendjob;
 
 // Pin mapping
@@ -242,43 +243,50 @@ void onEvent(ev_t ev)
   }
 }
 
+// id of the queued reading, -1 once it has been sent or dropped
+static int pendingId = -1;
+
+// called when the frame carrying a queued message is done
+static void onMessageDone(lmic_ctx *ctx, u2_t id, u1_t txrxFlags)
+{
+  if (id != pendingId)
+    return;
+  if (txrxFlags & TXRX_DROP)
+    fprintf(stdout, "reading dropped\n");
+  pendingId = -1;
+}
+
 static void do_send(osjob_t *j)
 {
   time_t t = time(NULL);
   fprintf(stdout, "[%x] (%ld) %s\n", hal_ticks(), t, ctime(&t));
-  // Show TX channel (channel numbers are local to LMIC)
-  // Check if there is not a current TX/RX job running
-  if (LMIC.opmode & (1 << 7))
+  u8_t idle, busy;
+  hal_cpuStats(&idle, &busy);
+  fprintf(stdout, "cpu: idle %llu ms, busy %llu ms\n", (unsigned long long)idle/1000, (unsigned long long)busy/1000);
+  // Queue the reading, newline-terminated so that several readings can share a frame
+  loraData = "";
+
+  loraData.append(meterSerial);
+  loraData.append(",");
+  loraData.append(obisSelection);
+  loraData.append(",");
+  loraData.append(obisUnit);
+  loraData.append(",");
+  loraData.append(obisValue);
+  loraData.append("\n");
+
+  pendingId = LMIC_queueTx(1, (const u1_t *)loraData.data(), loraData.size(), 0, 0);
+  if (pendingId < 0)
   {
-    fprintf(stdout, "OP_TXRXPEND, not sending");
-  }
-  else
-  {
-    // Prepare upstream data transmission at the next possible time.
-    loraData = "";
-
-    loraData.append(meterSerial);
-    loraData.append(",");
-    loraData.append(obisSelection);
-    loraData.append(",");
-    loraData.append(obisUnit);
-    loraData.append(",");
-    loraData.append(obisValue);
-
-    char buf[100];
-    loraData.copy(buf, loraData.size() + 1);
-
-    int i = 0;
-    while (buf[i])
-    {
-      mydata[i] = buf[i];
-      i++;
-    }
-    mydata[i] = '\0';
-    LMIC_setTxData2(1, mydata, strlen(buf), 0);
+    fprintf(stdout, "uplink queue %s, reading dropped\n", pendingId == -1 ? "full" : "frame too small");
+    pendingId = -1;
+    return;
   }
-  // Schedule a timed job to run at the given timestamp (absolute system time)
-  os_setTimedCallback(j, os_getTime() + sec2osticks(20), do_send);
+  // The stored duty cycle state may hold the frame back for a while
+  lmic_txbudget_t budget;
+  LMIC_getTxBudget(&budget);
+  if (budget.txbeg - os_getTime() > 0)
+    fprintf(stdout, "duty cycle: sending in %d s\n", osticks2ms(budget.txbeg - os_getTime()) / 1000);
 }
 
 void setup()
@@ -290,10 +298,17 @@ void setup()
   readD0LastReadoutPath();
 
   os_init();
-  // Reset the MAC state. Session and pending data transfers will be discarded.
+#if defined(CFG_jobstats)
+  os_setJobName(do_send, "do_send");
+#endif
+  // Resume frame counters, channels and duty cycle state of the last run
+  if (LMIC_openStore(filenameSession.c_str()) < 0)
+    perror(filenameSession.c_str());
+  // Reset the MAC state. Pending data transfers will be discarded.
   LMIC_reset();
   // Set static session parameters. Instead of dynamically establishing a session
   // by joining the network, precomputed session parameters are be provided.
+  // The stored state is kept if it belongs to this session.
   LMIC_setSession(0x1, DEVADDR, (u1_t *)DEVKEY, (u1_t *)ARTKEY);
   // Disable data rate adaptation
   LMIC_setAdrMode(0);
@@ -305,7 +320,8 @@ void setup()
   LMIC_stopPingable();
   // Set data rate and transmit power (note: txpow seems to be ignored by the library)
   LMIC_setDrTxpow(DR_SF7, 14);
-  //
+  // Get told when the queued reading is done
+  lmic_setTxCallback(&LMIC, onMessageDone);
 
 }
 
@@ -315,7 +331,11 @@ int main()
 
   getLastReading();
 
+  // One reading per run: queue it and run the MAC until its frame has been
+  // sent and the receive windows are over
   do_send(&sendjob);
+  while (pendingId >= 0)
+    os_runloop_once();
 
   return 0;
 }
\ No newline at end of file